@@ -0,0 +1,141 @@
+#!/usr/bin/env bash
+#
+# End-to-end C1M benchmark over loopback.
+#
+# Builds server.c and client.c, starts the server, then drives it with the
+# load client through a fixed matrix:
+#
+#   ramp   idle connections up to TARGET_CONNS, spread over SOURCES loopback addresses
+#   echo   ECHO_CONNS connections echoing at each size in ECHO_SIZES
+#   churn  CHURN_CONNS connections, each closed and reopened after CHURN_TRIPS round trips
+#
+# For every phase it records client throughput and latency percentiles, the
+# server's accepts/s and msgs/s, server RSS, server CPU and per-core CPU use,
+# and writes everything to REPORT as JSON.
+#
+# Usage: ./bench.sh            (run as root for ulimit/sysctl headroom)
+#        TARGET_CONNS=100000 PHASE_SECONDS=5 ./bench.sh
+
+set -u
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+
+BUILD_DIR="${BUILD_DIR:-$HERE/_bench}"
+REPORT="${REPORT:-$BUILD_DIR/c1m_report.json}"
+PORT="${PORT:-2000}"
+PORTS="${PORTS:-20}"
+SOURCES="${SOURCES:-20}"
+TARGET_CONNS="${TARGET_CONNS:-1000000}"
+RAMP_RATE="${RAMP_RATE:-50000}"
+RAMP_TIMEOUT="${RAMP_TIMEOUT:-300}"
+ECHO_CONNS="${ECHO_CONNS:-10000}"
+ECHO_SIZES="${ECHO_SIZES:-64 512 1024}"
+CHURN_CONNS="${CHURN_CONNS:-10000}"
+CHURN_TRIPS="${CHURN_TRIPS:-10}"
+PHASE_SECONDS="${PHASE_SECONDS:-10}"
+
+mkdir -p "$BUILD_DIR"
+
+# server.c keeps a 1M entry connection table in .bss, hence -mcmodel=medium
+gcc -O2 -mcmodel=medium -o "$BUILD_DIR/server" "$HERE/server.c" || exit 1
+gcc -O2 -o "$BUILD_DIR/client" "$HERE/client.c" -lcrypto || exit 1
+
+# every connection costs one fd on each side
+ulimit -n $((TARGET_CONNS + 4096)) 2>/dev/null || \
+    echo "warning: cannot raise open files limit to $((TARGET_CONNS + 4096)), ramp will stop at $(ulimit -n)"
+if [ "$(id -u)" = "0" ]; then
+    sysctl -q -w fs.file-max=$((TARGET_CONNS * 3)) fs.nr_open=$((TARGET_CONNS * 2)) \
+        net.ipv4.ip_local_port_range="1024 65535" net.core.somaxconn=65535 \
+        net.ipv4.tcp_max_syn_backlog=65535 net.ipv4.tcp_tw_reuse=1 2>/dev/null
+fi
+
+SOURCE_LIST=""
+for i in $(seq 1 "$SOURCES"); do
+    SOURCE_LIST="${SOURCE_LIST:+$SOURCE_LIST,}127.0.0.$((i + 1))"
+done
+
+SERVER_LOG="$BUILD_DIR/server.log"
+"$BUILD_DIR/server" > "$SERVER_LOG" 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+
+CLK_TCK=$(getconf CLK_TCK)
+NCPU=$(grep -c '^cpu[0-9]' /proc/stat)
+
+# "busy total" per core, one line each
+cpu_snapshot() {
+    awk '/^cpu[0-9]/ { busy = $2 + $3 + $4 + $7 + $8; print busy, busy + $5 + $6 }' /proc/stat
+}
+
+server_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$SERVER_PID/stat"
+}
+
+server_rss_kb() {
+    awk '/^VmRSS:/ { print $2 }' "/proc/$SERVER_PID/status"
+}
+
+# average of the server's per-second "stats:" lines after the given line number
+server_rates() {
+    tail -n +"$1" "$SERVER_LOG" | awk -F'[:,]' '/^stats:/ { n++; a += $5; m += $7 }
+        END { if (n) printf "%.0f %.0f", a / n, m / n; else printf "0 0" }'
+}
+
+PHASES=""
+
+run_phase() {
+    local name="$1"; shift
+
+    local log_start cpu_before ticks_before t_before
+    log_start=$(( $(wc -l < "$SERVER_LOG") + 1 ))
+    cpu_before="$(cpu_snapshot)"
+    ticks_before=$(server_ticks)
+    t_before=$(date +%s.%N)
+
+    echo "== $name: client $*"
+    local out
+    out="$("$BUILD_DIR/client" 127.0.0.1 "$PORT" -p "$PORTS" -a "$SOURCE_LIST" -j "$@" | tee /dev/stderr | grep '^{')"
+
+    local t_after ticks_after cpu_after rss rates
+    t_after=$(date +%s.%N)
+    ticks_after=$(server_ticks)
+    cpu_after="$(cpu_snapshot)"
+    rss=$(server_rss_kb)
+    rates=($(server_rates "$log_start"))
+
+    local elapsed server_cpu per_core
+    elapsed=$(awk -v a="$t_after" -v b="$t_before" 'BEGIN { print a - b }')
+    server_cpu=$(awk -v d=$((ticks_after - ticks_before)) -v hz="$CLK_TCK" -v e="$elapsed" 'BEGIN { print d * 100 / hz / e }')
+    per_core=$(paste -d' ' <(echo "$cpu_before") <(echo "$cpu_after") | awk '
+        { d = $4 - $2; printf "%s%.1f", (NR > 1 ? ", " : ""), (d > 0 ? ($3 - $1) * 100 / d : 0) }')
+
+    [ -z "$out" ] && out="null"
+    local phase
+    phase=$(printf '{"name": "%s", "client": %s, "server": {"accepts_per_sec": %s, "msgs_per_sec": %s, "rss_kb": %s, "cpu_percent": %.1f, "cpu_per_core_percent": [%s]}}' \
+        "$name" "$out" "${rates[0]}" "${rates[1]}" "${rss:-0}" "$server_cpu" "$per_core")
+    PHASES="${PHASES:+$PHASES,
+    }$phase"
+}
+
+run_phase "ramp" -i -c "$TARGET_CONNS" -r "$RAMP_RATE" -d "$RAMP_TIMEOUT"
+
+for size in $ECHO_SIZES; do
+    run_phase "echo_$size" -c "$ECHO_CONNS" -r "$RAMP_RATE" -s "$size" -d "$PHASE_SECONDS"
+done
+
+run_phase "churn" -c "$CHURN_CONNS" -r "$RAMP_RATE" -k "$CHURN_TRIPS" -d "$PHASE_SECONDS"
+
+cat > "$REPORT" <<EOF
+{
+  "host": "$(hostname)",
+  "kernel": "$(uname -r)",
+  "cpus": $NCPU,
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "phases": [
+    $PHASES
+  ]
+}
+EOF
+
+echo "report written to $REPORT"
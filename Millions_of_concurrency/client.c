@@ -1,159 +1,693 @@
-
-
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/epoll.h>
-#include <errno.h>
-#include <netinet/tcp.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <unistd.h>
-
-#define MAX_BUFFER		128
-#define MAX_EPOLLSIZE	(384*1024)
-#define MAX_PORT		20
-
-#define TIME_SUB_MS(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000 + (tv1.tv_usec - tv2.tv_usec) / 1000)
-
-int isContinue = 0;
-
-static int ntySetNonblock(int fd) {
-	int flags;
-
-	flags = fcntl(fd, F_GETFL, 0);
-	if (flags < 0) return flags;
-	flags |= O_NONBLOCK;
-	if (fcntl(fd, F_SETFL, flags) < 0) return -1;
-	return 0;
-}
-
-static int ntySetReUseAddr(int fd) {
-	int reuse = 1;
-	return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse));
-}
-
-
-
-int main(int argc, char **argv) {
-	if (argc <= 2) {
-		printf("Usage: %s ip port\n", argv[0]);
-		exit(0);
-	}
-
-	const char *ip = argv[1];
-	int port = atoi(argv[2]);
-	int connections = 0;
-	char buffer[128] = {0};
-	int i = 0, index = 0;
-
-	struct epoll_event events[MAX_EPOLLSIZE];
-	
-	int epoll_fd = epoll_create(MAX_EPOLLSIZE);
-	
-	strcpy(buffer, " Data From MulClient\n");
-		
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(struct sockaddr_in));
-	
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(ip);
-
-	struct timeval tv_begin;
-	gettimeofday(&tv_begin, NULL);
-	int sockfd = 0;
-
-	while (1) {
-		if (++index >= MAX_PORT) index = 0;
-		
-		struct epoll_event ev;
-
-		if (connections < 340000 && !isContinue) {
-			sockfd = socket(AF_INET, SOCK_STREAM, 0);
-			if (sockfd == -1) {
-				perror("socket");
-				goto err;
-			}
-
-			//ntySetReUseAddr(sockfd);
-			addr.sin_port = htons(port+index);
-
-			if (connect(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
-				perror("connect");
-				goto err;
-			}
-			ntySetNonblock(sockfd);
-			ntySetReUseAddr(sockfd);
-
-			sprintf(buffer, "Hello Server: client --> %d\n", connections);
-			send(sockfd, buffer, strlen(buffer), 0);
-
-			ev.data.fd = sockfd;
-			ev.events = EPOLLIN | EPOLLOUT;
-			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
-		
-			connections ++;
-		}
-		//connections ++;
-		if (connections % 1000 == 999 || connections >= 340000) {
-			struct timeval tv_cur;
-			memcpy(&tv_cur, &tv_begin, sizeof(struct timeval));
-			
-			gettimeofday(&tv_begin, NULL);
-
-			int time_used = TIME_SUB_MS(tv_begin, tv_cur);
-			printf("connections: %d, sockfd:%d, time_used:%d\n", connections, sockfd, time_used);
-
-			int nfds = epoll_wait(epoll_fd, events, connections, 100);
-			for (i = 0;i < nfds;i ++) {
-				int clientfd = events[i].data.fd;
-
-				if (events[i].events & EPOLLOUT) {
-				//	sprintf(buffer, "data from %d\n", clientfd);
-					send(sockfd, buffer, strlen(buffer), 0);
-				} else if (events[i].events & EPOLLIN) {
-					char rBuffer[MAX_BUFFER] = {0};				
-					ssize_t length = recv(sockfd, rBuffer, MAX_BUFFER, 0);
-					if (length > 0) {
-				//		printf(" RecvBuffer:%s\n", rBuffer);
-
-						if (!strcmp(rBuffer, "quit")) {
-							isContinue = 0;
-						}
-						
-					} else if (length == 0) {
-						printf(" Disconnect clientfd:%d\n", clientfd);
-						connections --;
-						close(clientfd);
-					} else {
-						if (errno == EINTR || errno == EAGAIN || errno == ENOTSOCK) continue;
-
-						printf(" Error clientfd:%d, errno:%d\n", clientfd, errno);
-						close(clientfd);
-					}
-				} else {
-					printf(" clientfd:%d, errno:%d\n", clientfd, errno);
-					close(clientfd);
-				}
-			}
-		}
-
-		usleep(500);
-	}
-
-	return 0;
-
-err:
-	printf("error : %s\n", strerror(errno));
-	return 0;
-	
-}
-
-
-
-
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#define MAX_BUFFER		128
+#define MAX_EPOLLSIZE	(384*1024)
+#define MAX_PORT		20
+#define MAX_CONNECTIONS	340000
+#define MAX_SOURCES		64
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT	24
+#endif
+
+#define TIME_SUB_MS(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000 + (tv1.tv_usec - tv2.tv_usec) / 1000)
+
+#define WS_GUID			"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_HEADER_MAX	14
+#define WS_HANDSHAKE_MAX	1024
+
+#define HIST_SUB_BITS	4
+#define HIST_BUCKETS	(64 << HIST_SUB_BITS)
+
+enum {
+	NTY_MODE_ECHO = 0,
+	NTY_MODE_WEBSOCKET,
+};
+
+enum {
+	NTY_CONN_FREE = 0,
+	NTY_CONN_HANDSHAKE,
+	NTY_CONN_OPEN,
+};
+
+struct nty_conn {
+	int status;
+
+	unsigned char *rbuffer;
+	int rlength;
+
+	unsigned char *wbuffer;		// unsent tail of the last request, NULL when drained
+	int wlength;
+	int woffset;
+
+	char accept[32];			// expected Sec-WebSocket-Accept
+	unsigned long long sent_us;
+	int round_trips;
+};
+
+struct nty_hist {
+	unsigned long long count;
+	unsigned long long buckets[HIST_BUCKETS];
+};
+
+struct nty_stats {
+	unsigned long long connects;
+	unsigned long long closes;
+	unsigned long long handshakes;
+	unsigned long long frames;
+	unsigned long long errors;
+	struct nty_hist handshake_lat;
+	struct nty_hist frame_lat;
+};
+
+int isContinue = 0;
+
+static int mode = NTY_MODE_ECHO;
+static int opcode = 0x1;			// text frames by default, -b switches to binary
+static int msg_size = 0;
+static int rcapacity = 0;
+static int idle = 0;				// -i: connect/handshake only, no traffic
+static int churn = 0;				// -k: close and reconnect after this many round trips
+static int established = 0;
+
+static unsigned char *payload = NULL;
+static struct nty_conn *conn_list = NULL;
+static int conn_max = 0;
+
+static struct nty_stats interval;
+static struct nty_stats total;
+
+static int ntySetNonblock(int fd) {
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return flags;
+	flags |= O_NONBLOCK;
+	if (fcntl(fd, F_SETFL, flags) < 0) return -1;
+	return 0;
+}
+
+static int ntySetReUseAddr(int fd) {
+	int reuse = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse));
+}
+
+static unsigned long long ntyNowUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static unsigned int ntyRandom(void) {
+	static unsigned int state = 0;
+	if (state == 0) state = (unsigned int)ntyNowUs() | 1;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// log-linear histogram: 16 sub buckets per power of two, ~6% relative error
+static int ntyHistIndex(unsigned long long v) {
+	if (v < (1 << HIST_SUB_BITS)) return (int)v;
+
+	int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static unsigned long long ntyHistValue(int index) {
+	if (index < (1 << HIST_SUB_BITS)) return index;
+
+	int shift = (index >> HIST_SUB_BITS) - 1;
+	return (unsigned long long)((1 << HIST_SUB_BITS) + (index & ((1 << HIST_SUB_BITS) - 1))) << shift;
+}
+
+static void ntyHistRecord(struct nty_hist *h, unsigned long long v) {
+	h->buckets[ntyHistIndex(v)] ++;
+	h->count ++;
+}
+
+static unsigned long long ntyHistPercentile(const struct nty_hist *h, double p) {
+	if (h->count == 0) return 0;
+
+	unsigned long long rank = (unsigned long long)(h->count * p / 100.0);
+	unsigned long long seen = 0;
+	int i = 0;
+
+	for (i = 0;i < HIST_BUCKETS;i ++) {
+		seen += h->buckets[i];
+		if (seen > rank) return ntyHistValue(i);
+	}
+	return ntyHistValue(HIST_BUCKETS - 1);
+}
+
+static void ntyStatsMerge(struct nty_stats *to, const struct nty_stats *from) {
+	int i = 0;
+
+	to->connects += from->connects;
+	to->closes += from->closes;
+	to->handshakes += from->handshakes;
+	to->frames += from->frames;
+	to->errors += from->errors;
+
+	to->handshake_lat.count += from->handshake_lat.count;
+	to->frame_lat.count += from->frame_lat.count;
+	for (i = 0;i < HIST_BUCKETS;i ++) {
+		to->handshake_lat.buckets[i] += from->handshake_lat.buckets[i];
+		to->frame_lat.buckets[i] += from->frame_lat.buckets[i];
+	}
+}
+
+static void ntyCloseConn(int fd) {
+	struct nty_conn *c = &conn_list[fd];
+
+	if (c->status == NTY_CONN_OPEN) established --;
+	free(c->rbuffer);
+	free(c->wbuffer);
+	memset(c, 0, sizeof(struct nty_conn));
+	close(fd);
+}
+
+// flush the pending tail first, then whatever the caller hands in
+static int ntySendData(int fd, const unsigned char *data, int length) {
+	struct nty_conn *c = &conn_list[fd];
+
+	if (c->wbuffer) {
+		while (c->woffset < c->wlength) {
+			ssize_t n = send(fd, c->wbuffer + c->woffset, c->wlength - c->woffset, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+				return -1;
+			}
+			c->woffset += n;
+		}
+		free(c->wbuffer);
+		c->wbuffer = NULL;
+		c->wlength = c->woffset = 0;
+	}
+
+	int offset = 0;
+	while (offset < length) {
+		ssize_t n = send(fd, data + offset, length - offset, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		offset += n;
+	}
+
+	if (offset < length) {
+		c->wbuffer = malloc(length - offset);
+		if (!c->wbuffer) return -1;
+		memcpy(c->wbuffer, data + offset, length - offset);
+		c->wlength = length - offset;
+		c->woffset = 0;
+	}
+	return 0;
+}
+
+static int ntyBuildFrame(unsigned char *frame, int op, const unsigned char *data, int length) {
+	unsigned int mask = ntyRandom();
+	unsigned char *key = (unsigned char *)&mask;
+	int hlen = 2;
+	int i = 0;
+
+	frame[0] = 0x80 | op;
+	if (length < 126) {
+		frame[1] = 0x80 | length;
+	} else if (length <= 0xffff) {
+		frame[1] = 0x80 | 126;
+		frame[2] = (length >> 8) & 0xff;
+		frame[3] = length & 0xff;
+		hlen = 4;
+	} else {
+		frame[1] = 0x80 | 127;
+		for (i = 0;i < 8;i ++) {
+			frame[2 + i] = ((unsigned long long)length >> (56 - 8 * i)) & 0xff;
+		}
+		hlen = 10;
+	}
+
+	memcpy(frame + hlen, key, 4);
+	hlen += 4;
+
+	for (i = 0;i < length;i ++) {
+		frame[hlen + i] = data[i] ^ key[i & 3];
+	}
+	return hlen + length;
+}
+
+static int ntySendRequest(int fd) {
+	static unsigned char *frame = NULL;
+	struct nty_conn *c = &conn_list[fd];
+
+	if (!frame) frame = malloc(WS_HEADER_MAX + msg_size);
+
+	c->sent_us = ntyNowUs();
+	if (mode == NTY_MODE_WEBSOCKET) {
+		int length = ntyBuildFrame(frame, opcode, payload, msg_size);
+		return ntySendData(fd, frame, length);
+	}
+	return ntySendData(fd, payload, msg_size);
+}
+
+static int ntySendHandshake(int fd, const char *ip, int port) {
+	struct nty_conn *c = &conn_list[fd];
+	unsigned char nonce[16];
+	char key[32] = {0};
+	char accept_src[64] = {0};
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char request[256];
+	int i = 0;
+
+	for (i = 0;i < 16;i ++) nonce[i] = ntyRandom() & 0xff;
+	EVP_EncodeBlock((unsigned char *)key, nonce, 16);
+
+	snprintf(accept_src, sizeof(accept_src), "%s%s", key, WS_GUID);
+	SHA1((unsigned char *)accept_src, strlen(accept_src), digest);
+	EVP_EncodeBlock((unsigned char *)c->accept, digest, SHA_DIGEST_LENGTH);
+
+	int length = snprintf(request, sizeof(request),
+		"GET / HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n", ip, port, key);
+
+	c->sent_us = ntyNowUs();
+	return ntySendData(fd, (unsigned char *)request, length);
+}
+
+// returns 1 once the 101 response is complete, 0 when more data is needed, -1 on a bad response
+static int ntyParseHandshake(struct nty_conn *c) {
+	c->rbuffer[c->rlength] = '\0';
+
+	char *end = strstr((char *)c->rbuffer, "\r\n\r\n");
+	if (!end) return c->rlength >= WS_HANDSHAKE_MAX ? -1 : 0;
+
+	if (strncmp((char *)c->rbuffer, "HTTP/1.1 101", 12)) return -1;
+
+	char *accept = strcasestr((char *)c->rbuffer, "Sec-WebSocket-Accept:");
+	if (!accept || accept > end) return -1;
+	accept += strlen("Sec-WebSocket-Accept:");
+	while (*accept == ' ') accept ++;
+	if (strncmp(accept, c->accept, strlen(c->accept))) return -1;
+
+	int used = end + 4 - (char *)c->rbuffer;
+	memmove(c->rbuffer, c->rbuffer + used, c->rlength - used);
+	c->rlength -= used;
+	return 1;
+}
+
+// returns 1 once a full echo was consumed, 0 when more data is needed, -1 on a mismatch,
+// 2 after a ping/pong was handled and 3 when the server closed the connection
+static int ntyParseEcho(int fd, struct nty_conn *c) {
+	int ret = 1;
+	int hlen = 0;
+	unsigned long long length = 0;
+
+	if (mode == NTY_MODE_ECHO) {
+		if (c->rlength < msg_size) return 0;
+		if (memcmp(c->rbuffer, payload, msg_size)) return -1;
+		hlen = 0;
+		length = msg_size;
+	} else {
+		const unsigned char *p = c->rbuffer;
+		int i = 0;
+
+		if (c->rlength < 2) return 0;
+		if (p[1] & 0x80) return -1;				// server frames must not be masked
+
+		length = p[1] & 0x7f;
+		hlen = 2;
+		if (length == 126) {
+			if (c->rlength < 4) return 0;
+			length = ((unsigned long long)p[2] << 8) | p[3];
+			hlen = 4;
+		} else if (length == 127) {
+			if (c->rlength < 10) return 0;
+			length = 0;
+			for (i = 0;i < 8;i ++) length = (length << 8) | p[2 + i];
+			hlen = 10;
+		}
+
+		if (p[0] & 0x08) {						// control frames, e.g. the server's keepalive ping
+			unsigned char reply[WS_HEADER_MAX + 125];
+			int op = p[0] & 0x0f;
+
+			if (length > 125 || !(p[0] & 0x80)) return -1;
+			if (c->rlength < hlen + (int)length) return 0;
+
+			if (op == 0x9) {
+				if (ntySendData(fd, reply, ntyBuildFrame(reply, 0xA, p + hlen, length)) < 0) return -1;
+				ret = 2;
+			} else if (op == 0xA) {
+				ret = 2;
+			} else if (op == 0x8) {
+				ntySendData(fd, reply, ntyBuildFrame(reply, 0x8, p + hlen, length < 2 ? 0 : 2));
+				ret = 3;
+			} else {
+				return -1;
+			}
+		} else {
+			if (length != (unsigned long long)msg_size) return -1;
+			if (c->rlength < hlen + (int)length) return 0;
+			if (!(p[0] & 0x80) || memcmp(p + hlen, payload, msg_size)) return -1;
+		}
+	}
+
+	int used = hlen + (int)length;
+	memmove(c->rbuffer, c->rbuffer + used, c->rlength - used);
+	c->rlength -= used;
+	return ret;
+}
+
+// returns 1 when the connection finished its churn quota, -1 on errors
+static int ntyHandleRead(int fd) {
+	struct nty_conn *c = &conn_list[fd];
+
+	for (;;) {
+		ssize_t length = recv(fd, c->rbuffer + c->rlength, rcapacity - c->rlength, 0);
+		if (length == 0) {
+			printf(" Disconnect clientfd:%d\n", fd);
+			return -1;
+		} else if (length < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+			printf(" Error clientfd:%d, errno:%d\n", fd, errno);
+			return -1;
+		}
+		c->rlength += length;
+
+		for (;;) {
+			int ret = 0;
+			unsigned long long now = 0;
+
+			if (c->status == NTY_CONN_HANDSHAKE) {
+				ret = ntyParseHandshake(c);
+				if (ret < 0) return -1;
+				if (ret == 0) break;
+
+				now = ntyNowUs();
+				interval.handshakes ++;
+				ntyHistRecord(&interval.handshake_lat, now - c->sent_us);
+				c->status = NTY_CONN_OPEN;
+				established ++;
+				if (idle) break;
+			} else {
+				ret = ntyParseEcho(fd, c);
+				if (ret < 0) return -1;
+				if (ret == 0) break;
+				if (ret == 2) continue;
+				if (ret == 3) return 1;			// clean close from the server
+
+				now = ntyNowUs();
+				interval.frames ++;
+				ntyHistRecord(&interval.frame_lat, now - c->sent_us);
+				if (churn && ++c->round_trips >= churn) return 1;
+			}
+
+			if (ntySendRequest(fd) < 0) return -1;
+		}
+
+		if (c->rlength == rcapacity) return -1;
+	}
+}
+
+static void ntyPrintStats(int connections, unsigned long long elapsed_us) {
+	double seconds = elapsed_us / 1000000.0;
+
+	printf("connections: %d, connects/s: %.0f, handshakes/s: %.0f, frames/s: %.0f, errors: %llu, "
+		"handshake p50/p99: %llu/%llu us, frame p50/p99/p999: %llu/%llu/%llu us\n",
+		connections, interval.connects / seconds, interval.handshakes / seconds, interval.frames / seconds, interval.errors,
+		ntyHistPercentile(&interval.handshake_lat, 50), ntyHistPercentile(&interval.handshake_lat, 99),
+		ntyHistPercentile(&interval.frame_lat, 50), ntyHistPercentile(&interval.frame_lat, 99),
+		ntyHistPercentile(&interval.frame_lat, 99.9));
+
+	ntyStatsMerge(&total, &interval);
+	memset(&interval, 0, sizeof(interval));
+}
+
+static void ntyUsage(const char *name) {
+	printf("Usage: %s ip port [-w] [-b] [-i] [-j] [-s size] [-c connections] [-p ports] [-r rate] [-d seconds]\n"
+		"         [-k round_trips] [-a source_ip,source_ip,...]\n"
+		"  -w  websocket mode: HTTP Upgrade handshake, then masked frames\n"
+		"  -b  send binary frames instead of text frames (websocket mode)\n"
+		"  -s  message/payload size in bytes (default %d)\n"
+		"  -c  number of connections (default %d)\n"
+		"  -p  number of consecutive server ports (default %d)\n"
+		"  -r  new connections per second (default 2000)\n"
+		"  -d  run time in seconds, 0 runs forever (default 0)\n"
+		"  -i  idle: only connect (and handshake), exit once all connections are up\n"
+		"  -k  churn: close and reconnect each connection after this many round trips\n"
+		"  -a  local source addresses to spread connections over, e.g. 127.0.0.2,127.0.0.3\n"
+		"  -j  print the final summary as a single JSON line\n",
+		name, MAX_BUFFER, MAX_CONNECTIONS, MAX_PORT);
+}
+
+int main(int argc, char **argv) {
+	int max_connections = MAX_CONNECTIONS;
+	int max_port = MAX_PORT;
+	int rate = 2000;
+	int duration = 0;
+	int json = 0;
+	int opt = 0;
+
+	struct in_addr sources[MAX_SOURCES];
+	int source_count = 0;
+	int source_index = 0;
+
+	msg_size = MAX_BUFFER;
+	while ((opt = getopt(argc, argv, "wbijs:c:p:r:d:k:a:")) != -1) {
+		switch (opt) {
+			case 'w': mode = NTY_MODE_WEBSOCKET; break;
+			case 'b': opcode = 0x2; break;
+			case 's': msg_size = atoi(optarg); break;
+			case 'c': max_connections = atoi(optarg); break;
+			case 'p': max_port = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'i': idle = 1; break;
+			case 'j': json = 1; break;
+			case 'k': churn = atoi(optarg); break;
+			case 'a': {
+				char *saveptr = NULL;
+				char *token = strtok_r(optarg, ",", &saveptr);
+				while (token && source_count < MAX_SOURCES) {
+					if (inet_pton(AF_INET, token, &sources[source_count]) != 1) {
+						printf("bad source address: %s\n", token);
+						exit(0);
+					}
+					source_count ++;
+					token = strtok_r(NULL, ",", &saveptr);
+				}
+				break;
+			}
+			default: ntyUsage(argv[0]); exit(0);
+		}
+	}
+
+	if (argc - optind < 2 || msg_size <= 0 || max_port <= 0 || rate <= 0) {
+		ntyUsage(argv[0]);
+		exit(0);
+	}
+
+	const char *ip = argv[optind];
+	int port = atoi(argv[optind + 1]);
+	int connections = 0;
+	int i = 0, index = 0;
+
+	struct rlimit rl;
+	conn_max = MAX_EPOLLSIZE;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (int)rl.rlim_cur > conn_max) {
+		conn_max = (int)rl.rlim_cur;
+	}
+	conn_list = calloc(conn_max, sizeof(struct nty_conn));
+
+	payload = malloc(msg_size);
+	for (i = 0;i < msg_size;i ++) {
+		payload[i] = (opcode == 0x1) ? 'a' + i % 26 : (unsigned char)i;
+	}
+	if (mode == NTY_MODE_ECHO && msg_size > 0) payload[msg_size - 1] = '\n';
+
+	rcapacity = WS_HANDSHAKE_MAX + WS_HEADER_MAX + msg_size;
+
+	struct epoll_event *events = calloc(MAX_EPOLLSIZE, sizeof(struct epoll_event));
+
+	int epoll_fd = epoll_create(MAX_EPOLLSIZE);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+
+	unsigned long long start_us = ntyNowUs();
+	unsigned long long report_us = start_us;
+	int sockfd = 0;
+
+	while (1) {
+		unsigned long long now = ntyNowUs();
+		long long target = (long long)(now - start_us) * rate / 1000000 + 1;
+
+		while (connections < max_connections && connections < target && !isContinue) {
+			if (++index >= max_port) index = 0;
+
+			sockfd = socket(AF_INET, SOCK_STREAM, 0);
+			if (sockfd == -1) {
+				perror("socket");
+				goto err;
+			}
+			if (sockfd >= conn_max) {
+				printf("sockfd %d exceeds connection table (%d)\n", sockfd, conn_max);
+				close(sockfd);
+				goto err;
+			}
+
+			addr.sin_port = htons(port + index);
+
+			if (source_count > 0) {
+				// pick the local port at connect() time so each source address gets the full 4-tuple space
+				struct sockaddr_in local;
+				int one = 1;
+
+				memset(&local, 0, sizeof(local));
+				local.sin_family = AF_INET;
+				local.sin_addr = sources[source_index];
+				if (++source_index >= source_count) source_index = 0;
+
+				setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+				if (bind(sockfd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+					perror("bind");
+					goto err;
+				}
+			}
+
+			if (connect(sockfd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
+				perror("connect");
+				goto err;
+			}
+			ntySetNonblock(sockfd);
+			ntySetReUseAddr(sockfd);
+
+			struct nty_conn *c = &conn_list[sockfd];
+			c->rbuffer = malloc(rcapacity + 1);
+			c->rlength = 0;
+
+			int ret = 0;
+			interval.connects ++;
+			if (mode == NTY_MODE_WEBSOCKET) {
+				c->status = NTY_CONN_HANDSHAKE;
+				ret = ntySendHandshake(sockfd, ip, port + index);
+			} else {
+				c->status = NTY_CONN_OPEN;
+				established ++;
+				if (!idle) ret = ntySendRequest(sockfd);
+			}
+
+			if (ret < 0) {
+				interval.errors ++;
+				ntyCloseConn(sockfd);
+				continue;
+			}
+
+			struct epoll_event ev;
+			ev.data.fd = sockfd;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
+
+			connections ++;
+		}
+
+		int ramping = connections < max_connections && !isContinue;
+		int nfds = epoll_wait(epoll_fd, events, MAX_EPOLLSIZE, ramping ? 1 : 100);
+		for (i = 0;i < nfds;i ++) {
+			int clientfd = events[i].data.fd;
+			int ret = 0;
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				ret = -1;
+			}
+			if (ret == 0 && (events[i].events & EPOLLOUT) && conn_list[clientfd].wbuffer) {
+				ret = ntySendData(clientfd, NULL, 0);
+			}
+			if (ret == 0 && (events[i].events & EPOLLIN)) {
+				ret = ntyHandleRead(clientfd);
+			}
+
+			if (ret != 0) {
+				if (ret < 0) interval.errors ++;
+				else interval.closes ++;
+				connections --;
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, clientfd, NULL);
+				ntyCloseConn(clientfd);
+			}
+		}
+
+		now = ntyNowUs();
+		if (now - report_us >= 1000000) {
+			ntyPrintStats(connections, now - report_us);
+			report_us = now;
+		}
+
+		if (duration > 0 && now - start_us >= (unsigned long long)duration * 1000000) {
+			break;
+		}
+		if (idle && established >= max_connections) {
+			printf("ramp complete: %d connections in %llu ms\n", established, (now - start_us) / 1000);
+			break;
+		}
+	}
+
+	ntyStatsMerge(&total, &interval);
+	double seconds = (ntyNowUs() - start_us) / 1000000.0;
+	printf("total: connections: %d, handshakes: %llu (%.0f/s), frames: %llu (%.0f/s), errors: %llu, "
+		"frame p50/p99/p999: %llu/%llu/%llu us\n",
+		connections, total.handshakes, total.handshakes / seconds, total.frames, total.frames / seconds, total.errors,
+		ntyHistPercentile(&total.frame_lat, 50), ntyHistPercentile(&total.frame_lat, 99),
+		ntyHistPercentile(&total.frame_lat, 99.9));
+
+	if (json) {
+		printf("{\"mode\": \"%s\", \"size\": %d, \"seconds\": %.3f, \"connections\": %d, "
+			"\"connects\": %llu, \"connects_per_sec\": %.0f, \"closes\": %llu, "
+			"\"handshakes\": %llu, \"handshakes_per_sec\": %.0f, "
+			"\"frames\": %llu, \"frames_per_sec\": %.0f, \"errors\": %llu, "
+			"\"latency_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu}}\n",
+			mode == NTY_MODE_WEBSOCKET ? "websocket" : "echo", msg_size, seconds, connections,
+			total.connects, total.connects / seconds, total.closes,
+			total.handshakes, total.handshakes / seconds,
+			total.frames, total.frames / seconds, total.errors,
+			ntyHistPercentile(&total.frame_lat, 50), ntyHistPercentile(&total.frame_lat, 90),
+			ntyHistPercentile(&total.frame_lat, 99), ntyHistPercentile(&total.frame_lat, 99.9));
+	}
+
+	return 0;
+
+err:
+	printf("error : %s\n", strerror(errno));
+	return 0;
+
+}
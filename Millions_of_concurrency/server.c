@@ -25,6 +25,10 @@ int send_cb(int fd);
 int epfd = 0;
 struct timeval begin;
 
+int connections = 0;
+unsigned long long accepts = 0;
+unsigned long long msgs = 0;
+
 struct conn
 {
     int fd;
@@ -66,7 +70,7 @@ int set_event(int fd, int event, int flag)
 
 int event_register(int fd, int event)
 {
-    if (fd < 0)
+    if (fd < 0 || fd >= CONNECTION_SIZE)
         return -1;
 
     conn_list[fd].fd = fd;
@@ -94,7 +98,14 @@ int accept_cb(int fd)
         printf("accept errno: %d --> %s\n", errno, strerror(errno));
         return -1;
     }
-    event_register(clientfd, EPOLLIN);
+    if (event_register(clientfd, EPOLLIN) < 0)
+    {
+        printf("accept fd %d exceeds CONNECTION_SIZE\n", clientfd);
+        close(clientfd);
+        return -1;
+    }
+    connections++;
+    accepts++;
 
     if ((clientfd % 1000) == 0) {
         struct timeval current;
@@ -111,14 +122,19 @@ int accept_cb(int fd)
 int recv_cb(int fd)
 {
     int count = recv(fd, conn_list[fd].rbuffer, BUFFER_LENGTH, 0);
-    if (count == 0)
+    if (count <= 0)
     {
-        printf("client disconnect: %d\n", fd);
+        if (count < 0)
+            printf("client error: %d, errno: %d --> %s\n", fd, errno, strerror(errno));
+        else
+            printf("client disconnect: %d\n", fd);
         close(fd);
         epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        connections--;
         return 0;
     }
     conn_list[fd].rlength = count;
+    msgs++;
     // printf("RECV: %s\n", conn_list[fd].rbuffer);
 
 #if 1 // echo
@@ -151,7 +167,7 @@ int init_server(unsigned short port)
         printf("bind failed: %s\n", strerror(errno));
     }
 
-    listen(sockfd, 10);
+    listen(sockfd, SOMAXCONN);
     // printf("listen finshed: %d\n", sockfd); // 3
 
     return sockfd;
@@ -176,10 +192,14 @@ int main()
 
     gettimeofday(&begin, NULL);
 
+    struct timeval last_stats;
+    unsigned long long last_accepts = 0, last_msgs = 0;
+    gettimeofday(&last_stats, NULL);
+
     while (1) 
     {
         struct epoll_event events[1024] = {0};
-        int nready = epoll_wait(epfd, events, 1024, -1);
+        int nready = epoll_wait(epfd, events, 1024, 1000);
 
         int i = 0;
         for (i = 0; i < nready; i++)
@@ -203,5 +223,19 @@ int main()
             }
 #endif
         }
+
+        // one line per second, parsed by bench.sh
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        int elapsed = TIME_SUB_MS(now, last_stats);
+        if (elapsed >= 1000)
+        {
+            printf("stats: connections: %d, accepts/s: %llu, msgs/s: %llu\n", connections,
+                   (accepts - last_accepts) * 1000 / elapsed, (msgs - last_msgs) * 1000 / elapsed);
+            fflush(stdout);
+            last_accepts = accepts;
+            last_msgs = msgs;
+            memcpy(&last_stats, &now, sizeof(struct timeval));
+        }
     }
 }
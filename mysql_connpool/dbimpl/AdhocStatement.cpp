@@ -57,3 +57,8 @@ bool BasicStatementTask::Execute()
 
     return m_conn->Execute(m_sql);
 }
+
+bool BasicStatementTask::AppendBatch(std::string& sql)
+{
+    return !m_has_result && m_conn->AppendBatch(m_sql, sql);
+}
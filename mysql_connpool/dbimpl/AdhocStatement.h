@@ -30,6 +30,7 @@ class TC_DATABASE_API BasicStatementTask : public SQLOperation
         ~BasicStatementTask();
 
         bool Execute() override;
+        bool AppendBatch(std::string& sql) override;
         QueryResultFuture GetFuture() const { return m_result->get_future(); }
 
     private:
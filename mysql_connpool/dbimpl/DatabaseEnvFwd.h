@@ -18,6 +18,7 @@
 #ifndef DatabaseEnvFwd_h__
 #define DatabaseEnvFwd_h__
 
+#include "Define.h"
 #include <future>
 #include <memory>
 
@@ -45,6 +46,23 @@ using PreparedQueryResultPromise = std::promise<PreparedQueryResult>;
 
 class QueryCallback;
 
+//! Lanes of the async queue, see SQLOperationQueue
+enum SQLPriority
+{
+    SQL_PRIORITY_HIGH,      // 有人在等结果的查询
+    SQL_PRIORITY_NORMAL,
+    SQL_PRIORITY_LOW,       // 日志之类可以延后的写入
+    MAX_SQL_PRIORITY
+};
+
+//! Async operations sharing a non-zero key run one at a time, in submission order
+//! (e.g. an account or player id). 0 means no ordering.
+typedef uint64 SQLOrderKey;
+
+class SQLOperationQueue;
+struct SQLQueueSchedule;
+struct SQLQueueStats;
+
 template<typename T>
 class AsyncCallbackProcessor;
 
@@ -16,10 +16,12 @@
  */
 
 #include "DatabaseWorker.h"
+#include "MySQLConnection.h"
 #include "SQLOperation.h"
-#include "ProducerConsumerQueue.h"
+#include "SQLOperationQueue.h"
+#include <algorithm>
 
-DatabaseWorker::DatabaseWorker(ProducerConsumerQueue<SQLOperation*>* newQueue, MySQLConnection* connection)
+DatabaseWorker::DatabaseWorker(SQLOperationQueue* newQueue, MySQLConnection* connection)
 {
     _connection = connection;
     _queue = newQueue;
@@ -41,18 +43,49 @@ void DatabaseWorker::WorkerThread()
     if (!_queue)
         return;
 
+    SQLOperation* operations[MAX_BATCH_SIZE];
     for (;;)
     {
-        SQLOperation* operation = nullptr;
+        size_t count = _queue->WaitAndPopBatch(operations, std::min(_queue->GetBatchSize(), MAX_BATCH_SIZE));
 
-        _queue->WaitAndPop(operation);
-
-        if (_cancelationToken || !operation)
+        if (_cancelationToken || !count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                delete operations[i];
             return;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            operations[i]->SetConnection(_connection);
+
+        // 连续的单向语句合并成一次往返，其它操作按出队顺序逐个执行
+        for (size_t i = 0; i < count;)
+        {
+            size_t executed = _connection->ExecuteBatch(&operations[i], count - i);
+            if (!executed)
+            {
+                operations[i]->call();
+                executed = 1;
+            }
 
-        operation->SetConnection(_connection);
-        operation->call();
+            for (size_t end = i + executed; i < end; ++i)
+            {
+                // 先交出 order key，同 key 的下一个操作可以在别的连接上开始
+                SQLOperation* next = _queue->Finish(operations[i]);
+                operations[i]->Complete();
+                delete operations[i];
 
-        delete operation;
+                // 车道满了放不回去的，由这个连接接着执行
+                while (next)
+                {
+                    SQLOperation* op = next;
+                    op->SetConnection(_connection);
+                    op->call();
+                    next = _queue->Finish(op);
+                    op->Complete();
+                    delete op;
+                }
+            }
+        }
     }
 }
@@ -22,20 +22,21 @@
 #include <atomic>
 #include <thread>
 
-template <typename T>
-class ProducerConsumerQueue;
-
 class MySQLConnection;
 class SQLOperation;
+class SQLOperationQueue;
 
 class TC_DATABASE_API DatabaseWorker
 {
     public:
-        DatabaseWorker(ProducerConsumerQueue<SQLOperation*>* newQueue, MySQLConnection* connection);
+        DatabaseWorker(SQLOperationQueue* newQueue, MySQLConnection* connection);
         ~DatabaseWorker();
 
+        //! Upper bound of SQLOperationQueue::SetBatchSize.
+        static constexpr uint32 MAX_BATCH_SIZE = 64;
+
     private:
-        ProducerConsumerQueue<SQLOperation*>* _queue;
+        SQLOperationQueue* _queue;
         MySQLConnection* _connection;
 
         void WorkerThread();
@@ -22,11 +22,11 @@
 #include "Log.h"
 #include "MySQLPreparedStatement.h"
 #include "PreparedStatement.h"
-#include "ProducerConsumerQueue.h"
 #include "QueryCallback.h"
 #include "QueryHolder.h"
 #include "QueryResult.h"
 #include "SQLOperation.h"
+#include "SQLOperationQueue.h"
 #include "Transaction.h"
 #include "MySQLWorkaround.h"
 #include <mysqld_error.h>
@@ -57,7 +57,7 @@ class PingOperation : public SQLOperation
 
 template <class T>
 DatabaseWorkerPool<T>::DatabaseWorkerPool()
-    : _queue(new ProducerConsumerQueue<SQLOperation*>()),
+    : _queue(new SQLOperationQueue()),
       _async_threads(0), _synch_threads(0)
 {
     WPFatal(mysql_thread_safe(), "Used MySQL library isn't thread-safe.");
@@ -85,6 +85,8 @@ void DatabaseWorkerPool<T>::SetConnectionInfo(std::string const& infoString,
 
     _async_threads = asyncThreads;
     _synch_threads = synchThreads;
+
+    _queue->SetWorkerCount(asyncThreads);
 }
 
 template <class T>
@@ -215,32 +217,43 @@ PreparedQueryResult DatabaseWorkerPool<T>::Query(PreparedStatement<T>* stmt)
 }
 
 template <class T>
-QueryCallback DatabaseWorkerPool<T>::AsyncQuery(char const* sql)
+QueryCallback DatabaseWorkerPool<T>::AsyncQuery(char const* sql, SQLPriority priority, SQLOrderKey key)
 {
     BasicStatementTask* task = new BasicStatementTask(sql, true);
     // Store future result before enqueueing - task might get already processed and deleted before returning from this method
     QueryResultFuture result = task->GetFuture();
-    Enqueue(task);
+    Enqueue(task, priority, key);
     return QueryCallback(std::move(result));
 }
 
 template <class T>
-QueryCallback DatabaseWorkerPool<T>::AsyncQuery(PreparedStatement<T>* stmt)
+QueryCallback DatabaseWorkerPool<T>::AsyncQuery(PreparedStatement<T>* stmt, SQLPriority priority, SQLOrderKey key)
 {
     PreparedStatementTask* task = new PreparedStatementTask(stmt, true);
     // Store future result before enqueueing - task might get already processed and deleted before returning from this method
     PreparedQueryResultFuture result = task->GetFuture();
-    Enqueue(task);
+    Enqueue(task, priority, key);
     return QueryCallback(std::move(result));
 }
 
 template <class T>
-SQLQueryHolderCallback DatabaseWorkerPool<T>::DelayQueryHolder(std::shared_ptr<SQLQueryHolder<T>> holder)
+QueryCallback DatabaseWorkerPool<T>::AsyncQuery(PreparedStatement<T>* stmt, std::function<void()>&& onComplete, SQLPriority priority, SQLOrderKey key)
+{
+    PreparedStatementTask* task = new PreparedStatementTask(stmt, true);
+    task->SetCompletionHandler(std::move(onComplete));
+    // Store future result before enqueueing - task might get already processed and deleted before returning from this method
+    PreparedQueryResultFuture result = task->GetFuture();
+    Enqueue(task, priority, key);
+    return QueryCallback(std::move(result));
+}
+
+template <class T>
+SQLQueryHolderCallback DatabaseWorkerPool<T>::DelayQueryHolder(std::shared_ptr<SQLQueryHolder<T>> holder, SQLPriority priority, SQLOrderKey key)
 {
     SQLQueryHolderTask* task = new SQLQueryHolderTask(holder);
     // Store future result before enqueueing - task might get already processed and deleted before returning from this method
     QueryResultHolderFuture result = task->GetFuture();
-    Enqueue(task);
+    Enqueue(task, priority, key);
     return { std::move(holder), std::move(result) };
 }
 
@@ -251,7 +264,7 @@ SQLTransaction<T> DatabaseWorkerPool<T>::BeginTransaction()
 }
 
 template <class T>
-void DatabaseWorkerPool<T>::CommitTransaction(SQLTransaction<T> transaction)
+void DatabaseWorkerPool<T>::CommitTransaction(SQLTransaction<T> transaction, SQLPriority priority, SQLOrderKey key)
 {
 #ifdef TRINITY_DEBUG
     //! Only analyze transaction weaknesses in Debug mode.
@@ -270,11 +283,11 @@ void DatabaseWorkerPool<T>::CommitTransaction(SQLTransaction<T> transaction)
     }
 #endif // TRINITY_DEBUG
 
-    Enqueue(new TransactionTask(transaction));
+    Enqueue(new TransactionTask(transaction), priority, key);
 }
 
 template <class T>
-TransactionCallback DatabaseWorkerPool<T>::AsyncCommitTransaction(SQLTransaction<T> transaction)
+TransactionCallback DatabaseWorkerPool<T>::AsyncCommitTransaction(SQLTransaction<T> transaction, SQLPriority priority, SQLOrderKey key)
 {
 #ifdef TRINITY_DEBUG
     //! Only analyze transaction weaknesses in Debug mode.
@@ -295,7 +308,7 @@ TransactionCallback DatabaseWorkerPool<T>::AsyncCommitTransaction(SQLTransaction
 
     TransactionWithResultTask* task = new TransactionWithResultTask(transaction);
     TransactionFuture result = task->GetFuture();
-    Enqueue(task);
+    Enqueue(task, priority, key);
     return TransactionCallback(std::move(result));
 }
 
@@ -365,7 +378,7 @@ void DatabaseWorkerPool<T>::KeepAlive()
     //! as the sole purpose is to prevent connections from idling.
     auto const count = _connections[IDX_ASYNC].size();
     for (uint8 i = 0; i < count; ++i)
-        Enqueue(new PingOperation);
+        Enqueue(new PingOperation, SQL_PRIORITY_NORMAL);
 }
 
 template <class T>
@@ -426,9 +439,9 @@ unsigned long DatabaseWorkerPool<T>::EscapeString(char* to, char const* from, un
 }
 
 template <class T>
-void DatabaseWorkerPool<T>::Enqueue(SQLOperation* op)
+void DatabaseWorkerPool<T>::Enqueue(SQLOperation* op, SQLPriority priority, SQLOrderKey key)
 {
-    _queue->Push(op);
+    _queue->Push(op, priority, key);
 }
 
 template <class T>
@@ -437,6 +450,30 @@ size_t DatabaseWorkerPool<T>::QueueSize() const
     return _queue->Size();
 }
 
+template <class T>
+size_t DatabaseWorkerPool<T>::QueueSize(SQLPriority priority) const
+{
+    return _queue->Size(priority);
+}
+
+template <class T>
+void DatabaseWorkerPool<T>::SetBatchSize(uint32 size)
+{
+    _queue->SetBatchSize(size);
+}
+
+template <class T>
+void DatabaseWorkerPool<T>::SetQueueSchedule(SQLQueueSchedule const& schedule)
+{
+    _queue->SetSchedule(schedule);
+}
+
+template <class T>
+SQLQueueStats DatabaseWorkerPool<T>::GetQueueStats(SQLPriority priority)
+{
+    return _queue->GetStats(priority);
+}
+
 template <class T>
 T* DatabaseWorkerPool<T>::GetFreeConnection()
 {
@@ -471,20 +508,28 @@ char const* DatabaseWorkerPool<T>::GetDatabaseName() const
 }
 
 template <class T>
-void DatabaseWorkerPool<T>::Execute(char const* sql)
+void DatabaseWorkerPool<T>::Execute(char const* sql, SQLPriority priority, SQLOrderKey key)
 {
     if (Trinity::IsFormatEmptyOrNull(sql))
         return;
 
     BasicStatementTask* task = new BasicStatementTask(sql);
-    Enqueue(task);
+    Enqueue(task, priority, key);
+}
+
+template <class T>
+void DatabaseWorkerPool<T>::Execute(PreparedStatement<T>* stmt, SQLPriority priority, SQLOrderKey key)
+{
+    PreparedStatementTask* task = new PreparedStatementTask(stmt);
+    Enqueue(task, priority, key);
 }
 
 template <class T>
-void DatabaseWorkerPool<T>::Execute(PreparedStatement<T>* stmt)
+void DatabaseWorkerPool<T>::Execute(PreparedStatement<T>* stmt, std::function<void()>&& onComplete, SQLPriority priority, SQLOrderKey key)
 {
     PreparedStatementTask* task = new PreparedStatementTask(stmt);
-    Enqueue(task);
+    task->SetCompletionHandler(std::move(onComplete));
+    Enqueue(task, priority, key);
 }
 
 template <class T>
@@ -22,12 +22,11 @@
 #include "DatabaseEnvFwd.h"
 #include "StringFormat.h"
 #include <array>
+#include <functional>
 #include <string>
+#include <type_traits>
 #include <vector>
 
-template <typename T>
-class ProducerConsumerQueue;
-
 class SQLOperation;
 struct MySQLConnectionInfo;
 
@@ -66,15 +65,19 @@ class DatabaseWorkerPool
 
         /**
             Delayed one-way statement methods. 异步操作
+
+            All async methods take an optional SQLPriority (lane of the async queue) and SQLOrderKey.
+            Operations sharing a non-zero key run one at a time in submission order, e.g. everything
+            touching one account; the rest spread over all async connections.
         */
 
         //! Enqueues a one-way SQL operation in string format that will be executed asynchronously.
         //! This method should only be used for queries that are only executed once, e.g during startup.
-        void Execute(char const* sql); // 将一个 SQL 字符串任务加入异步队列，交由异步线程执行
+        void Execute(char const* sql, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 将一个 SQL 字符串任务加入异步队列，交由异步线程执行
 
         //! Enqueues a one-way SQL operation in string format -with variable args- that will be executed asynchronously.
         //! This method should only be used for queries that are only executed once, e.g during startup.
-        template<typename Format, typename... Args>
+        template<typename Format, typename... Args, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Format>, SQLPriority>>>
         void PExecute(Format&& sql, Args&&... args) // 格式化 SQL 字符串并将其加入异步队列。这种格式化方式允许动态生成 SQL 语句
         {
             if (Trinity::IsFormatEmptyOrNull(sql))
@@ -83,9 +86,34 @@ class DatabaseWorkerPool
             Execute(Trinity::StringFormat(std::forward<Format>(sql), std::forward<Args>(args)...).c_str());
         }
 
+        //! Same as above, in the given lane of the async queue (e.g. SQL_PRIORITY_LOW for bulk logging).
+        template<typename Format, typename... Args, typename = std::enable_if_t<!std::is_integral_v<std::decay_t<Format>>>>
+        void PExecute(SQLPriority priority, Format&& sql, Args&&... args)
+        {
+            if (Trinity::IsFormatEmptyOrNull(sql))
+                return;
+
+            Execute(Trinity::StringFormat(std::forward<Format>(sql), std::forward<Args>(args)...).c_str(), priority);
+        }
+
+        //! Same as above, ordered after earlier operations with the same key.
+        template<typename Format, typename... Args>
+        void PExecute(SQLPriority priority, SQLOrderKey key, Format&& sql, Args&&... args)
+        {
+            if (Trinity::IsFormatEmptyOrNull(sql))
+                return;
+
+            Execute(Trinity::StringFormat(std::forward<Format>(sql), std::forward<Args>(args)...).c_str(), priority, key);
+        }
+
         //! Enqueues a one-way SQL operation in prepared statement format that will be executed asynchronously.
         //! Statement must be prepared with CONNECTION_ASYNC flag.
-        void Execute(PreparedStatement<T>* stmt); // 将预处理好的 SQL 语句加入异步队列执行
+        void Execute(PreparedStatement<T>* stmt, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 将预处理好的 SQL 语句加入异步队列执行
+
+        //! Same as above, but onComplete is invoked from the worker thread once the statement was executed.
+        //! Lets readers of the written tables be notified without polling.
+        //! The handler may enqueue further work; it never blocks on a full queue.
+        void Execute(PreparedStatement<T>* stmt, std::function<void()>&& onComplete, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 执行完成后在工作线程中通知调用者
 
         /**
             Direct synchronous one-way statement methods. 同步操作
@@ -151,18 +179,22 @@ class DatabaseWorkerPool
 
         //! Enqueues a query in string format that will set the value of the QueryResultFuture return object as soon as the query is executed.
         //! The return value is then processed in ProcessQueryCallback methods.
-        QueryCallback AsyncQuery(char const* sql); // 将一个查询加入异步队列，查询结果通过回调函数处理
+        QueryCallback AsyncQuery(char const* sql, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 将一个查询加入异步队列，查询结果通过回调函数处理
 
         //! Enqueues a query in prepared format that will set the value of the PreparedQueryResultFuture return object as soon as the query is executed.
         //! The return value is then processed in ProcessQueryCallback methods.
         //! Statement must be prepared with CONNECTION_ASYNC flag.
-        QueryCallback AsyncQuery(PreparedStatement<T>* stmt); // 将一个预处理的查询加入异步队列，查询结果通过回调处理
+        QueryCallback AsyncQuery(PreparedStatement<T>* stmt, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 将一个预处理的查询加入异步队列，查询结果通过回调处理
+
+        //! Same as above, but onComplete is invoked from the worker thread once the result is set.
+        //! Event loops use it to wake up and invoke the returned callback instead of polling it.
+        QueryCallback AsyncQuery(PreparedStatement<T>* stmt, std::function<void()>&& onComplete, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 查询完成后在工作线程中通知调用者
 
         //! Enqueues a vector of SQL operations (can be both adhoc and prepared) that will set the value of the QueryResultHolderFuture
         //! return object as soon as the query is executed.
         //! The return value is then processed in ProcessQueryCallback methods.
         //! Any prepared statements added to this holder need to be prepared with the CONNECTION_ASYNC flag.
-        SQLQueryHolderCallback DelayQueryHolder(std::shared_ptr<SQLQueryHolder<T>> holder);
+        SQLQueryHolderCallback DelayQueryHolder(std::shared_ptr<SQLQueryHolder<T>> holder, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0);
 
         /**
             Transaction context methods.
@@ -173,11 +205,11 @@ class DatabaseWorkerPool
 
         //! Enqueues a collection of one-way SQL operations (can be both adhoc and prepared). The order in which these operations
         //! were appended to the transaction will be respected during execution.
-        void CommitTransaction(SQLTransaction<T> transaction); // 提交一个事务，确保按顺序执行 SQL 操作
+        void CommitTransaction(SQLTransaction<T> transaction, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 提交一个事务，确保按顺序执行 SQL 操作
 
         //! Enqueues a collection of one-way SQL operations (can be both adhoc and prepared). The order in which these operations
         //! were appended to the transaction will be respected during execution.
-        TransactionCallback AsyncCommitTransaction(SQLTransaction<T> transaction); // 将事务提交至异步队列执行
+        TransactionCallback AsyncCommitTransaction(SQLTransaction<T> transaction, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0); // 将事务提交至异步队列执行
 
         //! Directly executes a collection of one-way SQL operations (can be both adhoc and prepared). The order in which these operations
         //! were appended to the transaction will be respected during execution.
@@ -216,13 +248,25 @@ class DatabaseWorkerPool
         }
 
         size_t QueueSize() const;
+        size_t QueueSize(SQLPriority priority) const;
+
+        //! Operations an async worker of this pool takes per wakeup (1..64, default 32).
+        //! Consecutive one-way statements among them share a round trip; 1 disables batching.
+        //! A batch cut off by a lost connection is not replayed; its unacknowledged statements are logged.
+        void SetBatchSize(uint32 size);
+
+        //! Lane scheduling of the async queue, see SQLQueueSchedule. Must be set before Open().
+        void SetQueueSchedule(SQLQueueSchedule const& schedule);
+
+        //! Depth and queue wait of one lane. MaxWaitUs is reset by every call.
+        SQLQueueStats GetQueueStats(SQLPriority priority);
 
     private:
         uint32 OpenConnections(InternalIndex type, uint8 numConnections);
 
         unsigned long EscapeString(char* to, char const* from, unsigned long length);
 
-        void Enqueue(SQLOperation* op);
+        void Enqueue(SQLOperation* op, SQLPriority priority, SQLOrderKey key = 0);
 
         //! Gets a free connection in the synchronous connection pool.
         //! Caller MUST call t->Unlock() after touching the MySQL context to prevent deadlocks.
@@ -231,7 +275,7 @@ class DatabaseWorkerPool
         char const* GetDatabaseName() const;
 
         //! Queue shared by async worker threads.
-        std::unique_ptr<ProducerConsumerQueue<SQLOperation*>> _queue; // 异步 SQL 操作的队列，使用生产者-消费者模型管理异步任务
+        std::unique_ptr<SQLOperationQueue> _queue; // 异步 SQL 操作的队列，使用生产者-消费者模型管理异步任务
         std::array<std::vector<std::unique_ptr<T>>, IDX_SIZE> _connections;
         std::unique_ptr<MySQLConnectionInfo> _connectionInfo;
         std::vector<uint8> _preparedStatementSize;
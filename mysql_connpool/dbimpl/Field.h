@@ -48,6 +48,7 @@ struct QueryResultFieldMetadata
     char const* TypeName = nullptr;
     uint32 Index = 0;
     DatabaseFieldTypes Type = DatabaseFieldTypes::Null;
+    bool Unsigned = false;
 };
 
 /**
@@ -84,6 +85,7 @@ class TC_DATABASE_API Field
 {
     friend class ResultSet;
     friend class PreparedResultSet;
+    friend class JsonWriter;
 
     public:
         Field();
@@ -25,13 +25,21 @@ void SakilaDatabaseConnection::DoPrepareStatements()
         m_stmts.resize(MAX_SAKILADATABASE_STATEMENTS);
     PrepareStatement(SAKILA_SEL_ACTOR_INFO, "select actor_id, first_name, last_name, last_update from actor where actor_id = ?", CONNECTION_SYNCH);
     PrepareStatement(SAKILA_SEL_ACTOR_INFO_ASYNC, "select actor_id, first_name, last_name, last_update from actor where actor_id = ?", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_ACTOR_FILMS_ASYNC, "select f.film_id, f.title, f.release_year from film_actor fa join film f on f.film_id = fa.film_id where fa.actor_id = ? order by f.title", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_FILM_INFO_ASYNC, "select film_id, title, description, release_year, rental_rate, length, rating from film where film_id = ?", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_FILMS_BY_TITLE_ASYNC, "select film_id, title, release_year, rating from film where title like ? order by title limit ?", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_CUSTOMER_INFO_ASYNC, "select customer_id, first_name, last_name, email, active, create_date from customer where customer_id = ?", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_CUSTOMER_RENTALS_ASYNC, "select r.rental_id, r.rental_date, r.return_date, f.title from rental r join inventory i on i.inventory_id = r.inventory_id "
+        "join film f on f.film_id = i.film_id where r.customer_id = ? order by r.rental_date desc limit ?", CONNECTION_ASYNC);
+    PrepareStatement(SAKILA_SEL_FILMS, "select film_id, title, description, release_year, rental_duration, rental_rate, length, replacement_cost, rating, last_update from film", CONNECTION_SYNCH);
+    PrepareStatement(SAKILA_SEL_RENTALS, "select rental_id, rental_date, inventory_id, customer_id, return_date, staff_id, last_update from rental", CONNECTION_SYNCH);
 }
 
 SakilaDatabaseConnection::SakilaDatabaseConnection(MySQLConnectionInfo& connInfo) : MySQLConnection(connInfo)
 {
 }
 
-SakilaDatabaseConnection::SakilaDatabaseConnection(ProducerConsumerQueue<SQLOperation*>* q, MySQLConnectionInfo& connInfo) : MySQLConnection(q, connInfo)
+SakilaDatabaseConnection::SakilaDatabaseConnection(SQLOperationQueue* q, MySQLConnectionInfo& connInfo) : MySQLConnection(q, connInfo)
 {
 }
 
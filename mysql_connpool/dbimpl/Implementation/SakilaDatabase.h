@@ -29,6 +29,13 @@ enum SakilaDatabaseStatements : uint32
     */
     SAKILA_SEL_ACTOR_INFO,
     SAKILA_SEL_ACTOR_INFO_ASYNC,
+    SAKILA_SEL_ACTOR_FILMS_ASYNC,
+    SAKILA_SEL_FILM_INFO_ASYNC,
+    SAKILA_SEL_FILMS_BY_TITLE_ASYNC,
+    SAKILA_SEL_CUSTOMER_INFO_ASYNC,
+    SAKILA_SEL_CUSTOMER_RENTALS_ASYNC,
+    SAKILA_SEL_FILMS,
+    SAKILA_SEL_RENTALS,
     MAX_SAKILADATABASE_STATEMENTS
 };
 
@@ -39,7 +46,7 @@ public:
 
     //- Constructors for sync and async connections
     SakilaDatabaseConnection(MySQLConnectionInfo& connInfo);
-    SakilaDatabaseConnection(ProducerConsumerQueue<SQLOperation*>* q, MySQLConnectionInfo& connInfo);
+    SakilaDatabaseConnection(SQLOperationQueue* q, MySQLConnectionInfo& connInfo);
     ~SakilaDatabaseConnection();
 
     //- Loads database type specific prepared statements
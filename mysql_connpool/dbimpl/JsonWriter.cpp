@@ -0,0 +1,358 @@
+/*
+ * This file is part of the TrinityCore Project. See AUTHORS file for Copyright information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "JsonWriter.h"
+#include "Field.h"
+#include "MySQLWorkaround.h"
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Escape sequence letter for the bytes below 0x20, 'u' means \u00XX
+    char const ControlEscapes[32] =
+    {
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u'
+    };
+
+    char const HexDigits[] = "0123456789abcdef";
+
+    char const Base64Table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    //! Offset of the first byte that cannot be copied as is: control characters, '"', '\\' and non-ASCII
+    std::size_t FindSpecial(char const* data, std::size_t length)
+    {
+        std::size_t i = 0;
+#if defined(__SSE2__)
+        __m128i const quote = _mm_set1_epi8('"');
+        __m128i const backslash = _mm_set1_epi8('\\');
+        __m128i const space = _mm_set1_epi8(0x20);
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+            // 有符号比较，0x80 以上的字节是负数，也小于 0x20
+            __m128i special = _mm_or_si128(_mm_cmplt_epi8(bytes, space),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)));
+            if (int mask = _mm_movemask_epi8(special))
+                return i + __builtin_ctz(mask);
+        }
+#endif
+        for (; i < length; ++i)
+        {
+            uint8 c = uint8(data[i]);
+            if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+                return i;
+        }
+        return length;
+    }
+
+    //! Length of the well-formed UTF-8 sequence starting at data, 0 if there is none
+    std::size_t Utf8SequenceLength(uint8 const* data, std::size_t length)
+    {
+        uint8 lower = 0x80, upper = 0xBF;
+        std::size_t size;
+        if (data[0] >= 0xC2 && data[0] <= 0xDF)
+            size = 2;
+        else if (data[0] >= 0xE0 && data[0] <= 0xEF)
+        {
+            size = 3;
+            if (data[0] == 0xE0)
+                lower = 0xA0; // 过长编码
+            else if (data[0] == 0xED)
+                upper = 0x9F; // 代理区
+        }
+        else if (data[0] >= 0xF0 && data[0] <= 0xF4)
+        {
+            size = 4;
+            if (data[0] == 0xF0)
+                lower = 0x90;
+            else if (data[0] == 0xF4)
+                upper = 0x8F; // 超过 U+10FFFF
+        }
+        else
+            return 0;
+
+        if (length < size || data[1] < lower || data[1] > upper)
+            return 0;
+        for (std::size_t i = 2; i < size; ++i)
+            if ((data[i] & 0xC0) != 0x80)
+                return 0;
+        return size;
+    }
+
+    //! Result buffers are not aligned for the column type
+    template <typename T>
+    T ReadValue(char const* data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    char* WriteDigits(char* out, uint32 value, int digits)
+    {
+        for (int i = digits - 1; i >= 0; --i)
+        {
+            out[i] = char('0' + value % 10);
+            value /= 10;
+        }
+        return out + digits;
+    }
+}
+
+void JsonWriter::AppendString(std::string_view value)
+{
+    std::size_t const start = _buffer.size();
+    char const* data = value.data();
+    std::size_t const length = value.size();
+    std::size_t i = 0;
+
+    _buffer.push_back('"');
+    while (i < length)
+    {
+        std::size_t span = FindSpecial(data + i, length - i);
+        _buffer.append(data + i, data + i + span);
+        i += span;
+        if (i == length)
+            break;
+
+        uint8 c = uint8(data[i]);
+        if (c >= 0x80)
+        {
+            std::size_t size = Utf8SequenceLength(reinterpret_cast<uint8 const*>(data + i), length - i);
+            if (!size)
+            {
+                _buffer.resize(start);
+                AppendBase64(value);
+                return;
+            }
+            _buffer.append(data + i, data + i + size);
+            i += size;
+            continue;
+        }
+
+        char escape[6] = { '\\', char(c), 0, 0, 0, 0 };
+        std::size_t escapeLength = 2;
+        if (c < 0x20)
+        {
+            escape[1] = ControlEscapes[c];
+            if (escape[1] == 'u')
+            {
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = HexDigits[c >> 4];
+                escape[5] = HexDigits[c & 0xF];
+                escapeLength = 6;
+            }
+        }
+        _buffer.append(escape, escape + escapeLength);
+        ++i;
+    }
+    _buffer.push_back('"');
+}
+
+void JsonWriter::AppendBase64(std::string_view value)
+{
+    static char const prefix[] = "{\"base64\":\"";
+    uint8 const* data = reinterpret_cast<uint8 const*>(value.data());
+    std::size_t const length = value.size();
+    std::size_t const start = _buffer.size();
+
+    _buffer.resize(start + sizeof(prefix) - 1 + (length + 2) / 3 * 4 + 2);
+    char* out = std::copy(prefix, prefix + sizeof(prefix) - 1, _buffer.data() + start);
+    std::size_t i = 0;
+    for (; i + 3 <= length; i += 3)
+    {
+        uint32 v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *out++ = Base64Table[v >> 18];
+        *out++ = Base64Table[(v >> 12) & 0x3F];
+        *out++ = Base64Table[(v >> 6) & 0x3F];
+        *out++ = Base64Table[v & 0x3F];
+    }
+    if (i < length)
+    {
+        uint32 v = data[i] << 16;
+        if (i + 1 < length)
+            v |= data[i + 1] << 8;
+        *out++ = Base64Table[v >> 18];
+        *out++ = Base64Table[(v >> 12) & 0x3F];
+        *out++ = i + 1 < length ? Base64Table[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+    *out++ = '"';
+    *out++ = '}';
+}
+
+void JsonWriter::AppendInteger(Field const& field)
+{
+    char const* value = field.data.value;
+    bool const isUnsigned = field.meta->Unsigned;
+    switch (field.meta->Type)
+    {
+        case DatabaseFieldTypes::Int8:
+            if (isUnsigned)
+                AppendNumber(*reinterpret_cast<uint8 const*>(value));
+            else
+                AppendNumber(*reinterpret_cast<int8 const*>(value));
+            break;
+        case DatabaseFieldTypes::Int16:
+            if (isUnsigned)
+                AppendNumber(ReadValue<uint16>(value));
+            else
+                AppendNumber(ReadValue<int16>(value));
+            break;
+        case DatabaseFieldTypes::Int32:
+            if (isUnsigned)
+                AppendNumber(ReadValue<uint32>(value));
+            else
+                AppendNumber(ReadValue<int32>(value));
+            break;
+        default:
+            if (isUnsigned)
+                AppendNumber(ReadValue<uint64>(value));
+            else
+                AppendNumber(ReadValue<int64>(value));
+            break;
+    }
+}
+
+void JsonWriter::AppendBit(Field const& field)
+{
+    uint64 value = 0;
+    for (uint32 i = 0; i < field.data.length && i < sizeof(value); ++i)
+        value = (value << 8) | uint8(field.data.value[i]);
+    AppendNumber(value);
+}
+
+void JsonWriter::AppendTime(Field const& field)
+{
+    MYSQL_TIME const* time = reinterpret_cast<MYSQL_TIME const*>(field.data.value);
+    if (time->time_type == MYSQL_TIMESTAMP_TIME)
+    {
+        // TIME 的小时可以超过 24，也可以是负数
+        fmt::format_to(_buffer, "\"{}{:02}:{:02}:{:02}", time->neg ? "-" : "", time->hour, time->minute, time->second);
+        if (time->second_part)
+            fmt::format_to(_buffer, ".{:06}", time->second_part);
+        _buffer.push_back('"');
+        return;
+    }
+
+    char text[32];
+    char* out = text;
+    *out++ = '"';
+    out = WriteDigits(out, time->year, 4);
+    *out++ = '-';
+    out = WriteDigits(out, time->month, 2);
+    *out++ = '-';
+    out = WriteDigits(out, time->day, 2);
+    if (time->time_type != MYSQL_TIMESTAMP_DATE)
+    {
+        *out++ = ' ';
+        out = WriteDigits(out, time->hour, 2);
+        *out++ = ':';
+        out = WriteDigits(out, time->minute, 2);
+        *out++ = ':';
+        out = WriteDigits(out, time->second, 2);
+        if (time->second_part)
+        {
+            *out++ = '.';
+            out = WriteDigits(out, uint32(time->second_part), 6);
+        }
+    }
+    *out++ = '"';
+    _buffer.append(text, out);
+}
+
+void JsonWriter::AppendField(Field const& field)
+{
+    if (field.IsNull())
+    {
+        Append("null");
+        return;
+    }
+
+    std::string_view const text(field.data.value, field.data.length);
+    switch (field.meta->Type)
+    {
+        case DatabaseFieldTypes::Int8:
+        case DatabaseFieldTypes::Int16:
+        case DatabaseFieldTypes::Int32:
+        case DatabaseFieldTypes::Int64:
+            if (field.meta->TypeName && std::strcmp(field.meta->TypeName, "BIT") == 0)
+                AppendBit(field); // BIT(n) 在两种协议下都是大端字节，不是文本数字
+            else if (field.data.raw)
+                AppendInteger(field);
+            else
+                Append(text); // 文本协议的整数本身就是合法的 JSON 数字
+            break;
+        case DatabaseFieldTypes::Float:
+            if (field.data.raw)
+                AppendFloat(ReadValue<float>(field.data.value));
+            else
+                Append(text);
+            break;
+        case DatabaseFieldTypes::Double:
+            if (field.data.raw)
+                AppendFloat(ReadValue<double>(field.data.value));
+            else
+                Append(text);
+            break;
+        case DatabaseFieldTypes::Decimal:
+            Append(text); // 两种协议都按文本返回，保留精度
+            break;
+        case DatabaseFieldTypes::Date:
+            if (field.data.raw)
+                AppendTime(field);
+            else
+                AppendString(text);
+            break;
+        case DatabaseFieldTypes::Binary:
+            AppendString(text);
+            break;
+        default:
+            Append("null");
+            break;
+    }
+}
+
+void JsonWriter::AppendRow(Field const* fields, uint32 count)
+{
+    _buffer.push_back('[');
+    for (uint32 i = 0; i < count; ++i)
+    {
+        if (i)
+            _buffer.push_back(',');
+        AppendField(fields[i]);
+    }
+    _buffer.push_back(']');
+}
+
+void JsonWriter::AppendColumns(std::vector<QueryResultFieldMetadata> const& metadata)
+{
+    _buffer.push_back('[');
+    for (std::size_t i = 0; i < metadata.size(); ++i)
+    {
+        if (i)
+            _buffer.push_back(',');
+        AppendString(metadata[i].Alias ? metadata[i].Alias : "");
+    }
+    _buffer.push_back(']');
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of the TrinityCore Project. See AUTHORS file for Copyright information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JSONWRITER_H
+#define _JSONWRITER_H
+
+#include "Define.h"
+#include "DatabaseEnvFwd.h"
+#include <cmath>
+#include <fmt/format.h>
+#include <string_view>
+#include <vector>
+
+/**
+    @class JsonWriter
+
+    @brief Appends query results to a reusable buffer as JSON
+
+    Fields are encoded straight from the result buffers by their metadata type,
+    without going through Field::GetString(), so a row costs no allocation once
+    the buffer has grown to its working size. Works for both ResultSet (text
+    protocol) and PreparedResultSet (binary protocol) rows.
+
+    | Field type  | JSON                                            |
+    |-------------|-------------------------------------------------|
+    | NULL        | null                                            |
+    | Int8-Int64  | number, signed or unsigned as the column        |
+    | Float       | shortest number that reads back as the float    |
+    | Double      | shortest number that reads back as the double   |
+    | Decimal     | number, exact text from the server              |
+    | Date        | "YYYY-MM-DD", "YYYY-MM-DD hh:mm:ss[.ffffff]"    |
+    | Binary      | string, or {"base64": "..."} if not valid UTF-8 |
+*/
+class TC_DATABASE_API JsonWriter
+{
+    public:
+        void Clear() { _buffer.clear(); }
+        char const* Data() const { return _buffer.data(); }
+        std::size_t Size() const { return _buffer.size(); }
+        std::string_view View() const { return { _buffer.data(), _buffer.size() }; }
+
+        void Append(std::string_view raw) { _buffer.append(raw.data(), raw.data() + raw.size()); }
+        void Append(char c) { _buffer.push_back(c); }
+
+        //! Quoted and escaped; invalid UTF-8 is written as {"base64": "..."} instead
+        void AppendString(std::string_view value); // 转义时用 SIMD 一次扫描 16 字节，找到需要转义的字符才逐个处理
+        void AppendField(Field const& field);
+        //! [value, ...]
+        void AppendRow(Field const* fields, uint32 count);
+        //! ["alias", ...]
+        void AppendColumns(std::vector<QueryResultFieldMetadata> const& metadata);
+
+    private:
+        template <typename T>
+        void AppendNumber(T value)
+        {
+            fmt::format_int digits(value);
+            _buffer.append(digits.data(), digits.data() + digits.size());
+        }
+
+        //! JSON has no nan/inf, those are written as null
+        template <typename T>
+        void AppendFloat(T value)
+        {
+            if (std::isfinite(value))
+                fmt::format_to(_buffer, "{}", value);
+            else
+                Append("null");
+        }
+
+        void AppendInteger(Field const& field);
+        void AppendBit(Field const& field);
+        void AppendTime(Field const& field);
+        void AppendBase64(std::string_view value);
+
+        fmt::memory_buffer _buffer;
+};
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * This file is part of the TrinityCore Project. See AUTHORS file for Copyright information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MPMCQUEUE_H
+#define _MPMCQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#  include <immintrin.h>
+#endif
+
+//! Bounded multi-producer multi-consumer ring without any waiting.
+//! Push and Pop claim a slot with one CAS (each slot carries a sequence number), so producers
+//! and consumers never take a lock.
+template <typename T>
+class MPMCRing
+{
+private:
+    static constexpr size_t CacheLine = 64;
+
+    struct Cell
+    {
+        std::atomic<size_t> Sequence;
+        T Value;
+    };
+
+    alignas(CacheLine) std::atomic<size_t> _enqueuePos;
+    alignas(CacheLine) std::atomic<size_t> _dequeuePos;
+    alignas(CacheLine) std::unique_ptr<Cell[]> _cells;
+    size_t _mask;
+
+public:
+    //! capacity is rounded up to a power of two.
+    explicit MPMCRing(size_t capacity = 65536) : _enqueuePos(0), _dequeuePos(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+
+        _cells.reset(new Cell[size]);
+        _mask = size - 1;
+        for (size_t i = 0; i < size; ++i)
+            _cells[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MPMCRing(MPMCRing const&) = delete;
+    MPMCRing& operator=(MPMCRing const&) = delete;
+
+    //! Returns false if the ring is full.
+    bool TryPush(T const& value)
+    {
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->Sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+
+        cell->Value = value;
+        cell->Sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& value)
+    {
+        return TryPopBatch(&value, 1) != 0;
+    }
+
+    //! Claims the run of published slots at the head, up to max, with a single CAS.
+    size_t TryPopBatch(T* values, size_t max)
+    {
+        size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        size_t count;
+        for (;;)
+        {
+            size_t seq = _cells[pos & _mask].Sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff < 0)
+                return 0;
+
+            if (diff > 0)
+            {
+                pos = _dequeuePos.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            count = 1;
+            while (count < max && _cells[(pos + count) & _mask].Sequence.load(std::memory_order_acquire) == pos + count + 1)
+                ++count;
+
+            if (_dequeuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                break;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            Cell& cell = _cells[(pos + i) & _mask];
+            values[i] = std::move(cell.Value);
+            cell.Sequence.store(pos + i + _mask + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    //! Approximate while producers or consumers are running.
+    size_t Size() const
+    {
+        size_t dequeuePos = _dequeuePos.load(std::memory_order_relaxed);
+        size_t enqueuePos = _enqueuePos.load(std::memory_order_relaxed);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+
+    size_t Capacity() const
+    {
+        return _mask + 1;
+    }
+};
+
+//! Spin-then-park waiting for consumers of one or more MPMCRings.
+//! An idle consumer spins for a while before it parks on a condition variable, and producers
+//! only touch the mutex when someone is parked.
+class QueueParker
+{
+private:
+    static constexpr uint32_t MinSpin = 16;
+    static constexpr uint32_t MaxSpin = 4096;
+
+    alignas(64) std::atomic<uint32_t> _sleepers;
+    std::atomic<uint32_t> _spin;    // 消费者进入休眠前的自旋次数，按最近的命中情况调整；单核上不自旋
+    std::atomic<bool> _shutdown;
+    std::mutex _parkLock;
+    std::condition_variable _condition;
+
+public:
+    QueueParker() : _sleepers(0), _spin(std::thread::hardware_concurrency() > 1 ? MinSpin * 8 : 0), _shutdown(false) { }
+
+    QueueParker(QueueParker const&) = delete;
+    QueueParker& operator=(QueueParker const&) = delete;
+
+    //! Called by producers after a value was published.
+    void Notify()
+    {
+        // 和 Wait 中的 fence 配对：要么这里看到休眠的消费者，要么消费者休眠前看到这个元素
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleepers.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(_parkLock);
+            _condition.notify_one();
+        }
+    }
+
+    //! Calls tryPop until it returns non-zero, spinning first and then sleeping.
+    //! Returns 0 once canceled.
+    template <typename TryPop>
+    size_t Wait(TryPop&& tryPop)
+    {
+        if (IsCanceled())
+            return 0;
+
+        if (size_t count = tryPop())
+            return count;
+
+        uint32_t spin = _spin.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < spin; ++i)
+        {
+            Pause();
+
+            if (IsCanceled())
+                return 0;
+
+            if (size_t count = tryPop())
+            {
+                if (spin < MaxSpin) // 自旋等到了，下次多等一会
+                    _spin.store(spin * 2, std::memory_order_relaxed);
+                return count;
+            }
+        }
+
+        if (spin > MinSpin)
+            _spin.store(spin / 2, std::memory_order_relaxed);
+
+        std::unique_lock<std::mutex> lock(_parkLock);
+        _sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        size_t count = 0;
+        while (!IsCanceled() && !(count = tryPop()))
+            _condition.wait(lock);
+
+        _sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return count;
+    }
+
+    void Cancel()
+    {
+        _shutdown.store(true, std::memory_order_seq_cst);
+
+        std::lock_guard<std::mutex> lock(_parkLock);
+        _condition.notify_all();
+    }
+
+    bool IsCanceled() const
+    {
+        return _shutdown.load(std::memory_order_relaxed);
+    }
+
+    //! Full ring: spin briefly, then yield, then sleep so a stalled database does not burn the producers' CPU.
+    static void Backoff(uint32_t attempt)
+    {
+        if (attempt < 64)
+            Pause();
+        else if (attempt < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    static void Pause()
+    {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+};
+
+//! Bounded multi-producer multi-consumer queue, a drop-in for ProducerConsumerQueue built from
+//! an MPMCRing and a QueueParker. Push blocks while the ring is full, which pushes back on the
+//! producers instead of growing.
+template <typename T>
+class MPMCQueue
+{
+private:
+    MPMCRing<T> _ring;
+    QueueParker _parker;
+
+public:
+    explicit MPMCQueue(size_t capacity = 65536) : _ring(capacity) { }
+
+    //! Returns false if the queue is full.
+    bool TryPush(T const& value)
+    {
+        if (!_ring.TryPush(value))
+            return false;
+
+        _parker.Notify();
+        return true;
+    }
+
+    void Push(T const& value)
+    {
+        for (uint32_t i = 0; !TryPush(value); ++i)
+            QueueParker::Backoff(i);
+    }
+
+    //! Returns false if the queue is empty or canceled.
+    bool Pop(T& value)
+    {
+        return !_parker.IsCanceled() && _ring.TryPop(value);
+    }
+
+    void WaitAndPop(T& value)
+    {
+        _parker.Wait([&]() { return _ring.TryPopBatch(&value, 1); });
+    }
+
+    //! Waits like WaitAndPop, then takes whatever else is ready, up to max values in total.
+    //! Returns the number of values taken, 0 if the queue was canceled.
+    size_t WaitAndPopBatch(T* values, size_t max)
+    {
+        return _parker.Wait([&]() { return _ring.TryPopBatch(values, max); });
+    }
+
+    bool Empty() const
+    {
+        return _ring.Size() == 0;
+    }
+
+    //! Approximate while producers or consumers are running.
+    size_t Size() const
+    {
+        return _ring.Size();
+    }
+
+    size_t Capacity() const
+    {
+        return _ring.Capacity();
+    }
+
+    void Cancel()
+    {
+        _parker.Cancel();
+
+        T value;
+        while (_ring.TryPop(value))
+            DeleteQueuedObject(value);
+    }
+
+private:
+    template<typename E = T>
+    typename std::enable_if<std::is_pointer<E>::value>::type DeleteQueuedObject(E& obj) { delete obj; }
+
+    template<typename E = T>
+    typename std::enable_if<!std::is_pointer<E>::value>::type DeleteQueuedObject(E const& /*packet*/) { }
+};
+
+#endif
@@ -28,6 +28,51 @@
 #include <errmsg.h>
 #include "MySQLWorkaround.h"
 #include <mysqld_error.h>
+#include <fmt/format.h>
+#include <cmath>
+#include <iterator>
+#include <string_view>
+
+namespace
+{
+    //! Larger batches are split so they stay well below max_allowed_packet (4MB by default on 5.7)
+    constexpr size_t MAX_BATCH_SQL_SIZE = 1024 * 1024;
+
+    //! Returns where the statement ends, without trailing blanks and semicolons, or npos if it can't be
+    //! joined with others: it holds more than one statement or a comment that would swallow the separator.
+    //! Collects the positions of '?' placeholders outside of quotes.
+    size_t ScanStatement(std::string_view sql, std::vector<size_t>* placeholders)
+    {
+        size_t end = sql.size();
+        for (size_t i = 0; i < sql.size(); ++i)
+        {
+            char c = sql[i];
+            if (c == '\'' || c == '"' || c == '`')
+            {
+                for (++i; i < sql.size() && sql[i] != c; ++i)
+                    if (sql[i] == '\\' && c != '`')
+                        ++i;
+                if (i >= sql.size())
+                    return std::string_view::npos;
+            }
+            else if (c == '#' || (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-') || (c == '/' && i + 1 < sql.size() && sql[i + 1] == '*'))
+                return std::string_view::npos;
+            else if (c == '?' && placeholders)
+                placeholders->push_back(i);
+            else if (c == ';')
+            {
+                if (sql.find_first_not_of("; \t\r\n", i) != std::string_view::npos)
+                    return std::string_view::npos;
+                end = i;
+                break;
+            }
+        }
+
+        while (end && (sql[end - 1] == ' ' || sql[end - 1] == '\t' || sql[end - 1] == '\r' || sql[end - 1] == '\n'))
+            --end;
+        return end;
+    }
+}
 
 namespace Trinity
 {
@@ -73,15 +118,17 @@ m_prepareError(false),
 m_queue(nullptr),
 m_Mysql(nullptr),
 m_connectionInfo(connInfo),
-m_connectionFlags(CONNECTION_SYNCH) { }
+m_connectionFlags(CONNECTION_SYNCH),
+m_multiStatements(false) { }
 
-MySQLConnection::MySQLConnection(ProducerConsumerQueue<SQLOperation*>* queue, MySQLConnectionInfo& connInfo) :
+MySQLConnection::MySQLConnection(SQLOperationQueue* queue, MySQLConnectionInfo& connInfo) :
 m_reconnecting(false),
 m_prepareError(false),
 m_queue(queue),
 m_Mysql(nullptr),
 m_connectionInfo(connInfo),
-m_connectionFlags(CONNECTION_ASYNC)
+m_connectionFlags(CONNECTION_ASYNC),
+m_multiStatements(false)
 {
     m_worker = std::make_unique<DatabaseWorker>(m_queue, this);
 }
@@ -189,6 +236,7 @@ uint32 MySQLConnection::Open()
         // set connection properties to UTF8 to properly handle locales for different
         // server configs - core sends data in UTF8, so MySQL must expect UTF8 too
         mysql_set_character_set(m_Mysql, "utf8mb4");
+        m_multiStatements = false;
         return 0;
     }
     else
@@ -211,6 +259,8 @@ bool MySQLConnection::Execute(char const* sql)
     if (!m_Mysql)
         return false;
 
+    SetMultiStatements(false);
+
     {
         uint32 _s = getMSTime();
 
@@ -280,6 +330,173 @@ bool MySQLConnection::Execute(PreparedStatementBase* stmt)
     return true;
 }
 
+bool MySQLConnection::SetMultiStatements(bool enable)
+{
+    if (m_multiStatements == enable)
+        return true;
+
+    if (mysql_set_server_option(m_Mysql, enable ? MYSQL_OPTION_MULTI_STATEMENTS_ON : MYSQL_OPTION_MULTI_STATEMENTS_OFF))
+        return false;
+
+    m_multiStatements = enable;
+    return true;
+}
+
+bool MySQLConnection::AppendBatch(char const* sql, std::string& batch)
+{
+    // 不同 sql_mode 下反斜杠的含义不同，这种语句不敢保证和其它语句拼接后边界不变
+    std::string_view query(sql);
+    if (query.find('\\') != std::string_view::npos)
+        return false;
+
+    size_t end = ScanStatement(query, nullptr);
+    if (end == std::string_view::npos || !end)
+        return false;
+
+    batch.append(query.data(), end);
+    return true;
+}
+
+bool MySQLConnection::AppendBatch(PreparedStatementBase* stmt, std::string& batch)
+{
+    MySQLPreparedStatement* m_mStmt = GetPreparedStatement(stmt->GetIndex());
+    if (!m_mStmt)
+        return false;
+
+    std::string const& query = m_mStmt->m_queryString;
+    std::vector<PreparedStatementData> const& parameters = stmt->GetParameters();
+    m_placeholders.clear();
+    size_t end = ScanStatement(query, &m_placeholders);
+    if (end == std::string_view::npos || m_placeholders.size() != parameters.size())
+        return false;
+
+    size_t const start = batch.size();
+    size_t from = 0;
+    for (size_t i = 0; i < parameters.size(); ++i)
+    {
+        batch.append(query, from, m_placeholders[i] - from);
+        from = m_placeholders[i] + 1;
+
+        // 文本协议下的值和二进制协议绑定的值要完全一致，做不到的（比如 NaN）交给预处理语句执行
+        bool rendered = std::visit([&](auto const& value) -> bool
+        {
+            using V = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<V, std::nullptr_t>)
+                batch += "NULL";
+            else if constexpr (std::is_same_v<V, bool>)
+                batch += value ? '1' : '0';
+            else if constexpr (std::is_same_v<V, std::string>)
+            {
+                size_t offset = batch.size() + 1;
+                batch.resize(offset + value.size() * 2 + 1);
+                batch[offset - 1] = '\'';
+                unsigned long length = mysql_real_escape_string(m_Mysql, &batch[offset], value.data(), value.size());
+                if (length == (unsigned long)-1) // NO_BACKSLASH_ESCAPES
+                    return false;
+                batch.resize(offset + length);
+                batch += '\'';
+            }
+            else if constexpr (std::is_same_v<V, std::vector<uint8>>)
+            {
+                static char const hex[] = "0123456789ABCDEF";
+                batch += "X'";
+                for (uint8 byte : value)
+                {
+                    batch += hex[byte >> 4];
+                    batch += hex[byte & 15];
+                }
+                batch += '\'';
+            }
+            else if constexpr (std::is_floating_point_v<V>)
+            {
+                if (!std::isfinite(value))
+                    return false;
+                // float 要按服务端展宽后的 double 输出，0.1f 是 0.10000000149011612 而不是 0.1
+                fmt::format_to(std::back_inserter(batch), "{}", static_cast<double>(value));
+            }
+            else
+                fmt::format_to(std::back_inserter(batch), "{}", value);
+            return true;
+        }, parameters[i].data);
+
+        if (!rendered)
+        {
+            batch.resize(start);
+            return false;
+        }
+    }
+
+    batch.append(query, from, end - from);
+    return true;
+}
+
+size_t MySQLConnection::ExecuteBatch(SQLOperation* const* ops, size_t count)
+{
+    if (!m_Mysql || count < 2)
+        return 0;
+
+    m_batch.clear();
+    m_batchOffsets.clear();
+    size_t n = 0;
+    for (; n < count; ++n)
+    {
+        size_t const start = m_batch.size();
+        if (n)
+            m_batch += ';';
+        if (!ops[n]->AppendBatch(m_batch) || (n && m_batch.size() > MAX_BATCH_SQL_SIZE))
+        {
+            m_batch.resize(start);
+            break;
+        }
+        m_batchOffsets.push_back(n ? start + 1 : start);
+    }
+
+    // 只在发送批次时打开多语句，其它文本查询执行前会关掉，拼接的 SQL 不会因此多出语句
+    if (n < 2 || !SetMultiStatements(true))
+        return 0;
+
+    m_batchOffsets.push_back(m_batch.size() + 1);
+
+    uint32 _s = getMSTime();
+
+    // 服务器按顺序执行，遇到第一个出错的语句就停止，done 是已经成功的语句数
+    size_t done = 0;
+    int status = mysql_real_query(m_Mysql, m_batch.data(), static_cast<unsigned long>(m_batch.size()));
+    if (!status)
+    {
+        do
+        {
+            if (MYSQL_RES* result = mysql_store_result(m_Mysql))
+                mysql_free_result(result);
+            ++done;
+        } while ((status = mysql_next_result(m_Mysql)) == 0);
+    }
+
+    if (status <= 0 && done == n)
+    {
+        TC_LOG_DEBUG("sql.sql", "[%u ms] SQL batch of " SZFMTD " statements", getMSTimeDiff(_s, getMSTime()), n);
+        return n;
+    }
+
+    uint32 lErrno = mysql_errno(m_Mysql);
+    TC_LOG_INFO("sql.sql", "SQL: %.*s", int(m_batchOffsets[done + 1] - 1 - m_batchOffsets[done]), m_batch.data() + m_batchOffsets[done]);
+    TC_LOG_ERROR("sql.sql", "[%u] %s", lErrno, mysql_error(m_Mysql));
+
+    if (_HandleMySQLErrno(lErrno))
+    {
+        // 连接断开：服务器可能已经执行了还没读到结果的语句，重放会重复写入，只记录下来不再执行
+        for (size_t i = done; i < n; ++i)
+            TC_LOG_ERROR("sql.sql", "Connection lost during SQL batch, statement may or may not have been applied: %.*s",
+                int(m_batchOffsets[i + 1] - 1 - m_batchOffsets[i]), m_batch.data() + m_batchOffsets[i]);
+        return n;
+    }
+
+    // 语句出错时服务器停在这一句，后面的确实没有执行，逐个执行它们
+    for (size_t i = done + 1; i < n; ++i)
+        ops[i]->call();
+    return n;
+}
+
 bool MySQLConnection::_Query(PreparedStatementBase* stmt, MySQLPreparedStatement** mysqlStmt, MySQLResult** pResult, uint64* pRowCount, uint32* pFieldCount)
 {
     if (!m_Mysql)
@@ -355,6 +572,8 @@ bool MySQLConnection::_Query(const char* sql, MySQLResult** pResult, MySQLField*
     if (!m_Mysql)
         return false;
 
+    SetMultiStatements(false);
+
     {
         uint32 _s = getMSTime();
 
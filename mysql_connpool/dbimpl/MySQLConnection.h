@@ -26,9 +26,6 @@
 #include <string>
 #include <vector>
 
-template <typename T>
-class ProducerConsumerQueue;
-
 class DatabaseWorker;
 class MySQLPreparedStatement;
 class SQLOperation;
@@ -59,7 +56,7 @@ class TC_DATABASE_API MySQLConnection
 
     public:
         MySQLConnection(MySQLConnectionInfo& connInfo);                               //! Constructor for synchronous connections.
-        MySQLConnection(ProducerConsumerQueue<SQLOperation*>* queue, MySQLConnectionInfo& connInfo);  //! Constructor for asynchronous connections.
+        MySQLConnection(SQLOperationQueue* queue, MySQLConnectionInfo& connInfo);     //! Constructor for asynchronous connections.
         virtual ~MySQLConnection();
 
         virtual uint32 Open();
@@ -78,6 +75,17 @@ class TC_DATABASE_API MySQLConnection
         void RollbackTransaction();
         void CommitTransaction();
         int ExecuteTransaction(std::shared_ptr<TransactionBase> transaction);
+
+        //! Renders a one-way statement as SQL text at the end of a multi-statement batch.
+        //! Returns false (leaving batch untouched) if the statement has to run on its own.
+        bool AppendBatch(char const* sql, std::string& batch);
+        bool AppendBatch(PreparedStatementBase* stmt, std::string& batch);
+        //! Sends the leading run of batchable operations in ops as one multi-statement query.
+        //! Returns how many operations were consumed, 0 if fewer than two could be batched.
+        //! If a statement fails, the ones after it run on their own. If the connection is lost,
+        //! statements without a result are logged and not replayed (at most once), since the
+        //! server may already have applied them.
+        size_t ExecuteBatch(SQLOperation* const* ops, size_t count);
         size_t EscapeString(char* to, const char* from, size_t length);
         void Ping();
 
@@ -105,13 +113,18 @@ class TC_DATABASE_API MySQLConnection
 
     private:
         bool _HandleMySQLErrno(uint32 errNo, uint8 attempts = 5);
+        bool SetMultiStatements(bool enable);
 
-        ProducerConsumerQueue<SQLOperation*>* m_queue;      //! Queue shared with other asynchronous connections.
+        SQLOperationQueue*    m_queue;                      //! Queue shared with other asynchronous connections.
         std::unique_ptr<DatabaseWorker> m_worker;           //! Core worker task.
         MySQLHandle*          m_Mysql;                      //! MySQL Handle.
         MySQLConnectionInfo&  m_connectionInfo;             //! Connection info (used for logging)
         ConnectionFlags       m_connectionFlags;            //! Connection flags (for preparing relevant statements)
         std::mutex            m_Mutex;
+        bool                  m_multiStatements;            //! Multi-statement queries enabled (by ExecuteBatch, until the next text query)
+        std::string           m_batch;                      //! Batch being built by ExecuteBatch, reused between batches
+        std::vector<size_t>   m_batchOffsets;               //! Start of each statement in m_batch
+        std::vector<size_t>   m_placeholders;               //! '?' positions of the statement being rendered
 
         MySQLConnection(MySQLConnection const& right) = delete;
         MySQLConnection& operator=(MySQLConnection const& right) = delete;
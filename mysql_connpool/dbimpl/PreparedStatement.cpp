@@ -153,6 +153,11 @@ bool PreparedStatementTask::Execute()
     return m_conn->Execute(m_stmt);
 }
 
+bool PreparedStatementTask::AppendBatch(std::string& sql)
+{
+    return !m_has_result && m_conn->AppendBatch(m_stmt, sql);
+}
+
 template<typename T>
 std::string PreparedStatementData::ToString(T value)
 {
@@ -119,6 +119,7 @@ class TC_DATABASE_API PreparedStatementTask : public SQLOperation
         ~PreparedStatementTask();
 
         bool Execute() override;
+        bool AppendBatch(std::string& sql) override;
         PreparedQueryResultFuture GetFuture() { return m_result->get_future(); }
 
     protected:
@@ -28,7 +28,7 @@ template <typename T>
 class ProducerConsumerQueue
 {
 private:
-    std::mutex _queueLock;
+    mutable std::mutex _queueLock;
     std::queue<T> _queue;
     std::condition_variable _condition;
     std::atomic<bool> _shutdown;
@@ -54,6 +54,8 @@ public:
 
     size_t Size() const
     {
+        std::lock_guard<std::mutex> lock(_queueLock);
+
         return _queue.size();
     }
 
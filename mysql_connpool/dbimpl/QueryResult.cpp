@@ -161,6 +161,7 @@ void InitializeDatabaseFieldMetadata(QueryResultFieldMetadata* meta, MySQLField
     meta->TypeName = FieldTypeToString(field->type);
     meta->Index = fieldIndex;
     meta->Type = MysqlTypeToFieldType(field->type);
+    meta->Unsigned = (field->flags & UNSIGNED_FLAG) != 0;
 }
 }
 
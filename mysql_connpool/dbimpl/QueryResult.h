@@ -35,6 +35,8 @@ class TC_DATABASE_API ResultSet
         Field* Fetch() const { return _currentRow; }
         Field const& operator[](std::size_t index) const;
 
+        std::vector<QueryResultFieldMetadata> const& GetFieldMetadata() const { return _fieldMetadata; }
+
     protected:
         std::vector<QueryResultFieldMetadata> _fieldMetadata;
         uint64 _rowCount;
@@ -63,6 +65,8 @@ class TC_DATABASE_API PreparedResultSet
         Field* Fetch() const;
         Field const& operator[](std::size_t index) const;
 
+        std::vector<QueryResultFieldMetadata> const& GetFieldMetadata() const { return m_fieldMetadata; }
+
     protected:
         std::vector<QueryResultFieldMetadata> m_fieldMetadata;
         std::vector<Field> m_rows;
@@ -20,6 +20,9 @@
 
 #include "Define.h"
 #include "DatabaseEnvFwd.h"
+#include "Duration.h"
+#include <functional>
+#include <string>
 
 //- Union that holds element data
 union SQLElementUnion
@@ -47,7 +50,7 @@ class MySQLConnection;
 class TC_DATABASE_API SQLOperation
 {
     public:
-        SQLOperation(): m_conn(nullptr) { }
+        SQLOperation(): m_conn(nullptr), m_orderKey(0) { }
         virtual ~SQLOperation() { }
 
         virtual int call()
@@ -58,9 +61,26 @@ class TC_DATABASE_API SQLOperation
         virtual bool Execute() = 0;
         virtual void SetConnection(MySQLConnection* con) { m_conn = con; }
 
+        //! One-way statements append their SQL text so the worker can send them together with
+        //! their neighbours as one multi-statement query. Returns false if the operation must run on its own.
+        virtual bool AppendBatch(std::string& /*sql*/) { return false; }
+
+        //! Called by the worker thread after the operation ran and its result (if any) is available.
+        //! Lets an event loop be woken up instead of polling the future.
+        void SetCompletionHandler(std::function<void()>&& handler) { m_completion = std::move(handler); }
+        void Complete()
+        {
+            if (m_completion)
+                m_completion();
+        }
+
         MySQLConnection* m_conn;
+        TimePoint m_queueTime;          //! Set by SQLOperationQueue::Push, for the wait-time metrics
+        SQLOrderKey m_orderKey;         //! Released by SQLOperationQueue::Finish
 
     private:
+        std::function<void()> m_completion;
+
         SQLOperation(SQLOperation const& right) = delete;
         SQLOperation& operator=(SQLOperation const& right) = delete;
 };
@@ -0,0 +1,335 @@
+/*
+ * This file is part of the TrinityCore Project. See AUTHORS file for Copyright information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SQLOperationQueue.h"
+#include "Errors.h"
+#include "SQLOperation.h"
+#include <algorithm>
+
+namespace
+{
+    //! Queue whose WaitAndPopBatch the current thread runs, pushes from there must not block
+    thread_local SQLOperationQueue const* WorkerQueue = nullptr;
+
+    int64 Ticks(TimePoint time)
+    {
+        return time.time_since_epoch().count();
+    }
+}
+
+SQLOperationQueue::SQLOperationQueue() : _overflowSize(0), _tick(0), _workers(1), _batchSize(32)
+{
+    SetSchedule(SQLQueueSchedule());
+}
+
+void SQLOperationQueue::Push(SQLOperation* op, SQLPriority priority, SQLOrderKey key)
+{
+    ASSERT(priority < MAX_SQL_PRIORITY);
+
+    op->m_queueTime = std::chrono::steady_clock::now();
+    op->m_orderKey = key;
+
+    if (key)
+    {
+        KeyShard& shard = GetKeyShard(key);
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        auto itr = shard.Pending.find(key);
+        if (itr != shard.Pending.end())
+        {
+            // 同一个 key 已有操作在排队或执行，等它 Finish 后再进入车道
+            itr->second.emplace_back(op, priority);
+            _lanes[priority].Blocked.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        shard.Pending.emplace(key, KeyBacklog());
+    }
+
+    PushLane(op, priority);
+}
+
+SQLOperation* SQLOperationQueue::Finish(SQLOperation* op)
+{
+    if (!op->m_orderKey)
+        return nullptr;
+
+    std::pair<SQLOperation*, SQLPriority> next;
+    {
+        KeyShard& shard = GetKeyShard(op->m_orderKey);
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        auto itr = shard.Pending.find(op->m_orderKey);
+        ASSERT(itr != shard.Pending.end());
+        if (itr->second.empty())
+        {
+            shard.Pending.erase(itr);
+            return nullptr;
+        }
+
+        next = itr->second.front();
+        itr->second.pop_front();
+        _lanes[next.second].Blocked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // 关闭时 Cancel 可能已经清空了车道，不再放回去
+    if (_parker.IsCanceled())
+    {
+        delete next.first;
+        return nullptr;
+    }
+
+    // 只有工作线程在消费车道，这里不能等空位，车道满了就让调用者自己执行
+    if (!TryPushLane(next.first, next.second))
+        return next.first;
+
+    return nullptr;
+}
+
+void SQLOperationQueue::PushLane(SQLOperation* op, SQLPriority priority)
+{
+    if (WorkerQueue == this)
+    {
+        // 只有工作线程在消费车道，工作线程自己等空位会全部卡死
+        if (TryPushLane(op, priority))
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(_overflowLock);
+            _overflow.push_back(op);
+            _overflowSize.fetch_add(1, std::memory_order_relaxed);
+        }
+        _parker.Notify();
+        return;
+    }
+
+    for (uint32 i = 0; !TryPushLane(op, priority); ++i)
+        QueueParker::Backoff(i);
+}
+
+bool SQLOperationQueue::TryPushLane(SQLOperation* op, SQLPriority priority)
+{
+    Lane& lane = _lanes[priority];
+
+    // 空车道不算在挨饿，从现在开始计时
+    if (!lane.Ring.Size())
+        lane.LastServed.store(Ticks(std::chrono::steady_clock::now()), std::memory_order_relaxed);
+
+    if (!lane.Ring.TryPush(op))
+        return false;
+
+    _parker.Notify();
+    return true;
+}
+
+SQLOperationQueue::KeyShard& SQLOperationQueue::GetKeyShard(SQLOrderKey key)
+{
+    // 连续的 id 分散到不同分片
+    return _keys[(key * UI64LIT(0x9E3779B97F4A7C15)) >> 58];
+}
+
+size_t SQLOperationQueue::WaitAndPopBatch(SQLOperation** ops, size_t max)
+{
+    WorkerQueue = this;
+    return _parker.Wait([&]() { return TryPopBatch(ops, max); });
+}
+
+void SQLOperationQueue::Cancel()
+{
+    _parker.Cancel();
+
+    for (KeyShard& shard : _keys)
+    {
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        for (auto& pending : shard.Pending)
+        {
+            for (std::pair<SQLOperation*, SQLPriority>& op : pending.second)
+            {
+                _lanes[op.second].Blocked.fetch_sub(1, std::memory_order_relaxed);
+                delete op.first;
+            }
+            pending.second.clear();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_overflowLock);
+        for (SQLOperation* op : _overflow)
+            delete op;
+        _overflowSize.fetch_sub(_overflow.size(), std::memory_order_relaxed);
+        _overflow.clear();
+    }
+
+    for (Lane& lane : _lanes)
+    {
+        SQLOperation* op;
+        while (lane.Ring.TryPop(op))
+            delete op;
+    }
+}
+
+void SQLOperationQueue::SetSchedule(SQLQueueSchedule const& schedule)
+{
+    _schedule = schedule;
+
+    // 平滑加权轮转：每一轮中各车道按权重出现，并且尽量错开
+    _slots.clear();
+    std::array<int64, MAX_SQL_PRIORITY> current = { };
+    int64 total = 0;
+    for (uint32 weight : schedule.Weights)
+        total += weight;
+
+    for (int64 i = 0; i < total; ++i)
+    {
+        uint32 best = 0;
+        for (uint32 lane = 0; lane < MAX_SQL_PRIORITY; ++lane)
+        {
+            current[lane] += schedule.Weights[lane];
+            if (current[lane] > current[best])
+                best = lane;
+        }
+        current[best] -= total;
+        _slots.push_back(uint8(best));
+    }
+}
+
+void SQLOperationQueue::SetWorkerCount(uint32 workers)
+{
+    _workers = std::max<uint32>(workers, 1);
+}
+
+void SQLOperationQueue::SetBatchSize(uint32 size)
+{
+    _batchSize.store(std::max<uint32>(size, 1), std::memory_order_relaxed);
+}
+
+size_t SQLOperationQueue::Size() const
+{
+    size_t size = _overflowSize.load(std::memory_order_relaxed);
+    for (Lane const& lane : _lanes)
+        size += lane.Ring.Size() + lane.Blocked.load(std::memory_order_relaxed);
+    return size;
+}
+
+size_t SQLOperationQueue::Size(SQLPriority priority) const
+{
+    ASSERT(priority < MAX_SQL_PRIORITY);
+    return _lanes[priority].Ring.Size() + _lanes[priority].Blocked.load(std::memory_order_relaxed);
+}
+
+SQLQueueStats SQLOperationQueue::GetStats(SQLPriority priority)
+{
+    ASSERT(priority < MAX_SQL_PRIORITY);
+
+    Lane& lane = _lanes[priority];
+    SQLQueueStats stats;
+    stats.Blocked = lane.Blocked.load(std::memory_order_relaxed);
+    stats.Depth = lane.Ring.Size() + stats.Blocked;
+    stats.Dequeued = lane.Dequeued.load(std::memory_order_relaxed);
+    stats.TotalWaitUs = lane.TotalWaitUs.load(std::memory_order_relaxed);
+    stats.MaxWaitUs = lane.MaxWaitUs.exchange(0, std::memory_order_relaxed);
+    stats.Promoted = lane.Promoted.load(std::memory_order_relaxed);
+    return stats;
+}
+
+size_t SQLOperationQueue::TryPopBatch(SQLOperation** ops, size_t max)
+{
+    if (_overflowSize.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(_overflowLock);
+        size_t count = 0;
+        while (count < max && !_overflow.empty())
+        {
+            ops[count++] = _overflow.front();
+            _overflow.pop_front();
+        }
+        _overflowSize.fetch_sub(count, std::memory_order_relaxed);
+        if (count)
+            return count;
+    }
+
+    // 全部为空时不读时钟，自旋等待只是几次原子读
+    std::array<bool, MAX_SQL_PRIORITY> backlogged;
+    bool any = false;
+    for (uint32 i = 0; i < MAX_SQL_PRIORITY; ++i)
+        any |= backlogged[i] = _lanes[i].Ring.Size() != 0;
+    if (!any)
+        return 0;
+
+    TimePoint now = std::chrono::steady_clock::now();
+
+    // 饥饿保护：上面有车道在排队，而这个车道太久没被服务
+    if (_schedule.MaxWait > 0ms)
+    {
+        int64 const deadline = Ticks(now - _schedule.MaxWait);
+        bool higher = backlogged[0];
+        for (uint32 i = 1; i < MAX_SQL_PRIORITY; ++i)
+        {
+            Lane& lane = _lanes[i];
+            if (higher && backlogged[i] && lane.LastServed.load(std::memory_order_relaxed) < deadline)
+            {
+                if (size_t count = PopLane(i, ops, max, now))
+                {
+                    lane.Promoted.fetch_add(1, std::memory_order_relaxed);
+                    return count;
+                }
+            }
+            higher |= backlogged[i];
+        }
+    }
+
+    if (_schedule.Weighted && !_slots.empty())
+    {
+        uint32 lane = _slots[_tick.fetch_add(1, std::memory_order_relaxed) % _slots.size()];
+        if (size_t count = PopLane(lane, ops, max, now))
+            return count;
+    }
+
+    for (uint32 i = 0; i < MAX_SQL_PRIORITY; ++i)
+        if (size_t count = PopLane(i, ops, max, now))
+            return count;
+
+    return 0;
+}
+
+size_t SQLOperationQueue::PopLane(uint32 index, SQLOperation** ops, size_t max, TimePoint now)
+{
+    Lane& lane = _lanes[index];
+    size_t depth = lane.Ring.Size();
+    if (!depth)
+        return 0;
+
+    // 只取自己那一份，队列不深时结果查询仍然分散到所有连接上并行执行
+    size_t count = lane.Ring.TryPopBatch(ops, std::min(max, depth / _workers + 1));
+    if (!count)
+        return 0;
+
+    lane.LastServed.store(Ticks(now), std::memory_order_relaxed);
+
+    uint64 total = 0, longest = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint64 wait = now > ops[i]->m_queueTime ? std::chrono::duration_cast<std::chrono::microseconds>(now - ops[i]->m_queueTime).count() : 0;
+        total += wait;
+        longest = std::max(longest, wait);
+    }
+
+    lane.Dequeued.fetch_add(count, std::memory_order_relaxed);
+    lane.TotalWaitUs.fetch_add(total, std::memory_order_relaxed);
+    uint64 previous = lane.MaxWaitUs.load(std::memory_order_relaxed);
+    while (previous < longest && !lane.MaxWaitUs.compare_exchange_weak(previous, longest, std::memory_order_relaxed))
+        ;
+    return count;
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the TrinityCore Project. See AUTHORS file for Copyright information
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SQLOPERATIONQUEUE_H
+#define _SQLOPERATIONQUEUE_H
+
+#include "Define.h"
+#include "DatabaseEnvFwd.h"
+#include "Duration.h"
+#include "MPMCQueue.h"
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class SQLOperation;
+
+//! How async workers pick the lane they serve next.
+struct SQLQueueSchedule
+{
+    //! false: always the highest non-empty lane. true: backlogged lanes share the workers by Weights.
+    bool Weighted = false;
+    std::array<uint32, MAX_SQL_PRIORITY> Weights = { 8, 4, 1 };
+    //! A lane that waited this long behind busier higher lanes is served next, whatever the policy. 0 disables.
+    Milliseconds MaxWait = 1s;
+};
+
+struct SQLQueueStats
+{
+    size_t Depth = 0;           //! Operations waiting in the lane
+    size_t Blocked = 0;         //! Of those, operations waiting behind an earlier one with the same order key
+    uint64 Dequeued = 0;
+    uint64 TotalWaitUs = 0;     //! Sum of the queue wait of dequeued operations, in microseconds
+    uint64 MaxWaitUs = 0;       //! Longest queue wait since the previous GetStats call
+    uint64 Promoted = 0;        //! Batches served ahead of higher lanes by starvation protection
+};
+
+//! Async queue of a DatabaseWorkerPool: one MPMCRing per SQLPriority, drained by workers that share a QueueParker.
+//! Operations with an order key enter the rings one at a time; the rest wait in a per-key FIFO until
+//! the previous one is finished, so any idle worker can take the next key that is ready.
+//! Producers block while their lane is full, except the workers themselves (e.g. an onComplete
+//! handler that enqueues): their operations go to an overflow list served before the lanes.
+class TC_DATABASE_API SQLOperationQueue
+{
+    public:
+        SQLOperationQueue();
+
+        void Push(SQLOperation* op, SQLPriority priority = SQL_PRIORITY_NORMAL, SQLOrderKey key = 0);
+
+        //! Called by the worker once a popped operation has executed. Hands the order key to
+        //! the next operation with the same key, if any. Never blocks: if that operation's lane
+        //! is full it is returned instead, and the caller must execute and Finish it itself.
+        SQLOperation* Finish(SQLOperation* op);
+
+        //! Waits for work, then takes up to max operations from the lane picked by the schedule.
+        //! Returns 0 once canceled.
+        size_t WaitAndPopBatch(SQLOperation** ops, size_t max);
+
+        void Cancel();
+
+        //! Both must be set before the workers start.
+        void SetSchedule(SQLQueueSchedule const& schedule);
+        void SetWorkerCount(uint32 workers);
+
+        //! Operations a worker takes per wakeup (default 32, capped at DatabaseWorker::MAX_BATCH_SIZE).
+        //! Consecutive one-way statements among them share a round trip; 1 disables batching.
+        //! Can be changed while the workers run.
+        void SetBatchSize(uint32 size);
+        uint32 GetBatchSize() const { return _batchSize.load(std::memory_order_relaxed); }
+
+        size_t Size() const;
+        size_t Size(SQLPriority priority) const;
+        SQLQueueStats GetStats(SQLPriority priority);
+
+    private:
+        struct Lane
+        {
+            MPMCRing<SQLOperation*> Ring;
+            std::atomic<int64> LastServed{ 0 };     // steady_clock 计数，入队到空车道时也会刷新
+            std::atomic<uint64> Dequeued{ 0 };
+            std::atomic<uint64> TotalWaitUs{ 0 };
+            std::atomic<uint64> MaxWaitUs{ 0 };
+            std::atomic<uint64> Promoted{ 0 };
+            std::atomic<size_t> Blocked{ 0 };
+        };
+
+        typedef std::deque<std::pair<SQLOperation*, SQLPriority>> KeyBacklog;
+
+        struct KeyShard
+        {
+            std::mutex Lock;
+            //! Keys with an operation in a ring or executing, with the operations queued behind it
+            std::unordered_map<SQLOrderKey, KeyBacklog> Pending;
+        };
+
+        static constexpr size_t KEY_SHARDS = 64;
+
+        KeyShard& GetKeyShard(SQLOrderKey key);
+        void PushLane(SQLOperation* op, SQLPriority priority);
+        bool TryPushLane(SQLOperation* op, SQLPriority priority);
+
+        size_t TryPopBatch(SQLOperation** ops, size_t max);
+        size_t PopLane(uint32 index, SQLOperation** ops, size_t max, TimePoint now);
+
+        std::array<Lane, MAX_SQL_PRIORITY> _lanes;
+        std::array<KeyShard, KEY_SHARDS> _keys;
+        std::mutex _overflowLock;
+        std::deque<SQLOperation*> _overflow;        //! Pushed by workers while the lane was full
+        std::atomic<size_t> _overflowSize;
+        QueueParker _parker;
+        SQLQueueSchedule _schedule;
+        std::vector<uint8> _slots;          //! Lane order of one weighted round
+        std::atomic<uint64> _tick;
+        uint32 _workers;
+        std::atomic<uint32> _batchSize;
+
+        SQLOperationQueue(SQLOperationQueue const& right) = delete;
+        SQLOperationQueue& operator=(SQLOperationQueue const& right) = delete;
+};
+
+#endif
@@ -0,0 +1,172 @@
+// JSON 行编码基准：同一批结果分别用 JsonWriter 和逐列 GetString() 的写法编码，比较 rows/s
+//
+// ./bench_json [dsn] [passes]
+//
+// 每一遍重新查询（不计时），只统计遍历结果并编码的时间；ResultSet 走文本协议，PreparedResultSet 走二进制协议
+
+#include "DatabaseEnv.h"
+#include "DatabaseLoader.h"
+#include "Implementation/SakilaDatabase.h"
+#include "JsonWriter.h"
+#include "Log.h"
+#include "MySQLThreading.h"
+#include "MySQLWorkaround.h"
+#include <fmt/format.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+
+// 对照组：每个单元格经过 GetString() 或数值 getter，再逐字符转义
+static void AppendNaive(std::string& out, Field const& field, QueryResultFieldMetadata const& meta, bool prepared)
+{
+    if (field.IsNull())
+    {
+        out += "null";
+        return;
+    }
+    switch (meta.Type)
+    {
+        case DatabaseFieldTypes::Int8:
+            out += meta.Unsigned ? std::to_string(field.GetUInt8()) : std::to_string(field.GetInt8());
+            break;
+        case DatabaseFieldTypes::Int16:
+            out += meta.Unsigned ? std::to_string(field.GetUInt16()) : std::to_string(field.GetInt16());
+            break;
+        case DatabaseFieldTypes::Int32:
+            out += meta.Unsigned ? std::to_string(field.GetUInt32()) : std::to_string(field.GetInt32());
+            break;
+        case DatabaseFieldTypes::Int64:
+            out += meta.Unsigned ? std::to_string(field.GetUInt64()) : std::to_string(field.GetInt64());
+            break;
+        case DatabaseFieldTypes::Float:
+            out += std::to_string(field.GetFloat());
+            break;
+        case DatabaseFieldTypes::Double:
+            out += std::to_string(field.GetDouble());
+            break;
+        case DatabaseFieldTypes::Decimal:
+            out += field.GetString();
+            break;
+        case DatabaseFieldTypes::Date:
+            if (prepared)
+            {
+                MYSQL_TIME const* time = reinterpret_cast<MYSQL_TIME const*>(field.GetStringView().data());
+                out += fmt::format("\"{:04}-{:02}-{:02} {:02}:{:02}:{:02}\"", time->year, time->month, time->day,
+                    time->hour, time->minute, time->second);
+                break;
+            }
+            [[fallthrough]];
+        default:
+        {
+            std::string value = field.GetString();
+            out += '"';
+            for (char c : value)
+            {
+                if (c == '"' || c == '\\')
+                    out += '\\';
+                out += c;
+            }
+            out += '"';
+            break;
+        }
+    }
+}
+
+struct Sample
+{
+    uint64 Rows = 0;
+    uint64 Bytes = 0;
+    double Seconds = 0;
+};
+
+template <class Result>
+static void Encode(Result const& result, bool naive, JsonWriter& writer, std::string& naiveOut, Sample& sample)
+{
+    std::vector<QueryResultFieldMetadata> const& metadata = result->GetFieldMetadata();
+    uint32 const fieldCount = result->GetFieldCount();
+    auto start = std::chrono::steady_clock::now();
+    do
+    {
+        Field* fields = result->Fetch();
+        if (naive)
+        {
+            naiveOut.clear();
+            naiveOut += '[';
+            for (uint32 i = 0; i < fieldCount; ++i)
+            {
+                if (i)
+                    naiveOut += ',';
+                AppendNaive(naiveOut, fields[i], metadata[i], std::is_same_v<Result, PreparedQueryResult>);
+            }
+            naiveOut += ']';
+            sample.Bytes += naiveOut.size();
+        }
+        else
+        {
+            writer.Clear();
+            writer.AppendRow(fields, fieldCount);
+            sample.Bytes += writer.Size();
+        }
+        ++sample.Rows;
+    } while (result->NextRow());
+    sample.Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void Report(char const* name, char const* protocol, char const* encoder, Sample const& sample)
+{
+    printf("%-8s %-9s %-10s %12.0f rows/s %8.1f MB/s %6.1f bytes/row\n", name, protocol, encoder,
+        sample.Rows / sample.Seconds, sample.Bytes / sample.Seconds / 1e6, double(sample.Bytes) / sample.Rows);
+}
+
+int main(int argc, char* argv[])
+{
+    char const* dsn = argc > 1 ? argv[1] : "127.0.0.1;3306;root;123456;sakila";
+    int passes = argc > 2 ? atoi(argv[2]) : 20;
+
+    MySQL::Library_Init();
+
+    DatabaseLoader loader;
+    loader.AddDatabase(SakilaDatabase, dsn, 1, 1);
+    if (!loader.Load())
+    {
+        TC_LOG_ERROR("", "SakilaDatabase connect error");
+        return 1;
+    }
+
+    struct
+    {
+        char const* Name;
+        char const* Sql;
+        SakilaDatabaseStatements Statement;
+    } const tables[] =
+    {
+        { "film",   "select film_id, title, description, release_year, rental_duration, rental_rate, length, replacement_cost, rating, last_update from film", SAKILA_SEL_FILMS },
+        { "rental", "select rental_id, rental_date, inventory_id, customer_id, return_date, staff_id, last_update from rental", SAKILA_SEL_RENTALS },
+    };
+
+    JsonWriter writer;
+    std::string naiveOut;
+    for (auto const& table : tables)
+    {
+        for (int naive = 1; naive >= 0; --naive)
+        {
+            Sample text, binary;
+            for (int pass = 0; pass < passes; ++pass)
+            {
+                if (QueryResult result = SakilaDatabase.Query(table.Sql))
+                    Encode(result, naive, writer, naiveOut, text);
+                if (PreparedQueryResult result = SakilaDatabase.Query(SakilaDatabase.GetPreparedStatement(table.Statement)))
+                    Encode(result, naive, writer, naiveOut, binary);
+            }
+            if (!text.Rows || !binary.Rows)
+            {
+                TC_LOG_ERROR("", "%s is empty", table.Name);
+                return 1;
+            }
+            Report(table.Name, "text", naive ? "GetString" : "JsonWriter", text);
+            Report(table.Name, "prepared", naive ? "GetString" : "JsonWriter", binary);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+// 异步 SQL 队列的竞争基准：ProducerConsumerQueue（mutex + condition_variable）和 MPMCQueue 对比
+//
+// ./bench_queue [consumers] [ops] [work_ns]
+//
+// consumers 模拟 DatabaseWorker 线程（默认 8），1~64 个生产者一共推送 ops 个操作（默认 4M），
+// 每个操作在消费者上忙等 work_ns 纳秒（默认 0，只测队列本身）。
+// 每隔 64 次 Push 采样一次耗时，报告生产者看到的 p50/p99
+
+#include "MPMCQueue.h"
+#include "ProducerConsumerQueue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Task
+{
+    std::atomic<uint64_t> Done{ 0 };
+};
+
+struct Sample
+{
+    double Seconds = 0;
+    uint64_t P50 = 0;
+    uint64_t P99 = 0;
+};
+
+static void Work(uint64_t ns)
+{
+    if (!ns)
+        return;
+    Clock::time_point end = Clock::now() + std::chrono::nanoseconds(ns);
+    while (Clock::now() < end)
+        ;
+}
+
+template <class Queue>
+static Sample Run(int producers, int consumers, uint64_t ops, uint64_t workNs)
+{
+    Queue queue;
+    Task task;
+    std::atomic<bool> start{ false };
+    std::vector<std::vector<uint64_t>> latencies(producers);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < consumers; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            for (;;)
+            {
+                Task* op = nullptr;
+                queue.WaitAndPop(op);
+                if (!op)
+                    return;
+                Work(workNs);
+                op->Done.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    uint64_t const perProducer = ops / producers;
+    for (int i = 0; i < producers; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            std::vector<uint64_t>& samples = latencies[i];
+            samples.reserve(perProducer / 64 + 1);
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for (uint64_t n = 0; n < perProducer; ++n)
+            {
+                if (n % 64)
+                {
+                    queue.Push(&task);
+                    continue;
+                }
+                Clock::time_point begin = Clock::now();
+                queue.Push(&task);
+                samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count());
+            }
+        });
+    }
+
+    Clock::time_point begin = Clock::now();
+    start.store(true, std::memory_order_release);
+    uint64_t const total = perProducer * producers;
+    while (task.Done.load(std::memory_order_relaxed) < total)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    Sample sample;
+    sample.Seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    queue.Cancel(); // 队列已空，只是唤醒消费者退出
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::vector<uint64_t> all;
+    for (std::vector<uint64_t>& samples : latencies)
+        all.insert(all.end(), samples.begin(), samples.end());
+    std::sort(all.begin(), all.end());
+    if (!all.empty())
+    {
+        sample.P50 = all[all.size() / 2];
+        sample.P99 = all[all.size() * 99 / 100];
+    }
+    return sample;
+}
+
+static void Report(char const* name, int producers, uint64_t ops, Sample const& sample)
+{
+    printf("%-22s %3d producers %10.0f ops/s   push p50 %6llu ns  p99 %8llu ns\n", name, producers,
+        ops / sample.Seconds, (unsigned long long)sample.P50, (unsigned long long)sample.P99);
+}
+
+int main(int argc, char* argv[])
+{
+    int consumers = argc > 1 ? atoi(argv[1]) : 8;
+    uint64_t ops = argc > 2 ? strtoull(argv[2], nullptr, 10) : 4000000;
+    uint64_t workNs = argc > 3 ? strtoull(argv[3], nullptr, 10) : 0;
+
+    printf("%d consumers, %llu ops, %llu ns per op, %u CPUs\n", consumers, (unsigned long long)ops,
+        (unsigned long long)workNs, std::thread::hardware_concurrency());
+    for (int producers : { 1, 2, 4, 8, 16, 32, 64 })
+    {
+        uint64_t const total = ops / producers * producers;
+        Report("ProducerConsumerQueue", producers, total, Run<ProducerConsumerQueue<Task*>>(producers, consumers, ops, workNs));
+        Report("MPMCQueue", producers, total, Run<MPMCQueue<Task*>>(producers, consumers, ops, workNs));
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+// 小写入吞吐基准：大量单行 INSERT 走异步 Execute，比较工作线程逐条执行和批量执行的 rows/s
+//
+// ./bench_write [dsn] [rows] [async_threads]
+//
+// 每一轮先清空 bench_write 表，再把 rows 条 INSERT 全部入队，计时到表里的行数达到 rows 为止
+
+#include "DatabaseEnv.h"
+#include "DatabaseLoader.h"
+#include "Implementation/SakilaDatabase.h"
+#include "Log.h"
+#include "MySQLThreading.h"
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+
+static uint64 CountRows()
+{
+    QueryResult result = SakilaDatabase.Query("select count(*) from bench_write");
+    return result ? uint64((*result)[0].GetInt64()) : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    char const* dsn = argc > 1 ? argv[1] : "127.0.0.1;3306;root;123456;sakila";
+    uint32 rows = argc > 2 ? uint32(atoi(argv[2])) : 100000;
+    uint8 asyncThreads = argc > 3 ? uint8(atoi(argv[3])) : 8;
+
+    MySQL::Library_Init();
+
+    DatabaseLoader loader;
+    loader.AddDatabase(SakilaDatabase, dsn, asyncThreads, 1);
+    if (!loader.Load())
+    {
+        TC_LOG_ERROR("", "SakilaDatabase connect error");
+        return 1;
+    }
+
+    SakilaDatabase.DirectExecute("create table if not exists bench_write (id int unsigned not null primary key, value varchar(64) not null)");
+
+    for (uint32 batch : { 1u, 8u, 32u, 64u })
+    {
+        SakilaDatabase.SetBatchSize(batch);
+        SakilaDatabase.DirectExecute("truncate table bench_write");
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32 i = 0; i < rows; ++i)
+            SakilaDatabase.PExecute("insert into bench_write (id, value) values (%u, 'row %u')", i, i);
+
+        while (CountRows() < rows)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("batch %2u  %u rows  %8.3f s  %10.0f rows/s\n", batch, rows, seconds, rows / seconds);
+    }
+
+    SakilaDatabase.DirectExecute("drop table bench_write");
+    return 0;
+}
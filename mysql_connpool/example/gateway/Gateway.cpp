@@ -0,0 +1,623 @@
+#include "Gateway.h"
+#include "DatabaseEnv.h"
+#include "JsonWriter.h"
+#include "LiveQuery.h"
+#include "server.h"
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    // 参数类型：'u' 无符号整数，'l' 行数上限（限制在 MAX_ROWS 以内），'s' 字符串
+    // Tables 是语句读取的表，订阅时用来匹配写通知
+    struct QueryDefinition
+    {
+        char const* Name;
+        SakilaDatabaseStatements Statement;
+        char const* Params;
+        char const* Tables;
+    };
+
+    QueryDefinition const Queries[] =
+    {
+        { "actor",            SAKILA_SEL_ACTOR_INFO_ASYNC,       "u",  "actor"                 },
+        { "actor_films",      SAKILA_SEL_ACTOR_FILMS_ASYNC,      "u",  "film_actor,film"       },
+        { "film",             SAKILA_SEL_FILM_INFO_ASYNC,        "u",  "film"                  },
+        { "film_search",      SAKILA_SEL_FILMS_BY_TITLE_ASYNC,   "sl", "film"                  },
+        { "customer",         SAKILA_SEL_CUSTOMER_INFO_ASYNC,    "u",  "customer"              },
+        { "customer_rentals", SAKILA_SEL_CUSTOMER_RENTALS_ASYNC, "ul", "rental,inventory,film" },
+    };
+
+    constexpr uint32 MAX_ROWS = 1000;
+    constexpr size_t MAX_STRING_PARAM = 256;
+    constexpr size_t FRAME_SIZE = 64 * 1024; // 结果超过这个大小时分帧发送
+    constexpr size_t MAX_TOPIC = 255;           // pubsub 主题名的长度上限
+    constexpr size_t MAX_SUBSCRIPTIONS = 64;    // 每个连接的订阅数上限
+
+    uint32 _maxInflight = 64;
+
+    // 连接上的网关状态，只在连接所属的 reactor 线程中访问，所以引用计数不需要原子操作
+    struct Session
+    {
+        conn* Conn;      // 连接关闭后为 nullptr，之后完成的查询直接丢弃结果
+        uint32 Inflight;
+        uint32 Refs;     // 连接本身加上每个执行中的查询
+        std::vector<std::string> Topics; // 订阅的查询
+    };
+
+    // 一个执行中的查询；工作线程完成后把它作为任务交回连接所属的 reactor
+    struct PendingQuery : ws_task
+    {
+        Session* Owner;
+        reactor* Reactor;
+        std::string Id;
+        std::optional<QueryCallback> Callback;
+    };
+
+    struct Param
+    {
+        bool IsString;
+        std::string Value; // 数字保留原始文本
+    };
+
+    struct Request
+    {
+        std::string Id = "null"; // id 的原始 JSON，原样放进结果
+        std::string Query;       // query 或 subscribe 的查询名
+        bool Subscribe = false;
+        std::string Unsubscribe; // 要取消订阅的 topic
+        std::vector<Param> Params;
+    };
+
+    void ReleaseSession(Session* session)
+    {
+        if (--session->Refs == 0)
+            delete session;
+    }
+
+    // 请求解析：只接受一层对象，值为字符串、数字、true/false/null，params 为这些值的数组
+    class RequestParser
+    {
+    public:
+        explicit RequestParser(std::string_view text) : _text(text), _pos(0) { }
+
+        char const* Parse(Request& request)
+        {
+            if (!Consume('{'))
+                return "request must be a JSON object";
+            if (Consume('}'))
+                return "missing query";
+            do
+            {
+                std::string key;
+                if (!ParseString(key) || !Consume(':'))
+                    return "malformed request";
+                if (key == "id")
+                {
+                    size_t start = Skip();
+                    std::string ignored;
+                    if (!ParseScalar(ignored))
+                        return "malformed id";
+                    request.Id.assign(_text.substr(start, _pos - start));
+                }
+                else if (key == "query" || key == "subscribe")
+                {
+                    request.Subscribe = key == "subscribe";
+                    if (!request.Query.empty() || !ParseString(request.Query))
+                        return "query must be a string";
+                }
+                else if (key == "unsubscribe")
+                {
+                    if (!ParseString(request.Unsubscribe))
+                        return "unsubscribe must be a topic";
+                }
+                else if (key == "params")
+                {
+                    if (!ParseParams(request.Params))
+                        return "params must be an array of scalars";
+                }
+                else
+                {
+                    std::string ignored;
+                    if (!ParseScalar(ignored))
+                        return "malformed request";
+                }
+            } while (Consume(','));
+            if (!Consume('}') || Skip() != _text.size())
+                return "malformed request";
+            if (request.Query.empty() == request.Unsubscribe.empty())
+                return "expected one of query, subscribe or unsubscribe";
+            return nullptr;
+        }
+
+    private:
+        size_t Skip()
+        {
+            while (_pos < _text.size() && (_text[_pos] == ' ' || _text[_pos] == '\t' || _text[_pos] == '\r' || _text[_pos] == '\n'))
+                ++_pos;
+            return _pos;
+        }
+
+        bool Consume(char c)
+        {
+            if (Skip() < _text.size() && _text[_pos] == c)
+            {
+                ++_pos;
+                return true;
+            }
+            return false;
+        }
+
+        static void AppendUtf8(std::string& out, uint32 cp)
+        {
+            if (cp < 0x80)
+                out += char(cp);
+            else if (cp < 0x800)
+            {
+                out += char(0xC0 | (cp >> 6));
+                out += char(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                out += char(0xE0 | (cp >> 12));
+                out += char(0x80 | ((cp >> 6) & 0x3F));
+                out += char(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                out += char(0xF0 | (cp >> 18));
+                out += char(0x80 | ((cp >> 12) & 0x3F));
+                out += char(0x80 | ((cp >> 6) & 0x3F));
+                out += char(0x80 | (cp & 0x3F));
+            }
+        }
+
+        bool ParseHex4(uint32& value)
+        {
+            if (_pos + 4 > _text.size())
+                return false;
+            value = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                char c = _text[_pos++];
+                value <<= 4;
+                if (c >= '0' && c <= '9')
+                    value |= c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    value |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    value |= c - 'A' + 10;
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        bool ParseString(std::string& out)
+        {
+            if (!Consume('"'))
+                return false;
+            while (_pos < _text.size())
+            {
+                char c = _text[_pos++];
+                if (c == '"')
+                    return true;
+                if (uint8(c) < 0x20)
+                    return false;
+                if (c != '\\')
+                {
+                    out += c;
+                    continue;
+                }
+                if (_pos == _text.size())
+                    return false;
+                switch (_text[_pos++])
+                {
+                    case '"': out += '"'; break;
+                    case '\\': out += '\\'; break;
+                    case '/': out += '/'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u':
+                    {
+                        uint32 cp, low;
+                        if (!ParseHex4(cp))
+                            return false;
+                        if (cp >= 0xD800 && cp < 0xDC00) // 代理对
+                        {
+                            if (_pos + 2 > _text.size() || _text[_pos] != '\\' || _text[_pos + 1] != 'u')
+                                return false;
+                            _pos += 2;
+                            if (!ParseHex4(low) || low < 0xDC00 || low >= 0xE000)
+                                return false;
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        else if (cp >= 0xDC00 && cp < 0xE000)
+                            return false;
+                        AppendUtf8(out, cp);
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+            return false;
+        }
+
+        // 字符串返回解码后的内容，其他标量返回原始文本
+        bool ParseScalar(std::string& out, bool* isString = nullptr)
+        {
+            if (Skip() == _text.size())
+                return false;
+            if (isString)
+                *isString = _text[_pos] == '"';
+            if (_text[_pos] == '"')
+                return ParseString(out);
+
+            size_t start = _pos;
+            while (_pos < _text.size() && (std::isalnum(uint8(_text[_pos])) || _text[_pos] == '-' || _text[_pos] == '+' || _text[_pos] == '.'))
+                ++_pos;
+            out.assign(_text.substr(start, _pos - start));
+            if (out.empty())
+                return false;
+            if (out == "true" || out == "false" || out == "null")
+                return true;
+            return IsNumber(out);
+        }
+
+        // JSON 数字：-?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?，原文会被回写到响应里，所以不能放过 nan、0x1F、007 这类
+        static bool IsNumber(std::string_view text)
+        {
+            size_t i = 0;
+            auto digits = [&]()
+            {
+                size_t start = i;
+                while (i < text.size() && std::isdigit(uint8(text[i])))
+                    ++i;
+                return i > start;
+            };
+
+            if (i < text.size() && text[i] == '-')
+                ++i;
+            if (i < text.size() && text[i] == '0')
+                ++i;
+            else if (!digits())
+                return false;
+            if (i < text.size() && text[i] == '.')
+            {
+                ++i;
+                if (!digits())
+                    return false;
+            }
+            if (i < text.size() && (text[i] == 'e' || text[i] == 'E'))
+            {
+                ++i;
+                if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+                    ++i;
+                if (!digits())
+                    return false;
+            }
+            return i == text.size();
+        }
+
+        bool ParseParams(std::vector<Param>& params)
+        {
+            if (!Consume('['))
+                return false;
+            if (Consume(']'))
+                return true;
+            do
+            {
+                Param param;
+                if (!ParseScalar(param.Value, &param.IsString))
+                    return false;
+                params.push_back(std::move(param));
+            } while (Consume(','));
+            return Consume(']');
+        }
+
+        std::string_view _text;
+        size_t _pos;
+    };
+
+    bool ParseUnsigned(Param const& param, uint32& value)
+    {
+        if (param.IsString || param.Value.empty() || param.Value.size() > 10)
+            return false;
+        uint64 v = 0;
+        for (char c : param.Value)
+        {
+            if (c < '0' || c > '9')
+                return false;
+            v = v * 10 + (c - '0');
+        }
+        if (v > std::numeric_limits<uint32>::max())
+            return false;
+        value = uint32(v);
+        return true;
+    }
+
+    // 编码用的缓冲区，每个 reactor 线程一个，长到最大的结果帧之后不再分配
+    thread_local JsonWriter _writer;
+
+    void Send(conn* c, JsonWriter const& writer)
+    {
+        ws_send(c, WS_OPCODE_TEXT, writer.Data(), int(writer.Size()));
+        ws_update_events(c);
+    }
+
+    void SendError(conn* c, std::string const& id, char const* error)
+    {
+        _writer.Clear();
+        _writer.Append("{\"id\":");
+        _writer.Append(id);
+        _writer.Append(",\"error\":");
+        _writer.AppendString(error);
+        _writer.Append('}');
+        Send(c, _writer);
+    }
+
+    // 把结果编码成 JSON，超过 FRAME_SIZE 就先发出已编码的行
+    void SendResult(conn* c, std::string const& id, PreparedQueryResult const& result)
+    {
+        _writer.Clear();
+        _writer.Append("{\"id\":");
+        _writer.Append(id);
+        _writer.Append(",\"columns\":");
+        if (!result)
+        {
+            _writer.Append("[],\"rows\":[]}");
+            Send(c, _writer);
+            return;
+        }
+
+        std::vector<QueryResultFieldMetadata> const& metadata = result->GetFieldMetadata();
+        uint32 const fieldCount = result->GetFieldCount();
+        _writer.AppendColumns(metadata);
+        _writer.Append(",\"rows\":[");
+
+        bool first = true;
+        do
+        {
+            if (_writer.Size() >= FRAME_SIZE)
+            {
+                _writer.Append("],\"more\":true}");
+                Send(c, _writer);
+                _writer.Clear();
+                _writer.Append("{\"id\":");
+                _writer.Append(id);
+                _writer.Append(",\"rows\":[");
+                first = true;
+            }
+            if (!first)
+                _writer.Append(',');
+            first = false;
+            _writer.AppendRow(result->Fetch(), fieldCount);
+        } while (result->NextRow());
+        _writer.Append("]}");
+        Send(c, _writer);
+    }
+
+    // reactor 线程执行：结果已经就绪，InvokeIfReady 直接调用结果回调
+    void OnQueryComplete(ws_task* task)
+    {
+        PendingQuery* query = static_cast<PendingQuery*>(task);
+        Session* session = query->Owner;
+
+        query->Callback->InvokeIfReady();
+        --session->Inflight;
+        ReleaseSession(session);
+        delete query;
+    }
+
+    bool BindParams(SakilaDatabasePreparedStatement* stmt, QueryDefinition const& def, std::vector<Param> const& params, char const*& error)
+    {
+        size_t const count = std::char_traits<char>::length(def.Params);
+        if (params.size() != count)
+        {
+            error = "wrong number of params";
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32 value;
+            switch (def.Params[i])
+            {
+                case 'u':
+                case 'l':
+                    if (!ParseUnsigned(params[i], value))
+                    {
+                        error = "param must be an unsigned integer";
+                        return false;
+                    }
+                    if (def.Params[i] == 'l' && value > MAX_ROWS)
+                        value = MAX_ROWS;
+                    stmt->setUInt32(uint8(i), value);
+                    break;
+                case 's':
+                    if (!params[i].IsString || params[i].Value.size() > MAX_STRING_PARAM)
+                    {
+                        error = "param must be a string";
+                        return false;
+                    }
+                    stmt->setString(uint8(i), params[i].Value);
+                    break;
+            }
+        }
+        return true;
+    }
+
+    // 订阅：同样的查询名和参数得到同一个 topic，所有订阅者共享一次执行
+    void Subscribe(Session* session, QueryDefinition const& def, Request& request)
+    {
+        conn* c = session->Conn;
+        SakilaDatabasePreparedStatement* stmt = SakilaDatabase.GetPreparedStatement(def.Statement);
+        char const* error = nullptr;
+        bool valid = BindParams(stmt, def, request.Params, error);
+        delete stmt; // 只用来检查参数，每次执行由刷新线程重新生成
+        if (!valid)
+        {
+            SendError(c, request.Id, error);
+            return;
+        }
+
+        std::string topic = "live:";
+        topic += def.Name;
+        topic += ":[";
+        for (size_t i = 0; i < request.Params.size(); ++i)
+        {
+            if (i)
+                topic += ',';
+            if (request.Params[i].IsString)
+            {
+                _writer.Clear();
+                _writer.AppendString(request.Params[i].Value);
+                topic += _writer.View();
+            }
+            else
+                topic += request.Params[i].Value;
+        }
+        topic += ']';
+
+        if (topic.size() > MAX_TOPIC)
+            error = "params too long to subscribe";
+        else if (std::find(session->Topics.begin(), session->Topics.end(), topic) != session->Topics.end())
+            error = "already subscribed";
+        else if (session->Topics.size() >= MAX_SUBSCRIPTIONS)
+            error = "too many subscriptions";
+        if (error)
+        {
+            SendError(c, request.Id, error);
+            return;
+        }
+
+        session->Topics.push_back(topic);
+        LiveQuery::Subscribe(c, request.Id, topic, def.Tables, [def = &def, params = std::move(request.Params)]()
+        {
+            SakilaDatabasePreparedStatement* stmt = SakilaDatabase.GetPreparedStatement(def->Statement);
+            char const* error = nullptr;
+            BindParams(stmt, *def, params, error);
+            return stmt;
+        });
+    }
+}
+
+void Gateway::SetMaxInflight(uint32 maxInflight)
+{
+    _maxInflight = maxInflight;
+}
+
+int Gateway::OnMessage(conn* c, int opcode, char const* data, int length)
+{
+    // 只处理 JSON 对象，其他消息仍由服务器回显
+    if (opcode != WS_OPCODE_TEXT || length == 0 || data[0] != '{')
+        return 0;
+
+    Request request;
+    if (char const* error = RequestParser(std::string_view(data, length)).Parse(request))
+    {
+        SendError(c, request.Id, error);
+        return 1;
+    }
+
+    Session* session = static_cast<Session*>(c->app);
+    if (!session)
+    {
+        session = new Session{ c, 0, 1, {} };
+        c->app = session;
+    }
+
+    if (!request.Unsubscribe.empty())
+    {
+        auto itr = std::find(session->Topics.begin(), session->Topics.end(), request.Unsubscribe);
+        if (itr == session->Topics.end())
+        {
+            SendError(c, request.Id, "not subscribed");
+            return 1;
+        }
+        LiveQuery::Unsubscribe(c, *itr);
+        session->Topics.erase(itr);
+
+        _writer.Clear();
+        _writer.Append("{\"id\":");
+        _writer.Append(request.Id);
+        _writer.Append(",\"unsubscribed\":");
+        _writer.AppendString(request.Unsubscribe);
+        _writer.Append('}');
+        Send(c, _writer);
+        return 1;
+    }
+
+    QueryDefinition const* def = nullptr;
+    for (QueryDefinition const& query : Queries)
+        if (request.Query == query.Name)
+            def = &query;
+    if (!def)
+    {
+        SendError(c, request.Id, "unknown query");
+        return 1;
+    }
+
+    if (request.Subscribe)
+    {
+        Subscribe(session, *def, request);
+        return 1;
+    }
+
+    if (session->Inflight >= _maxInflight)
+    {
+        SendError(c, request.Id, "too many queries in flight");
+        return 1;
+    }
+
+    SakilaDatabasePreparedStatement* stmt = SakilaDatabase.GetPreparedStatement(def->Statement);
+    char const* error = nullptr;
+    if (!BindParams(stmt, *def, request.Params, error))
+    {
+        delete stmt;
+        SendError(c, request.Id, error);
+        return 1;
+    }
+
+    PendingQuery* query = new PendingQuery();
+    query->run = OnQueryComplete;
+    query->Owner = session;
+    query->Reactor = c->reactor;
+    query->Id = std::move(request.Id);
+    ++session->Refs;
+    ++session->Inflight;
+
+    // 工作线程可能在 AsyncQuery 返回之前就完成并提交任务，但任务要等这个 reactor 线程回到事件循环才会执行，
+    // 那时 Callback 已经设置好了
+    query->Callback.emplace(SakilaDatabase.AsyncQuery(stmt, [query]()
+    {
+        reactor_post(query->Reactor, query);
+    }).WithPreparedCallback([query](PreparedQueryResult result)
+    {
+        conn* c = query->Owner->Conn;
+        if (c && c->status == WS_STATUS_OPEN)
+            SendResult(c, query->Id, result);
+    }));
+    return 1;
+}
+
+void Gateway::OnRelease(conn* c)
+{
+    Session* session = static_cast<Session*>(c->app);
+    if (!session)
+        return;
+    for (std::string const& topic : session->Topics)
+        LiveQuery::Unsubscribe(c, topic);
+    session->Topics.clear();
+    session->Conn = nullptr;
+    c->app = nullptr;
+    ReleaseSession(session);
+}
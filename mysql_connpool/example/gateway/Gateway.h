@@ -0,0 +1,30 @@
+#ifndef _GATEWAY_H
+#define _GATEWAY_H
+
+#include "Define.h"
+
+struct conn;
+
+// websocket 查询网关：客户端发送 JSON 请求执行白名单中的预处理语句，结果以 JSON 文本帧返回
+//
+//   请求 {"id": 7, "query": "film", "params": [1]}
+//   结果 {"id": 7, "columns": ["film_id", ...], "rows": [[1, "ACADEMY DINOSAUR", ...]]}
+//   出错 {"id": 7, "error": "unknown query"}
+//
+// 一个连接可以连续发送多个请求而不等待结果（pipelining），结果按完成顺序返回，用 id 对应；
+// 结果较大时分成多个帧，除最后一帧外都带 "more": true
+//
+// 把 query 换成 subscribe 就订阅这个查询，之后结果有变化时推送增量（见 LiveQuery.h）：
+//   订阅     {"id": 8, "subscribe": "film", "params": [1]}
+//   取消订阅 {"id": 9, "unsubscribe": "live:film:[1]"}
+namespace Gateway
+{
+    // 每个连接同时执行的查询数上限，超过的请求直接返回错误
+    void SetMaxInflight(uint32 maxInflight);
+
+    // ws_handler 的两个入口，在连接所属的 reactor 线程中调用
+    int OnMessage(conn* c, int opcode, char const* data, int length);
+    void OnRelease(conn* c);
+}
+
+#endif
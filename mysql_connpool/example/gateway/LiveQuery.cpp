@@ -0,0 +1,321 @@
+#include "LiveQuery.h"
+#include "AsyncCallbackProcessor.h"
+#include "DatabaseEnv.h"
+#include "JsonWriter.h"
+#include "server.h"
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    constexpr size_t FRAME_SIZE = 64 * 1024; // 快照和增量超过这个大小时分帧发送
+
+    struct Query
+    {
+        std::string Topic;
+        std::string Head; // {"topic":"..."
+        std::string Tables;
+        LiveQuery::PrepareFn Prepare;
+
+        // 以下三项由 _lock 保护
+        uint32 Subscribers = 0;
+        bool InFlight = false; // 同一个查询最多一个执行，期间的写通知合并到下一次
+        TimePoint Due;
+
+        // 上一次的结果，由 Lock 保护：刷新线程更新，reactor 线程为新订阅者编码快照
+        std::mutex Lock;
+        bool Loaded = false;
+        std::string Columns;
+        std::vector<std::string> Keys; // 结果中的顺序
+        std::unordered_map<std::string, std::string> Rows; // 键 -> 编码好的行
+    };
+
+    std::mutex _lock;
+    std::condition_variable _wake;
+    bool _pending = false;
+    Milliseconds _interval = 1s;
+    std::unordered_map<std::string, std::shared_ptr<Query>> _queries;
+
+    void Wake()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _pending = true;
+        _wake.notify_one();
+    }
+
+    bool DependsOn(std::string const& tables, std::string_view table)
+    {
+        size_t start = 0;
+        while (start <= tables.size())
+        {
+            size_t end = tables.find(',', start);
+            if (end == std::string::npos)
+                end = tables.size();
+            if (std::string_view(tables).substr(start, end - start) == table)
+                return true;
+            start = end + 1;
+        }
+        return false;
+    }
+
+    void Send(conn* c, std::string const& message)
+    {
+        ws_send(c, WS_OPCODE_TEXT, message.data(), int(message.size()));
+        ws_update_events(c);
+    }
+
+    // 共享帧只编码一次，所有 reactor 上订阅这个主题的连接引用同一个缓冲区
+    void Publish(Query const& query, std::string const& message)
+    {
+        ws_buffer* frame = ws_buffer_frame(WS_OPCODE_TEXT, message.data(), int(message.size()));
+        if (!frame)
+            return;
+        pubsub_publish(nullptr, query.Topic.data(), int(query.Topic.size()), frame);
+        ws_buffer_unref(frame);
+    }
+
+    // 把 items 接着 message 中已经打开的数组编码，超过 FRAME_SIZE 时以 "more": true 结束当前帧，
+    // 下一帧以 restart 开头继续这个数组
+    template <class Items, class Flush>
+    void AppendChunked(std::string& message, std::string const& restart, Items const& items, Flush&& flush)
+    {
+        bool first = true;
+        for (auto const& item : items)
+        {
+            if (message.size() >= FRAME_SIZE)
+            {
+                message += "],\"more\":true}";
+                flush(message);
+                message = restart;
+                first = true;
+            }
+            if (!first)
+                message += ',';
+            first = false;
+            message += *item;
+        }
+    }
+
+    void SendSnapshot(conn* c, std::string const& id, Query& query)
+    {
+        std::string message;
+        message.reserve(FRAME_SIZE + 1024);
+        message += "{\"id\":";
+        message += id;
+        message += ',';
+        message.append(query.Head, 1);
+
+        std::lock_guard<std::mutex> guard(query.Lock);
+        if (!query.Loaded)
+        {
+            message += '}';
+            Send(c, message);
+            return;
+        }
+
+        std::vector<std::string const*> rows;
+        rows.reserve(query.Keys.size());
+        for (std::string const& key : query.Keys)
+            rows.push_back(&query.Rows[key]);
+
+        std::string restart = message + ",\"rows\":[";
+        message += ",\"columns\":";
+        message += query.Columns;
+        message += ",\"rows\":[";
+        AppendChunked(message, restart, rows, [c](std::string const& chunk) { Send(c, chunk); });
+        message += "]}";
+        Send(c, message);
+    }
+
+    // 刷新线程执行：和上次的结果比较，有变化时发布增量
+    void Refresh(Query& query, PreparedQueryResult result)
+    {
+        std::string columns = "[]";
+        std::vector<std::string> keys;
+        std::unordered_map<std::string, std::string> rows;
+        if (result)
+        {
+            JsonWriter writer;
+            uint32 const fieldCount = result->GetFieldCount();
+            writer.AppendColumns(result->GetFieldMetadata());
+            columns.assign(writer.View());
+            keys.reserve(result->GetRowCount());
+            rows.reserve(result->GetRowCount());
+            do
+            {
+                Field* fields = result->Fetch();
+                writer.Clear();
+                writer.AppendField(fields[0]);
+                std::string key(writer.View());
+                writer.Clear();
+                writer.AppendRow(fields, fieldCount);
+                if (rows.emplace(key, std::string(writer.View())).second) // 键重复时保留第一行
+                    keys.push_back(std::move(key));
+            } while (result->NextRow());
+        }
+
+        std::lock_guard<std::mutex> guard(query.Lock);
+        std::vector<std::string const*> upserts, deletes;
+        for (std::string const& key : keys)
+        {
+            std::string const& row = rows[key];
+            auto old = query.Rows.find(key);
+            if (old == query.Rows.end() || old->second != row)
+                upserts.push_back(&row);
+        }
+        for (std::string const& key : query.Keys)
+            if (!rows.count(key))
+                deletes.push_back(&key);
+
+        if (!query.Loaded || !upserts.empty() || !deletes.empty())
+        {
+            std::string message;
+            message.reserve(FRAME_SIZE + 1024);
+            message += query.Head;
+            if (!query.Loaded)
+            {
+                message += ",\"columns\":";
+                message += columns;
+            }
+            auto flush = [&query](std::string const& chunk) { Publish(query, chunk); };
+            message += ",\"upsert\":[";
+            AppendChunked(message, query.Head + ",\"upsert\":[", upserts, flush);
+            message += "],\"delete\":[";
+            AppendChunked(message, query.Head + ",\"delete\":[", deletes, flush);
+            message += "]}";
+            Publish(query, message);
+        }
+
+        query.Loaded = true;
+        query.Columns = std::move(columns);
+        query.Keys = std::move(keys);
+        query.Rows = std::move(rows);
+    }
+
+    void Run()
+    {
+        QueryCallbackProcessor callbacks;
+        std::unique_lock<std::mutex> lock(_lock);
+        while (true)
+        {
+            TimePoint now = std::chrono::steady_clock::now();
+            TimePoint next = now + _interval;
+            std::vector<std::shared_ptr<Query>> due;
+            for (auto itr = _queries.begin(); itr != _queries.end();)
+            {
+                Query& query = *itr->second;
+                if (query.InFlight)
+                {
+                    ++itr;
+                    continue;
+                }
+                if (!query.Subscribers) // 最后一个订阅者已经离开
+                {
+                    itr = _queries.erase(itr);
+                    continue;
+                }
+                if (query.Due <= now)
+                {
+                    query.InFlight = true;
+                    query.Due = now + _interval;
+                    due.push_back(itr->second);
+                }
+                next = std::min(next, query.Due);
+                ++itr;
+            }
+            lock.unlock();
+
+            for (std::shared_ptr<Query>& query : due)
+            {
+                callbacks.AddCallback(SakilaDatabase.AsyncQuery(query->Prepare(), []() { Wake(); })
+                    .WithPreparedCallback([query](PreparedQueryResult result)
+                {
+                    Refresh(*query, std::move(result));
+                    std::lock_guard<std::mutex> guard(_lock);
+                    query->InFlight = false;
+                }));
+            }
+            callbacks.ProcessReadyCallbacks();
+
+            lock.lock();
+            _wake.wait_until(lock, next, []() { return _pending; });
+            _pending = false;
+        }
+    }
+}
+
+void LiveQuery::SetRefreshInterval(Milliseconds interval)
+{
+    _interval = interval;
+}
+
+void LiveQuery::Start()
+{
+    std::thread(Run).detach();
+}
+
+void LiveQuery::Subscribe(conn* c, std::string const& id, std::string const& topic, char const* tables, PrepareFn prepare)
+{
+    std::shared_ptr<Query> query;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        std::shared_ptr<Query>& entry = _queries[topic];
+        if (!entry)
+        {
+            entry = std::make_shared<Query>();
+            entry->Topic = topic;
+            JsonWriter writer;
+            writer.Append("{\"topic\":");
+            writer.AppendString(topic);
+            entry->Head.assign(writer.View());
+            entry->Tables = tables;
+            entry->Prepare = std::move(prepare);
+        }
+        if (!entry->Subscribers++)
+        {
+            entry->Due = std::chrono::steady_clock::now();
+            _pending = true;
+            _wake.notify_one();
+        }
+        query = entry;
+    }
+
+    // 先加入主题再取快照：取快照之前发布的增量已经包含在快照中，重复收到也没有影响
+    pubsub_subscribe(c, topic.data(), int(topic.size()));
+    SendSnapshot(c, id, *query);
+}
+
+void LiveQuery::Unsubscribe(conn* c, std::string const& topic)
+{
+    pubsub_unsubscribe(c, topic.data(), int(topic.size()));
+
+    std::lock_guard<std::mutex> guard(_lock);
+    auto itr = _queries.find(topic);
+    if (itr != _queries.end() && itr->second->Subscribers)
+        --itr->second->Subscribers; // 由刷新线程在执行结束后删除
+}
+
+void LiveQuery::Invalidate(std::string_view table)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    TimePoint now = std::chrono::steady_clock::now();
+    bool any = false;
+    for (auto& [topic, query] : _queries)
+    {
+        if (query->Subscribers && DependsOn(query->Tables, table))
+        {
+            query->Due = now;
+            any = true;
+        }
+    }
+    if (any)
+    {
+        _pending = true;
+        _wake.notify_one();
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _LIVE_QUERY_H
+#define _LIVE_QUERY_H
+
+#include "DatabaseEnvFwd.h"
+#include "Duration.h"
+#include <functional>
+#include <string>
+#include <string_view>
+
+struct conn;
+
+// 订阅的查询：同一个语句和参数的所有订阅者共享一次执行。刷新线程按间隔或在写通知后重新执行，
+// 和上次的结果比较后只推送变化的行，经 pubsub 发给订阅这个主题的所有连接，每次变化只编码一次
+//
+//   订阅时的快照 {"id": 7, "topic": "live:film:[1]", "columns": [...], "rows": [[...]]}
+//   之后的增量   {"topic": "live:film:[1]", "upsert": [[...]], "delete": [1, 2]}
+//
+// 行以第一列为键；upsert 是新增或内容变化的行，delete 是消失的行的键。
+// 还没有结果时订阅只返回 topic，第一次执行的结果以带 columns 的增量推送全部行
+namespace LiveQuery
+{
+    using PrepareFn = std::function<SakilaDatabasePreparedStatement*()>;
+
+    // 没有写通知时重新执行的间隔
+    void SetRefreshInterval(Milliseconds interval);
+
+    // 启动刷新线程
+    void Start();
+
+    // 在连接所属的 reactor 线程中调用：订阅 topic 并发送快照，第一个订阅者创建共享的查询。
+    // tables 是查询依赖的表，逗号分隔；prepare 在刷新线程中调用，返回绑定好参数的语句
+    void Subscribe(conn* c, std::string const& id, std::string const& topic, char const* tables, PrepareFn prepare);
+
+    // 在连接所属的 reactor 线程中调用，连接关闭时对每个订阅调用一次
+    void Unsubscribe(conn* c, std::string const& topic);
+
+    // 表被修改后调用，依赖这个表的查询尽快重新执行；可以在任何线程调用，例如
+    //   SakilaDatabase.Execute(stmt, []() { LiveQuery::Invalidate("rental"); });
+    void Invalidate(std::string_view table);
+}
+
+#endif
@@ -0,0 +1,346 @@
+// 网关压测：每个连接保持depth个请求在途，收到一个完整结果就发下一个，统计吞吐和请求->结果延迟
+//
+// gcc -O2 -o bench_gateway bench_gateway.c
+// ./bench_gateway 127.0.0.1 2000 -c 64 -n 8 -d 10 -q film -P '[%u]' -r 1000
+//
+// -P 是params的JSON，其中的%u替换成1到-r之间的随机数；-n 1就是不用pipelining的对照
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define READ_BUFFER (1 << 20) // 结果按64KB分帧，一个连接上可能同时到达多个帧
+#define MAX_DEPTH 256
+#define EVENT_SIZE 256
+
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct client
+{
+    int fd;
+    int open;
+    int rlength;
+    unsigned char *rbuffer;
+};
+
+// 对数线性直方图：每个2的幂分16个桶，相对误差约6%
+struct hist
+{
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+
+static int depth = 8;
+static int range = 1000;
+static const char *query = "film";
+static const char *params = "[%u]";
+static unsigned long long completed = 0, errors = 0, frames = 0, bytes = 0;
+static int measuring = 0;
+static struct hist latency;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long long v)
+{
+    int msb;
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static unsigned long long hist_value(int index)
+{
+    int major = index >> HIST_SUB_BITS;
+    unsigned long long minor = index & ((1 << HIST_SUB_BITS) - 1);
+    if (major == 0)
+        return minor;
+    return ((1ULL << HIST_SUB_BITS) + minor) << (major - 1);
+}
+
+static void hist_record(struct hist *h, unsigned long long v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static unsigned long long hist_percentile(const struct hist *h, double p)
+{
+    unsigned long long rank = h->count * p / 100, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+// 客户端帧必须带掩码，这里用全0掩码，负载不用变换
+static int encode_frame(unsigned char *out, int opcode, const char *data, int length)
+{
+    int size = 2;
+    out[0] = 0x80 | opcode;
+    if (length < 126)
+    {
+        out[1] = 0x80 | length;
+    }
+    else
+    {
+        out[1] = 0x80 | 126;
+        out[2] = length >> 8;
+        out[3] = length & 0xFF;
+        size = 4;
+    }
+    memset(out + size, 0, 4);
+    memcpy(out + size + 4, data, length);
+    return size + 4 + length;
+}
+
+static int send_all(int fd, const unsigned char *data, int length)
+{
+    while (length > 0)
+    {
+        int count = send(fd, data, length, 0);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += count;
+        length -= count;
+    }
+    return 0;
+}
+
+static int encode_request(unsigned char *out)
+{
+    char text[512], args[256];
+    snprintf(args, sizeof(args), params, (unsigned)(rand() % range + 1));
+    // id就是发送时间（微秒），结果可能乱序返回，直接从回显的id计算延迟
+    int length = snprintf(text, sizeof(text), "{\"id\":%llu,\"query\":\"%s\",\"params\":%s}", now_us(), query, args);
+    return encode_frame(out, 0x1, text, length);
+}
+
+// 解析收到的帧，每个结果的最后一帧算一次完成，返回需要补发的请求数，-1表示连接出错
+static int client_parse(struct client *c)
+{
+    int pos = 0, done = 0;
+
+    if (!c->open)
+    {
+        unsigned char *end = memmem(c->rbuffer, c->rlength, "\r\n\r\n", 4);
+        if (!end)
+            return c->rlength == READ_BUFFER ? -1 : 0;
+        if (memcmp(c->rbuffer, "HTTP/1.1 101", 12) != 0)
+            return -1;
+        pos = end + 4 - c->rbuffer;
+        c->open = 1;
+    }
+
+    while (c->rlength - pos >= 2)
+    {
+        unsigned char *p = c->rbuffer + pos;
+        int opcode = p[0] & 0x0F;
+        unsigned long long length = p[1] & 0x7F;
+        int header = 2, i;
+        if (length == 126)
+        {
+            if (c->rlength - pos < 4)
+                break;
+            length = (p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (length == 127)
+        {
+            if (c->rlength - pos < 10)
+                break;
+            for (length = 0, i = 2; i < 10; ++i)
+                length = (length << 8) | p[i];
+            header = 10;
+        }
+        if (length > READ_BUFFER - 16)
+            return -1;
+        if (c->rlength - pos < header + (long long)length)
+            break;
+
+        if (opcode == 0x1)
+        {
+            const char *text = (const char *)p + header;
+            static const char more[] = ",\"more\":true}";
+            if (measuring)
+            {
+                frames++;
+                bytes += length;
+            }
+            if (length < sizeof(more) - 1 || memcmp(text + length - (sizeof(more) - 1), more, sizeof(more) - 1) != 0)
+            {
+                char *end;
+                unsigned long long sent = strtoull(text + 6, &end, 10); // {"id":
+                if (measuring)
+                {
+                    hist_record(&latency, now_us() - sent);
+                    completed++;
+                    if (strncmp(end, ",\"error\"", 8) == 0)
+                        errors++;
+                }
+                done++;
+            }
+        }
+        else if (opcode == 0x8)
+        {
+            return -1;
+        }
+        pos += header + length;
+    }
+
+    memmove(c->rbuffer, c->rbuffer + pos, c->rlength - pos);
+    c->rlength -= pos;
+    return done;
+}
+
+static int client_event(struct client *c)
+{
+    unsigned char buffer[MAX_DEPTH * 600];
+    int count = recv(c->fd, c->rbuffer + c->rlength, READ_BUFFER - c->rlength, 0);
+    int done, length = 0;
+    if (count <= 0)
+        return count < 0 && errno == EAGAIN ? 0 : -1;
+    c->rlength += count;
+    done = client_parse(c);
+    if (done < 0)
+        return -1;
+    while (done-- > 0)
+        length += encode_request(buffer + length);
+    return length ? send_all(c->fd, buffer, length) : 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s ip port [-c connections] [-n depth] [-d seconds] [-w warmup_seconds] [-q query] [-P params] [-r range]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int nclients = 64, seconds = 10, warmup = 2;
+    struct sockaddr_in addr;
+    struct client *clients;
+    int epfd, opt, i, alive;
+
+    if (argc < 3)
+        usage(argv[0]);
+    optind = 3;
+    while ((opt = getopt(argc, argv, "c:n:d:w:q:P:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nclients = atoi(optarg); break;
+        case 'n': depth = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'q': query = optarg; break;
+        case 'P': params = optarg; break;
+        case 'r': range = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (depth < 1 || depth > MAX_DEPTH || range < 1)
+        usage(argv[0]);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(argv[1]);
+    addr.sin_port = htons(atoi(argv[2]));
+
+    // 同步连接，握手请求和第一批depth个请求一起发出
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    unsigned char buffer[sizeof(request) + MAX_DEPTH * 600];
+    clients = calloc(nclients, sizeof(struct client));
+    epfd = epoll_create1(0);
+    for (i = 0; i < nclients; ++i)
+    {
+        struct client *c = &clients[i];
+        int on = 1, length = sizeof(request) - 1, k;
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            printf("connect %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        c->rbuffer = malloc(READ_BUFFER);
+        memcpy(buffer, request, length);
+        for (k = 0; k < depth; ++k)
+            length += encode_request(buffer + length);
+        if (send_all(c->fd, buffer, length) < 0)
+            return 1;
+        struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    unsigned long long start = now_us(), begin = 0;
+    unsigned long long end = start + (warmup + seconds) * 1000000ULL;
+    alive = nclients;
+    while (alive > 0 && now_us() < end)
+    {
+        struct epoll_event events[EVENT_SIZE];
+        int nready = epoll_wait(epfd, events, EVENT_SIZE, 100);
+        if (!measuring && now_us() - start >= warmup * 1000000ULL)
+        {
+            measuring = 1;
+            begin = now_us();
+        }
+        for (i = 0; i < nready; ++i)
+        {
+            struct client *c = events[i].data.ptr;
+            if (client_event(c) < 0)
+            {
+                printf("connection closed by server\n");
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                alive--;
+            }
+        }
+    }
+    double elapsed = begin ? (now_us() - begin) / 1e6 : 0;
+    if (elapsed <= 0 || completed == 0)
+    {
+        printf("no results\n");
+        return 1;
+    }
+
+    printf("connections: %d, depth: %d, query: %s, results: %llu, errors: %llu, %.0f results/s, %.1f frames/result, %.2f MB/s\n",
+           nclients, depth, query, completed, errors, completed / elapsed, (double)frames / completed, bytes / elapsed / 1e6);
+    printf("request->result us: p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+           hist_percentile(&latency, 50), hist_percentile(&latency, 90), hist_percentile(&latency, 99),
+           hist_percentile(&latency, 99.9), latency.max);
+    printf("{\"connections\": %d, \"depth\": %d, \"results_per_sec\": %.0f, \"errors\": %llu, \"latency_us\": {\"p50\": %llu, "
+           "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+           nclients, depth, completed / elapsed, errors, hist_percentile(&latency, 50), hist_percentile(&latency, 90),
+           hist_percentile(&latency, 99), hist_percentile(&latency, 99.9), latency.max);
+    return errors ? 1 : 0;
+}
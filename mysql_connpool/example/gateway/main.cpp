@@ -0,0 +1,115 @@
+#include "DatabaseEnv.h"
+#include "DatabaseLoader.h"
+#include "Implementation/SakilaDatabase.h"
+#include "Log.h"
+#include "MySQLThreading.h"
+#include "Gateway.h"
+#include "LiveQuery.h"
+#include "server.h"
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+// 负载均衡的健康检查，和 websocket 共用端口
+static void HealthHandler(conn* c, ws_http_request* req)
+{
+    ws_http_respond(c, req, 200, "text/plain", "ok\n", 3);
+}
+
+static void usage(char const* name)
+{
+    printf("usage: %s [options]\n"
+           "  -d dsn    host;port;user;password;database (default 127.0.0.1;3306;root;123456;sakila)\n"
+           "  -a n      async worker threads (default 8)\n"
+           "  -s n      sync connections (default 2)\n"
+           "  -p port   websocket port (default 2000)\n"
+           "  -t n      reactor threads (default: CPU count)\n"
+           "  -i n      max queries in flight per connection (default 64)\n"
+           "  -r ms     re-run subscribed queries this often without a write notification (default 1000)\n"
+           "  -D ms     coalesce result frames queued within this window into one write (default 0: once per loop iteration)\n"
+           "  -C file   serve wss:// with this PEM certificate chain\n"
+           "  -K file   private key for -C\n"
+           "  -o file   append the log to this file instead of stdout\n",
+           name);
+}
+
+int main(int argc, char* argv[])
+{
+    std::string dsn = "127.0.0.1;3306;root;123456;sakila";
+    uint8 asyncThreads = 8, syncThreads = 2;
+    unsigned short port = 2000;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char const* logfile = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:a:s:p:t:i:r:D:C:K:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': dsn = optarg; break;
+            case 'a': asyncThreads = uint8(atoi(optarg)); break;
+            case 's': syncThreads = uint8(atoi(optarg)); break;
+            case 'p': port = (unsigned short)atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'i': Gateway::SetMaxInflight(uint32(atoi(optarg))); break;
+            case 'r': LiveQuery::SetRefreshInterval(Milliseconds(atoi(optarg))); break;
+            case 'D': ws_queue_config.flush_delay = atoi(optarg); break;
+            case 'C': ws_tls_config.cert = optarg; break;
+            case 'K': ws_tls_config.key = optarg; break;
+            case 'o': logfile = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    MySQL::Library_Init();
+
+    DatabaseLoader loader;
+    loader.AddDatabase(SakilaDatabase, dsn, asyncThreads, syncThreads);
+    if (!loader.Load())
+    {
+        TC_LOG_ERROR("", "SakilaDatabase connect error");
+        return 1;
+    }
+    TC_LOG_INFO("", "SakilaDatabase connect success");
+
+    // 空闲时数据库连接会被服务器断开，定期 ping 一下
+    std::thread([]()
+    {
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::minutes(5));
+            SakilaDatabase.KeepAlive();
+        }
+    }).detach();
+
+    int logfd = logfile ? open(logfile, O_WRONLY | O_CREAT | O_APPEND, 0644) : STDOUT_FILENO;
+    if (logfd < 0)
+    {
+        printf("open %s: %s\n", logfile, strerror(errno));
+        return 1;
+    }
+    if (log_init(logfd) < 0)
+        return 1;
+
+    if (ws_tls_config.cert)
+    {
+        if (!ws_tls_config.key)
+            ws_tls_config.key = ws_tls_config.cert;
+        if (tls_init() < 0)
+            return 1;
+    }
+
+    LiveQuery::Start();
+    ws_handler.message = Gateway::OnMessage;
+    ws_handler.release = Gateway::OnRelease;
+    // 客户端不能直接 SUB/PUB live: 主题，否则可以绕过查询白名单或伪造增量
+    ws_handler.no_commands = 1;
+    ws_http_route("GET", "/healthz", HealthHandler);
+    return reactor_run(port, threads) < 0 ? 1 : 0;
+}
@@ -0,0 +1,403 @@
+// 写合并基准：聊天室式的小消息，每个客户端订阅自己的房间，按固定间隔（随机相位）往房间里发一条短消息，
+// 房间里的每个人都收到一帧。统计送达延迟，并在测量前后用STATS读取服务器的帧数、写调用和epoll_ctl次数，
+// 得到每帧的系统调用数
+//
+// gcc -O2 -o bench_coalesce bench_coalesce.c
+// ./server -D 0 2000 4 &
+// ./bench_coalesce 127.0.0.1 2000 -c 2000 -m 20 -i 100 -d 10
+//
+// 分别用 -D 0（每轮事件循环合并一次）和 -D 2 等启动服务器，比较syscalls/frame和延迟
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define READ_BUFFER (64 * 1024)
+#define EVENT_SIZE 1024
+
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct client
+{
+    int fd;
+    int open;
+    int room;
+    int rlength;
+    unsigned long long next; // 下一次发言的时间
+    unsigned char rbuffer[READ_BUFFER];
+};
+
+// 对数线性直方图：每个2的幂分16个桶，相对误差约6%
+struct hist
+{
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+
+// STATS中服务器的发送计数，旧版本服务器没有这些字段时为-1
+struct server_counters
+{
+    long long frames;
+    long long writes;
+    long long epoll_mods;
+};
+
+static int measuring = 0;
+static unsigned long long received = 0, sent = 0;
+static struct hist latency;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long long v)
+{
+    int msb;
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static unsigned long long hist_value(int index)
+{
+    int major = index >> HIST_SUB_BITS;
+    unsigned long long minor = index & ((1 << HIST_SUB_BITS) - 1);
+    if (major == 0)
+        return minor;
+    return ((1ULL << HIST_SUB_BITS) + minor) << (major - 1);
+}
+
+static void hist_record(struct hist *h, unsigned long long v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static unsigned long long hist_percentile(const struct hist *h, double p)
+{
+    unsigned long long rank = h->count * p / 100, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+// 客户端帧必须带掩码，这里用全0掩码，负载不用变换
+static int encode_frame(unsigned char *out, int opcode, const char *data, int length)
+{
+    int size = 2;
+    out[0] = 0x80 | opcode;
+    if (length < 126)
+    {
+        out[1] = 0x80 | length;
+    }
+    else
+    {
+        out[1] = 0x80 | 126;
+        out[2] = length >> 8;
+        out[3] = length & 0xFF;
+        size = 4;
+    }
+    memset(out + size, 0, 4);
+    memcpy(out + size + 4, data, length);
+    return size + 4 + length;
+}
+
+static int send_all(int fd, const unsigned char *data, int length)
+{
+    while (length > 0)
+    {
+        int count = send(fd, data, length, 0);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += count;
+        length -= count;
+    }
+    return 0;
+}
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                              "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+
+// 同步连接并等到101响应，返回阻塞的fd
+static int connect_ws(struct sockaddr_in *addr)
+{
+    char buffer[1024];
+    int length = 0, on = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (send_all(fd, (const unsigned char *)request, sizeof(request) - 1) < 0)
+        return -1;
+    while (!memmem(buffer, length, "\r\n\r\n", 4))
+    {
+        int count = recv(fd, buffer + length, sizeof(buffer) - length, 0);
+        if (count <= 0)
+            return -1;
+        length += count;
+    }
+    return fd;
+}
+
+static long long stats_field(const char *json, const char *name)
+{
+    char key[64];
+    const char *p;
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    p = strstr(json, key);
+    return p ? atoll(p + strlen(key)) : -1;
+}
+
+// 用单独的连接发送STATS，取出"server"部分的发送计数
+static int read_counters(int fd, struct server_counters *out)
+{
+    unsigned char buffer[4096];
+    int length = 0, header;
+    send_all(fd, buffer, encode_frame(buffer, 0x1, "STATS", 5));
+    while (1)
+    {
+        int count = recv(fd, buffer + length, sizeof(buffer) - 1 - length, 0);
+        if (count <= 0)
+            return -1;
+        length += count;
+        if (length < 4)
+            continue;
+        header = (buffer[1] & 0x7F) == 126 ? 4 : 2;
+        if (length >= header + ((buffer[1] & 0x7F) == 126 ? (buffer[2] << 8 | buffer[3]) : (buffer[1] & 0x7F)))
+            break;
+    }
+    buffer[length] = '\0';
+    const char *server = strstr((const char *)buffer, "\"server\":");
+    if (server == NULL)
+        return -1;
+    out->frames = stats_field(server, "frames");
+    out->writes = stats_field(server, "writes");
+    out->epoll_mods = stats_field(server, "epoll_mods");
+    return 0;
+}
+
+// 解析收到的帧：握手响应之后是房间消息，负载以发送时间开头
+static int client_parse(struct client *c)
+{
+    int pos = 0;
+    if (!c->open)
+    {
+        unsigned char *end = memmem(c->rbuffer, c->rlength, "\r\n\r\n", 4);
+        if (!end)
+            return c->rlength == READ_BUFFER ? -1 : 0;
+        if (memcmp(c->rbuffer, "HTTP/1.1 101", 12) != 0)
+            return -1;
+        pos = end + 4 - c->rbuffer;
+        c->open = 1;
+    }
+    while (c->rlength - pos >= 2)
+    {
+        unsigned char *p = c->rbuffer + pos;
+        int length = p[1] & 0x7F, header = 2;
+        if (length == 126)
+        {
+            if (c->rlength - pos < 4)
+                break;
+            length = (p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (length == 127)
+        {
+            return -1;
+        }
+        if (c->rlength - pos < header + length)
+            break;
+        if ((p[0] & 0x0F) == 0x1 && measuring)
+        {
+            unsigned long long stamp = strtoull((const char *)p + header, NULL, 10);
+            hist_record(&latency, now_us() - stamp);
+            received++;
+        }
+        pos += header + length;
+    }
+    memmove(c->rbuffer, c->rbuffer + pos, c->rlength - pos);
+    c->rlength -= pos;
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s ip port [-c clients] [-m room_size] [-i interval_ms] [-s size] [-d seconds] [-w warmup_seconds]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int nclients = 2000, room_size = 20, interval_ms = 100, size = 32, seconds = 10, warmup = 2;
+    struct sockaddr_in addr;
+    struct rlimit rl;
+    struct client *clients;
+    struct server_counters before, after;
+    int epfd, opt, i, control;
+
+    if (argc < 3)
+        usage(argv[0]);
+    optind = 3;
+    while ((opt = getopt(argc, argv, "c:m:i:s:d:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nclients = atoi(optarg); break;
+        case 'm': room_size = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nclients < 1 || room_size < 1 || interval_ms < 1 || size < 1 || size > 1024)
+        usage(argv[0]);
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(argv[1]);
+    addr.sin_port = htons(atoi(argv[2]));
+
+    control = connect_ws(&addr);
+    if (control < 0)
+    {
+        printf("connect failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // 每个客户端订阅自己的房间，用ping等到SUB被处理之后再开始
+    clients = calloc(nclients, sizeof(struct client));
+    epfd = epoll_create1(0);
+    srand(1);
+    for (i = 0; i < nclients; ++i)
+    {
+        struct client *c = &clients[i];
+        unsigned char buffer[256];
+        char sub[64];
+        int length;
+        c->room = i / room_size;
+        c->fd = connect_ws(&addr);
+        if (c->fd < 0)
+        {
+            printf("connect %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        c->open = 1;
+        length = encode_frame(buffer, 0x1, sub, snprintf(sub, sizeof(sub), "SUB room%d", c->room));
+        send_all(c->fd, buffer, length);
+        c->next = now_us() + (unsigned long long)(rand() % (interval_ms * 1000)); // 随机相位，模拟各自独立的发言
+        struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    usleep(200 * 1000);
+
+    unsigned long long start = now_us(), begin = 0;
+    unsigned long long end = start + (warmup + seconds) * 1000000ULL;
+    unsigned long long sent_start = 0;
+    while (now_us() < end)
+    {
+        struct epoll_event events[EVENT_SIZE];
+        unsigned long long now = now_us();
+        int nready;
+
+        if (!measuring && now - start >= warmup * 1000000ULL)
+        {
+            if (read_counters(control, &before) < 0)
+                return 1;
+            measuring = 1;
+            begin = now_us();
+            sent_start = sent;
+        }
+        // 到时间的客户端发一条消息
+        for (i = 0; i < nclients; ++i)
+        {
+            struct client *c = &clients[i];
+            if (c->next <= now)
+            {
+                unsigned char buffer[1200];
+                char text[1100];
+                int length = snprintf(text, sizeof(text), "PUB room%d %llu ", c->room, now_us());
+                memset(text + length, 'x', size);
+                send_all(c->fd, buffer, encode_frame(buffer, 0x1, text, length + size));
+                sent++;
+                c->next += interval_ms * 1000ULL;
+            }
+        }
+
+        nready = epoll_wait(epfd, events, EVENT_SIZE, 1);
+        for (i = 0; i < nready; ++i)
+        {
+            struct client *c = events[i].data.ptr;
+            int count = recv(c->fd, c->rbuffer + c->rlength, READ_BUFFER - c->rlength, 0);
+            if (count <= 0 || (c->rlength += count, client_parse(c) < 0))
+            {
+                printf("connection closed by server\n");
+                return 1;
+            }
+        }
+    }
+    double elapsed = (now_us() - begin) / 1e6;
+    if (read_counters(control, &after) < 0 || received == 0)
+    {
+        printf("no results\n");
+        return 1;
+    }
+
+    printf("clients: %d, room size: %d, interval: %d ms, messages: %llu, deliveries: %llu, %.0f deliveries/s\n",
+           nclients, room_size, interval_ms, sent - sent_start, received, received / elapsed);
+    printf("message->delivery us: p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+           hist_percentile(&latency, 50), hist_percentile(&latency, 90), hist_percentile(&latency, 99),
+           hist_percentile(&latency, 99.9), latency.max);
+    if (after.frames >= 0)
+    {
+        long long frames = after.frames - before.frames;
+        long long writes = after.writes - before.writes;
+        long long mods = after.epoll_mods - before.epoll_mods;
+        printf("server frames: %lld, writes: %lld, epoll_ctl: %lld, frames/write: %.2f, syscalls/frame: %.3f\n",
+               frames, writes, mods, frames ? (double)frames / writes : 0, frames ? (double)(writes + mods) / frames : 0);
+    }
+    else
+    {
+        printf("server does not report send counters\n");
+    }
+    printf("{\"clients\": %d, \"room_size\": %d, \"deliveries_per_sec\": %.0f, \"latency_us\": {\"p50\": %llu, \"p99\": %llu, "
+           "\"max\": %llu}, \"frames\": %lld, \"writes\": %lld, \"epoll_mods\": %lld}\n",
+           nclients, room_size, received / elapsed, hist_percentile(&latency, 50), hist_percentile(&latency, 99), latency.max,
+           after.frames - before.frames, after.writes - before.writes, after.epoll_mods - before.epoll_mods);
+    return 0;
+}
@@ -0,0 +1,303 @@
+// 帧编解码基准：decode_packet、encode_packet、demask、握手，以及完整的接收路径
+// 在不同负载长度和分片方式下的ns/frame、GB/s和每帧的内存分配次数
+//
+// gcc -O2 -o bench_codec bench_codec.c websocket.c pubsub.c deflate.c utf8.c session.c http.c log.c -pthread -lz
+// ./bench_codec [seconds_per_case]
+//
+// 编解码函数本身不应分配内存，分配次数不为0时返回1，可以放进回归检查
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 替换glibc的分配函数来计数，整个程序都会经过这里
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static long long allocs = 0;
+
+void *malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    allocs++;
+    return __libc_realloc(p, size);
+}
+
+static double seconds = 0.3;
+static int failed = 0;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 一个结果行：bytes是每帧的负载字节数，用来计算GB/s
+static void report(const char *name, const char *variant, long long frames, long long bytes, long long nalloc, double elapsed, int expect_none)
+{
+    printf("%-10s %-22s %10.1f ns/frame", name, variant, elapsed * 1e9 / frames);
+    if (bytes)
+        printf(" %8.2f GB/s", (double)bytes * frames / elapsed / 1e9);
+    else
+        printf(" %8s     ", "-");
+    printf(" %8.3f allocs/frame\n", (double)nalloc / frames);
+    if (expect_none && nalloc)
+    {
+        printf("%s %s: expected no allocations\n", name, variant);
+        failed = 1;
+    }
+}
+
+// 生成客户端发来的帧：带掩码，一条消息分成fragments帧
+static int client_frames(char *out, int opcode, const char *payload, int length, int fragments)
+{
+    static const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    int pos = 0, sent = 0, i, j;
+
+    for (i = 0; i < fragments; ++i)
+    {
+        int size = i == fragments - 1 ? length - sent : length / fragments;
+        int header = encode_header(out + pos, i == fragments - 1, i == 0 ? opcode : WS_OPCODE_CONTINUATION, size);
+        out[pos + 1] |= 0x80; // MASK位
+        pos += header;
+        memcpy(out + pos, mask, 4);
+        pos += 4;
+        for (j = 0; j < size; ++j)
+            out[pos + j] = payload[sent + j] ^ mask[j & 3];
+        pos += size;
+        sent += size;
+    }
+    return pos;
+}
+
+static void bench_decode(void)
+{
+    int sizes[] = {16, 1000, 70000};
+    const char *names[] = {"7-bit length", "16-bit length", "64-bit length"};
+    char stream[16];
+    int i;
+
+    for (i = 0; i < 3; ++i)
+    {
+        struct ws_frame frame;
+        long long count = 0, before = allocs;
+        double start = now_sec(), elapsed;
+        int n = encode_header(stream, 1, WS_OPCODE_BINARY, sizes[i]);
+        stream[1] |= 0x80;
+        memset(stream + n, 0x5a, 4);
+        do
+        {
+            int k;
+            for (k = 0; k < 256; ++k)
+            {
+                stream[4] ^= k; // 防止编译器把循环中的调用合并掉
+                if (decode_packet(&frame, (const unsigned char *)stream, n + 4) != n + 4)
+                {
+                    printf("decode_packet failed\n");
+                    exit(1);
+                }
+            }
+            count += 256;
+            elapsed = now_sec() - start;
+        } while (elapsed < seconds);
+        report("decode", names[i], count, 0, allocs - before, elapsed, 1);
+    }
+}
+
+static void bench_encode(const int *sizes, int nsize)
+{
+    char *payload = malloc(sizes[nsize - 1]);
+    char *buffer = malloc(sizes[nsize - 1] + 10);
+    char variant[32];
+    int i;
+
+    memset(payload, 'x', sizes[nsize - 1]);
+    for (i = 0; i < nsize; ++i)
+    {
+        long long count = 0, before = allocs;
+        double start = now_sec(), elapsed;
+        do
+        {
+            int k;
+            for (k = 0; k < 16; ++k)
+                encode_packet(buffer, WS_OPCODE_BINARY, payload, sizes[i]);
+            count += 16;
+            elapsed = now_sec() - start;
+        } while (elapsed < seconds);
+        snprintf(variant, sizeof(variant), "%d bytes", sizes[i]);
+        report("encode", variant, count, sizes[i], allocs - before, elapsed, 1);
+    }
+    free(payload);
+    free(buffer);
+}
+
+static void bench_demask(const int *sizes, int nsize)
+{
+    static const unsigned char mask[4] = {0xde, 0xad, 0xbe, 0xef};
+    char *buffer = malloc(sizes[nsize - 1] + 1);
+    char variant[32];
+    int i;
+
+    memset(buffer, 0x5a, sizes[nsize - 1] + 1);
+    for (i = 0; i < nsize; ++i)
+    {
+        long long count = 0, before = allocs;
+        double start = now_sec(), elapsed;
+        do
+        {
+            int k;
+            for (k = 0; k < 16; ++k)
+                demask(buffer + 1, sizes[i], mask, k); // 帧头之后的负载通常不对齐
+            count += 16;
+            elapsed = now_sec() - start;
+        } while (elapsed < seconds);
+        snprintf(variant, sizeof(variant), "%d bytes", sizes[i]);
+        report("demask", variant, count, sizes[i], allocs - before, elapsed, 1);
+    }
+    free(buffer);
+}
+
+// 和bench_handshake一样：解析请求头，计算Accept，生成101响应
+static void bench_upgrade(void)
+{
+    static const char request[] = "GET /chat HTTP/1.1\r\n"
+                                  "Host: 127.0.0.1:2000\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    static struct conn c;
+    static struct reactor r;
+    char rbuffer[BUFFER_LENGTH];
+    long long count = 0, before = allocs;
+    double start = now_sec(), elapsed;
+
+    c.reactor = &r;
+    do
+    {
+        memset(&c.hs, 0, sizeof(c.hs));
+        c.status = WS_STATUS_HANDSHAKE;
+        c.rbuffer = rbuffer;
+        c.rcapacity = sizeof(rbuffer);
+        memcpy(rbuffer, request, sizeof(request) - 1);
+        c.rlength = sizeof(request) - 1;
+        ws_request(&c);
+        if (c.status != WS_STATUS_OPEN)
+        {
+            printf("handshake failed\n");
+            exit(1);
+        }
+        while (c.wcount > 0)
+            ws_queue_pop(&c);
+        count++;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+    c.rbuffer = NULL;
+    ws_release(&c);
+    report("handshake", "101 response", count, 0, allocs - before, elapsed, 0);
+}
+
+// 完整的接收路径：按每次read的大小把客户端帧放进rbuffer，经ws_request解码、去掩码、校验，
+// 再由echo编码进发送队列；每条消息处理完清空队列，相当于发送成功
+static void bench_receive(int opcode, int length, int fragments, int chunk)
+{
+    static struct conn c;
+    static struct reactor r;
+    char *payload = malloc(length);
+    char *wire = malloc(length + fragments * 14);
+    int size, i;
+    long long count = 0, before;
+    double start, elapsed;
+    char variant[48];
+
+    for (i = 0; i < length; ++i)
+        payload[i] = 'a' + i % 26;
+    size = client_frames(wire, opcode, payload, length, fragments);
+
+    memset(&c, 0, sizeof(c));
+    c.reactor = &r;
+    c.status = WS_STATUS_OPEN;
+    c.rcapacity = size + BUFFER_LENGTH;
+    c.rbuffer = malloc(c.rcapacity);
+
+    before = allocs;
+    start = now_sec();
+    do
+    {
+        int pos = 0;
+        while (pos < size)
+        {
+            int n = size - pos < chunk ? size - pos : chunk;
+            memcpy(c.rbuffer + c.rlength, wire + pos, n); // 相当于recv
+            c.rlength += n;
+            pos += n;
+            ws_request(&c);
+        }
+        if (c.status != WS_STATUS_OPEN || c.wcount == 0)
+        {
+            printf("receive failed\n");
+            exit(1);
+        }
+        while (c.wcount > 0)
+            ws_queue_pop(&c);
+        count++;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+
+    if (chunk >= size)
+        snprintf(variant, sizeof(variant), "%s %d x%d", opcode == WS_OPCODE_TEXT ? "text" : "bin", length, fragments);
+    else
+        snprintf(variant, sizeof(variant), "%s %d x%d /%d", opcode == WS_OPCODE_TEXT ? "text" : "bin", length, fragments, chunk);
+    // 按帧计算，负载字节数按每帧平均
+    report("receive", variant, count * fragments, length / fragments, allocs - before, elapsed, 0);
+
+    ws_release(&c);
+    free(payload);
+    free(wire);
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes[] = {16, 125, 1024, 16384, 65536, 1048576};
+    int nsize = sizeof(sizes) / sizeof(sizes[0]);
+    int i;
+
+    if (argc > 1)
+        seconds = atof(argv[1]);
+
+    bench_decode();
+    bench_encode(sizes, nsize);
+    bench_demask(sizes, nsize);
+    bench_upgrade();
+
+    // 单帧消息：负载长度覆盖三种长度编码，整帧一次到达
+    for (i = 0; i < nsize; ++i)
+        bench_receive(WS_OPCODE_BINARY, sizes[i], 1, 1 << 30);
+    bench_receive(WS_OPCODE_TEXT, 125, 1, 1 << 30);
+    bench_receive(WS_OPCODE_TEXT, 65536, 1, 1 << 30);
+    // 分片消息：在消息缓冲区中拼接
+    bench_receive(WS_OPCODE_BINARY, 65536, 4, 1 << 30);
+    bench_receive(WS_OPCODE_BINARY, 65536, 64, 1 << 30);
+    bench_receive(WS_OPCODE_TEXT, 65536, 64, 1 << 30);
+    // 一帧分多次到达：按TCP段大小和很小的读
+    bench_receive(WS_OPCODE_BINARY, 65536, 1, 1448);
+    bench_receive(WS_OPCODE_TEXT, 65536, 1, 1448);
+    bench_receive(WS_OPCODE_BINARY, 1024, 1, 7);
+    return failed;
+}
@@ -0,0 +1,116 @@
+// demask微基准：比较各个实现在不同负载长度下的吞吐量（GB/s）
+//
+// gcc -O2 -o bench_demask bench_demask.c websocket.c pubsub.c deflate.c utf8.c session.c http.c log.c -pthread -lz
+// ./bench_demask [seconds_per_case]
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct kernel
+{
+    const char *name;
+    void (*fn)(char *data, int len, const unsigned char *mask, unsigned long long offset);
+};
+
+// 原来的逐字节实现，作为正确性和性能的参照
+static void demask_bytewise(char *data, int len, const unsigned char *mask, unsigned long long offset)
+{
+    int i;
+    for (i = 0; i < len; ++i)
+        data[i] ^= mask[(offset + i) % 4];
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 各种起始地址、长度和掩码偏移下与参照实现逐字节比较
+static int verify(struct kernel *k)
+{
+    unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    char src[600], expect[600], got[600];
+    int align, len, offset, i;
+
+    for (i = 0; i < (int)sizeof(src); ++i)
+        src[i] = rand();
+    for (align = 0; align < 40; ++align)
+        for (len = 0; len < 300; ++len)
+            for (offset = 0; offset < 4; ++offset)
+            {
+                memcpy(expect, src, sizeof(src));
+                memcpy(got, src, sizeof(src));
+                demask_bytewise(expect + align, len, mask, offset);
+                k->fn(got + align, len, mask, offset);
+                if (memcmp(expect, got, sizeof(src)) != 0)
+                {
+                    printf("%s: mismatch at align %d len %d offset %d\n", k->name, align, len, offset);
+                    return -1;
+                }
+            }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    struct kernel kernels[8];
+    int nkernel = 0;
+    unsigned char mask[4] = {0xde, 0xad, 0xbe, 0xef};
+    int sizes[] = {16, 64, 125, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+    int nsize = sizeof(sizes) / sizeof(sizes[0]);
+    char *buffer;
+    int i, j;
+
+    kernels[nkernel++] = (struct kernel){"bytewise", demask_bytewise};
+    kernels[nkernel++] = (struct kernel){"scalar64", demask_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[nkernel++] = (struct kernel){"sse2", demask_sse2};
+    if (__builtin_cpu_supports("avx2"))
+        kernels[nkernel++] = (struct kernel){"avx2", demask_avx2};
+#endif
+    kernels[nkernel++] = (struct kernel){"demask", demask};
+
+    for (i = 0; i < nkernel; ++i)
+        if (verify(&kernels[i]) < 0)
+            return 1;
+
+    // 多留1字节，让负载从奇数地址开始，模拟帧头之后不对齐的情况
+    buffer = malloc(sizes[nsize - 1] + 64);
+    memset(buffer, 0x5a, sizes[nsize - 1] + 64);
+
+    printf("%10s", "size");
+    for (i = 0; i < nkernel; ++i)
+        printf("%12s", kernels[i].name);
+    printf("   (GB/s)\n");
+
+    for (j = 0; j < nsize; ++j)
+    {
+        printf("%10d", sizes[j]);
+        for (i = 0; i < nkernel; ++i)
+        {
+            long long rounds = 0;
+            double start = now_sec(), elapsed;
+            do
+            {
+                int k;
+                for (k = 0; k < 64; ++k)
+                    kernels[i].fn(buffer + 1, sizes[j], mask, rounds + k);
+                rounds += 64;
+                elapsed = now_sec() - start;
+            } while (elapsed < seconds);
+            printf("%12.2f", (double)rounds * sizes[j] / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,196 @@
+// 握手微基准：比较Sec-WebSocket-Accept的计算方式，并测量单核每秒能完成的握手数
+//
+// gcc -O2 -o bench_handshake bench_handshake.c websocket.c pubsub.c deflate.c utf8.c session.c http.c log.c -pthread -lz -lcrypto
+// ./bench_handshake [seconds_per_case] > /dev/null    (结果输出到stderr)
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/sha.h>
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+
+#define GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 原来的实现：SHA1后经BIO链做Base64，每次握手申请和释放两个BIO
+static int accept_bio(const char *key, int length, char *accept)
+{
+    char key_guid[64];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    BIO *b64, *bio;
+    BUF_MEM *bptr = NULL;
+    int size;
+
+    memcpy(key_guid, key, length);
+    memcpy(key_guid + length, GUID, sizeof(GUID) - 1);
+    SHA1((unsigned char *)key_guid, length + sizeof(GUID) - 1, digest);
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_new(BIO_s_mem());
+    bio = BIO_push(b64, bio);
+    BIO_write(bio, digest, SHA_DIGEST_LENGTH);
+    BIO_flush(bio);
+    BIO_get_mem_ptr(bio, &bptr);
+    memcpy(accept, bptr->data, bptr->length);
+    accept[bptr->length - 1] = '\0';
+    size = bptr->length - 1;
+    BIO_free_all(bio);
+    return size;
+}
+
+// OpenSSL一次性接口：SHA1 + EVP_EncodeBlock
+static int accept_evp(const char *key, int length, char *accept)
+{
+    char key_guid[64];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+
+    memcpy(key_guid, key, length);
+    memcpy(key_guid + length, GUID, sizeof(GUID) - 1);
+    SHA1((unsigned char *)key_guid, length + sizeof(GUID) - 1, digest);
+    return EVP_EncodeBlock((unsigned char *)accept, digest, SHA_DIGEST_LENGTH);
+}
+
+static void random_key(char *key)
+{
+    unsigned char raw[16];
+    int i;
+    for (i = 0; i < 16; ++i)
+        raw[i] = rand();
+    base64_encode(raw, 16, key);
+}
+
+// 与OpenSSL的结果逐一比较
+static int verify(void)
+{
+    unsigned char data[300], expect[SHA_DIGEST_LENGTH], got[SHA_DIGEST_LENGTH];
+    char key[32], a[512], b[512];
+    int i;
+
+    for (i = 0; i < (int)sizeof(data); ++i)
+        data[i] = rand();
+    for (i = 0; i <= (int)sizeof(data); ++i)
+    {
+        SHA1(data, i, expect);
+        sha1(data, i, got);
+        if (memcmp(expect, got, SHA_DIGEST_LENGTH) != 0)
+        {
+            fprintf(stderr, "sha1 mismatch at length %d\n", i);
+            return -1;
+        }
+        EVP_EncodeBlock((unsigned char *)a, data, i);
+        base64_encode(data, i, b);
+        if (strcmp(a, b) != 0)
+        {
+            fprintf(stderr, "base64 mismatch at length %d\n", i);
+            return -1;
+        }
+    }
+    for (i = 0; i < 1000; ++i)
+    {
+        random_key(key);
+        accept_bio(key, 24, a);
+        ws_accept_key(key, 24, b);
+        if (strcmp(a, b) != 0)
+        {
+            fprintf(stderr, "accept mismatch for key %s: %s != %s\n", key, a, b);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void bench_accept(const char *name, int (*fn)(const char *, int, char *), double seconds)
+{
+    char keys[64][32], accept[64];
+    long long count = 0;
+    double start = now_sec(), elapsed;
+    int i;
+
+    for (i = 0; i < 64; ++i)
+        random_key(keys[i]);
+    do
+    {
+        for (i = 0; i < 64; ++i)
+            fn(keys[i], 24, accept);
+        count += 64;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+    fprintf(stderr, "%-24s %12.0f keys/s %10.1f ns/key\n", name, count / elapsed, elapsed * 1e9 / count);
+}
+
+// 完整的握手：解析请求头，计算Accept，生成101响应
+static void bench_request(double seconds)
+{
+    static struct conn c;
+    static struct reactor r;
+    char request[512];
+    char rbuffer[BUFFER_LENGTH];
+    char key[32];
+    long long count = 0;
+    double start = now_sec(), elapsed;
+    int length;
+
+    c.reactor = &r;
+    random_key(key);
+    length = snprintf(request, sizeof(request),
+                      "GET /chat HTTP/1.1\r\n"
+                      "Host: 127.0.0.1:2000\r\n"
+                      "User-Agent: bench\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: %s\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n",
+                      key);
+    do
+    {
+        int i;
+        for (i = 0; i < 64; ++i)
+        {
+            memset(&c.hs, 0, sizeof(c.hs));
+            c.status = WS_STATUS_HANDSHAKE;
+            while (c.wcount > 0)
+                ws_queue_pop(&c);
+            c.rbuffer = rbuffer;
+            c.rcapacity = sizeof(rbuffer);
+            memcpy(c.rbuffer, request, length);
+            c.rlength = length;
+            ws_request(&c);
+            if (c.status != WS_STATUS_OPEN)
+            {
+                fprintf(stderr, "handshake failed\n");
+                exit(1);
+            }
+        }
+        count += 64;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+    c.rbuffer = NULL;
+    ws_release(&c);
+    fprintf(stderr, "%-24s %12.0f handshakes/s %6.1f ns/handshake\n", "ws_request", count / elapsed, elapsed * 1e9 / count);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+
+    if (verify() < 0)
+        return 1;
+
+    bench_accept("openssl sha1 + bio", accept_bio, seconds);
+    bench_accept("openssl sha1 + evp", accept_evp, seconds);
+    bench_accept("ws_accept_key", ws_accept_key, seconds);
+    bench_request(seconds);
+    return 0;
+}
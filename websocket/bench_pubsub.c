@@ -0,0 +1,443 @@
+// 发布/订阅基准：大量连接订阅同一个主题，测量从发布到每个订阅者收到的延迟
+//
+// gcc -O2 -o bench_pubsub bench_pubsub.c
+// ./bench_pubsub 127.0.0.1 2000 -c 100000 -n 50 -i 200 -a 127.0.0.2,127.0.0.3
+//
+// 每条发布消息的负载是"<序号> <填充>"，订阅者收到后用当前时间减去这条消息的发送时间；
+// 同时统计每条消息送达全部订阅者所用的时间（扇出完成时间）
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define TOPIC "bench"
+#define MAX_SOURCES 64
+#define MAX_CONNECTING 2000 // 同时进行中的connect个数，避免SYN队列溢出
+#define SUB_BUFFER 2048 // 每个订阅者一份，10万订阅者约200MB
+#define EVENT_SIZE 1024
+
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+enum
+{
+    SUB_CONNECTING = 0,
+    SUB_HANDSHAKE, // 等待101响应和对ping的pong，pong到达说明SUB已经被处理
+    SUB_READY,
+    SUB_CLOSED,
+};
+
+struct sub
+{
+    int fd;
+    int status;
+    int rlength;
+    unsigned char rbuffer[SUB_BUFFER];
+};
+
+// 对数线性直方图：每个2的幂分16个桶，相对误差约6%
+struct hist
+{
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+
+static struct sub *subs;
+static int ready = 0;
+static int closed = 0;
+static int *delivered;                // 每条发布消息已送达的订阅者数
+static unsigned long long *published; // 每条发布消息的发送时间
+static struct hist latency, fanout;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long long v)
+{
+    int msb;
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static unsigned long long hist_value(int index)
+{
+    int major = index >> HIST_SUB_BITS;
+    unsigned long long minor = index & ((1 << HIST_SUB_BITS) - 1);
+    if (major == 0)
+        return minor;
+    return ((1ULL << HIST_SUB_BITS) + minor) << (major - 1);
+}
+
+static void hist_record(struct hist *h, unsigned long long v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static unsigned long long hist_percentile(const struct hist *h, double p)
+{
+    unsigned long long rank = h->count * p / 100, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+// 客户端帧必须带掩码，这里用全0掩码，负载不用变换
+static int encode_frame(unsigned char *out, int opcode, const char *data, int length)
+{
+    int size = 2;
+    out[0] = 0x80 | opcode;
+    if (length < 126)
+    {
+        out[1] = 0x80 | length;
+    }
+    else
+    {
+        out[1] = 0x80 | 126;
+        out[2] = length >> 8;
+        out[3] = length & 0xFF;
+        size = 4;
+    }
+    memset(out + size, 0, 4);
+    memcpy(out + size + 4, data, length);
+    return size + 4 + length;
+}
+
+static int send_all(int fd, const unsigned char *data, int length)
+{
+    while (length > 0)
+    {
+        int count = send(fd, data, length, 0);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += count;
+        length -= count;
+    }
+    return 0;
+}
+
+// 握手请求、订阅命令和一个ping一起发出
+static int send_subscribe(int fd)
+{
+    unsigned char buffer[512];
+    int length = sprintf((char *)buffer,
+                         "GET / HTTP/1.1\r\n"
+                         "Host: bench\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                         "Sec-WebSocket-Version: 13\r\n\r\n");
+    length += encode_frame(buffer + length, 0x1, "SUB " TOPIC, sizeof("SUB " TOPIC) - 1);
+    length += encode_frame(buffer + length, 0x9, "", 0);
+    return send_all(fd, buffer, length);
+}
+
+static void sub_close(struct sub *s)
+{
+    if (s->status == SUB_READY)
+        ready--;
+    s->status = SUB_CLOSED;
+    close(s->fd);
+    closed++;
+}
+
+// 解析收到的帧，返回-1表示连接出错
+static int sub_parse(struct sub *s)
+{
+    int pos = 0;
+
+    if (s->status == SUB_HANDSHAKE && !memmem(s->rbuffer, s->rlength, "\r\n\r\n", 4))
+        return s->rlength == SUB_BUFFER ? -1 : 0;
+    if (s->status == SUB_HANDSHAKE)
+    {
+        unsigned char *end = memmem(s->rbuffer, s->rlength, "\r\n\r\n", 4);
+        if (memcmp(s->rbuffer, "HTTP/1.1 101", 12) != 0)
+            return -1;
+        pos = end + 4 - s->rbuffer;
+    }
+
+    while (s->rlength - pos >= 2)
+    {
+        unsigned char *p = s->rbuffer + pos;
+        int opcode = p[0] & 0x0F;
+        unsigned long long length = p[1] & 0x7F;
+        int header = 2;
+        if (length == 126)
+        {
+            if (s->rlength - pos < 4)
+                break;
+            length = (p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (length == 127)
+        {
+            return -1; // 基准只发送小消息
+        }
+        if (s->rlength - pos < header + (int)length)
+            break;
+
+        if (opcode == 0xA && s->status == SUB_HANDSHAKE)
+        {
+            s->status = SUB_READY;
+            ready++;
+        }
+        else if (opcode == 0x1)
+        {
+            unsigned long long now = now_us();
+            int seq = atoi((char *)p + header);
+            if (published[seq])
+            {
+                hist_record(&latency, now - published[seq]);
+                if (++delivered[seq] == ready)
+                    hist_record(&fanout, now - published[seq]);
+            }
+        }
+        else if (opcode == 0x8)
+        {
+            return -1;
+        }
+        pos += header + length;
+    }
+
+    memmove(s->rbuffer, s->rbuffer + pos, s->rlength - pos);
+    s->rlength -= pos;
+    return 0;
+}
+
+static void sub_event(int epfd, struct sub *s, unsigned int events)
+{
+    if (s->status == SUB_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || send_subscribe(s->fd) < 0)
+        {
+            sub_close(s);
+            return;
+        }
+        s->status = SUB_HANDSHAKE;
+        struct epoll_event ev = {EPOLLIN, {.ptr = s}};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        return;
+    }
+
+    int count = recv(s->fd, s->rbuffer + s->rlength, SUB_BUFFER - s->rlength, 0);
+    if (count <= 0)
+    {
+        if (count < 0 && errno == EAGAIN)
+            return;
+        sub_close(s);
+        return;
+    }
+    s->rlength += count;
+    if (sub_parse(s) < 0)
+        sub_close(s);
+}
+
+static int poll_events(int epfd, int timeout_ms)
+{
+    struct epoll_event events[EVENT_SIZE];
+    int nready = epoll_wait(epfd, events, EVENT_SIZE, timeout_ms);
+    int i;
+    for (i = 0; i < nready; ++i)
+        sub_event(epfd, events[i].data.ptr, events[i].events);
+    return nready;
+}
+
+static int connect_to(struct sockaddr_in *addr, const char *source, int nonblock)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0)
+        return -1;
+    if (source)
+    {
+        struct sockaddr_in local;
+        int on = 1;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = inet_addr(source);
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+        bind(fd, (struct sockaddr *)&local, sizeof(local));
+    }
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s ip port [-c subscribers] [-n publishes] [-i interval_ms] [-s size] [-a source_ip,...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int nsubs = 10000, npub = 50, interval_ms = 200, size = 32;
+    char *sources[MAX_SOURCES];
+    int nsources = 0;
+    struct sockaddr_in addr;
+    struct rlimit rl;
+    int epfd, opt;
+
+    if (argc < 3)
+        usage(argv[0]);
+    optind = 3;
+    while ((opt = getopt(argc, argv, "c:n:i:s:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nsubs = atoi(optarg); break;
+        case 'n': npub = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'a':
+            for (char *p = strtok(optarg, ","); p && nsources < MAX_SOURCES; p = strtok(NULL, ","))
+                sources[nsources++] = p;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (size < 32)
+        size = 32;
+    if (size > SUB_BUFFER / 2)
+        size = SUB_BUFFER / 2;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(argv[1]);
+    addr.sin_port = htons(atoi(argv[2]));
+
+    subs = calloc(nsubs, sizeof(struct sub));
+    delivered = calloc(npub, sizeof(int));
+    published = calloc(npub, sizeof(unsigned long long));
+    epfd = epoll_create1(0);
+
+    // 建立订阅连接，同时进行中的connect不超过MAX_CONNECTING
+    unsigned long long start = now_us();
+    int opened = 0;
+    while (ready + closed < nsubs)
+    {
+        while (opened < nsubs && opened - ready - closed < MAX_CONNECTING)
+        {
+            struct sub *s = &subs[opened];
+            s->fd = connect_to(&addr, nsources ? sources[opened % nsources] : NULL, 1);
+            opened++;
+            if (s->fd < 0)
+            {
+                printf("connect %d failed: %s\n", opened, strerror(errno));
+                s->status = SUB_CLOSED;
+                closed++;
+                continue;
+            }
+            struct epoll_event ev = {EPOLLOUT, {.ptr = s}};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+        }
+        if (poll_events(epfd, 1000) == 0 && now_us() - start > 60000000ULL)
+            break;
+    }
+    printf("subscribers ready: %d, failed: %d, setup %.2fs\n", ready, closed, (now_us() - start) / 1e6);
+    if (ready == 0)
+        return 1;
+
+    // 发布者连接：同步握手
+    static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    int pub = connect_to(&addr, nsources ? sources[0] : NULL, 0);
+    unsigned char buffer[SUB_BUFFER + 64];
+    if (pub < 0 || send_all(pub, (const unsigned char *)request, sizeof(request) - 1) < 0)
+    {
+        printf("publisher connect failed\n");
+        return 1;
+    }
+    int hlength = 0;
+    while (!memmem(buffer, hlength, "\r\n\r\n", 4))
+    {
+        int count = recv(pub, buffer + hlength, sizeof(buffer) - hlength, 0);
+        if (count <= 0)
+        {
+            printf("publisher handshake failed\n");
+            return 1;
+        }
+        hlength += count;
+    }
+
+    // 按固定间隔发布，间隔内处理订阅者收到的消息
+    char payload[SUB_BUFFER];
+    unsigned long long next = now_us();
+    int seq;
+    start = next;
+    for (seq = 0; seq < npub; ++seq)
+    {
+        while (now_us() < next)
+            poll_events(epfd, 1);
+        int header = sprintf(payload, "PUB " TOPIC " %d ", seq);
+        memset(payload + header, 'x', size);
+        published[seq] = now_us();
+        send_all(pub, buffer, encode_frame(buffer, 0x1, payload, header + size));
+        next += interval_ms * 1000ULL;
+    }
+    // 等最后一条消息送达，最多再等5秒
+    unsigned long long deadline = now_us() + 5000000ULL;
+    while (delivered[npub - 1] < ready && now_us() < deadline)
+        poll_events(epfd, 10);
+    double elapsed = (now_us() - start) / 1e6;
+
+    unsigned long long total = 0;
+    for (seq = 0; seq < npub; ++seq)
+        total += delivered[seq];
+    printf("subscribers: %d, publishes: %d, deliveries: %llu of %llu, %.0f deliveries/s\n",
+           ready, npub, total, (unsigned long long)ready * npub, total / elapsed);
+    printf("publish->delivery us: p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+           hist_percentile(&latency, 50), hist_percentile(&latency, 90), hist_percentile(&latency, 99),
+           hist_percentile(&latency, 99.9), latency.max);
+    printf("fan-out complete us: p50 %llu, p99 %llu, max %llu (%llu of %d publishes reached every subscriber)\n",
+           hist_percentile(&fanout, 50), hist_percentile(&fanout, 99), fanout.max, fanout.count, npub);
+    printf("{\"subscribers\": %d, \"publishes\": %d, \"deliveries\": %llu, \"latency_us\": {\"p50\": %llu, \"p90\": %llu, "
+           "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}, \"fanout_us\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu}}\n",
+           ready, npub, total, hist_percentile(&latency, 50), hist_percentile(&latency, 90), hist_percentile(&latency, 99),
+           hist_percentile(&latency, 99.9), latency.max, hist_percentile(&fanout, 50), hist_percentile(&fanout, 99), fanout.max);
+    return 0;
+}
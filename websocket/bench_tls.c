@@ -0,0 +1,146 @@
+// wss握手基准：比较完整握手和会话复用握手的速度，每次都完成websocket升级
+//
+// openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 -subj /CN=localhost -keyout key.pem -out cert.pem
+// ./server -C cert.pem -K key.pem 2000        (-N关闭票据，只用服务端会话缓存)
+//
+// gcc -O2 -o bench_tls bench_tls.c -lssl -lcrypto
+// ./bench_tls [host] [port] [seconds_per_case]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+static SSL_SESSION *latest = NULL;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// TLS 1.3的票据在握手之后才到，而且服务端可能要求每张票据只用一次，总是保留最新的一张
+static int new_session(SSL *ssl, SSL_SESSION *session)
+{
+    (void)ssl;
+    if (latest)
+        SSL_SESSION_free(latest);
+    latest = session;
+    return 1;
+}
+
+static int tcp_connect(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+// 一次TLS握手加websocket升级，返回是否复用了会话
+static int handshake(SSL_CTX *ctx, const char *host, int port, int resume)
+{
+    static const char request[] = "GET / HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n\r\n";
+    char response[512];
+    int fd = tcp_connect(host, port);
+    SSL *ssl = SSL_new(ctx);
+    int length = 0, reused;
+
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, "localhost");
+    if (resume && latest)
+        SSL_set_session(ssl, latest);
+    if (SSL_connect(ssl) != 1 || SSL_write(ssl, request, sizeof(request) - 1) <= 0)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    while (length < 4 || memcmp(response + length - 4, "\r\n\r\n", 4) != 0)
+    {
+        int n = SSL_read(ssl, response + length, sizeof(response) - 1 - length);
+        if (n <= 0)
+        {
+            fprintf(stderr, "upgrade failed\n");
+            exit(1);
+        }
+        length += n;
+    }
+    if (memcmp(response, "HTTP/1.1 101", 12) != 0)
+    {
+        fprintf(stderr, "unexpected response: %.*s\n", length, response);
+        exit(1);
+    }
+
+    reused = SSL_session_reused(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return reused;
+}
+
+static void bench(const char *name, int version, int resume, const char *host, int port, double seconds)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    long long count = 0, reused = 0;
+    double start, elapsed;
+
+    SSL_CTX_set_min_proto_version(ctx, version);
+    SSL_CTX_set_max_proto_version(ctx, version);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+    handshake(ctx, host, port, 0); // 拿到第一张票据或会话ID
+
+    start = now_sec();
+    do
+    {
+        reused += handshake(ctx, host, port, resume);
+        count++;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+
+    printf("%-20s %10.0f handshakes/s %8.1f us/handshake  resumed %lld/%lld\n",
+           name, count / elapsed, elapsed * 1e6 / count, reused, count);
+    if (latest)
+    {
+        SSL_SESSION_free(latest);
+        latest = NULL;
+    }
+    SSL_CTX_free(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 2000;
+    double seconds = argc > 3 ? atof(argv[3]) : 3.0;
+
+    bench("TLS 1.2 full", TLS1_2_VERSION, 0, host, port, seconds);
+    bench("TLS 1.2 resumed", TLS1_2_VERSION, 1, host, port, seconds);
+    bench("TLS 1.3 full", TLS1_3_VERSION, 0, host, port, seconds);
+    bench("TLS 1.3 resumed", TLS1_3_VERSION, 1, host, port, seconds);
+    return 0;
+}
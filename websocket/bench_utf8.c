@@ -0,0 +1,197 @@
+// UTF-8校验微基准：和memcpy比较各个实现在不同文本上的吞吐量（GB/s）
+//
+// gcc -O2 -o bench_utf8 bench_utf8.c utf8.c
+// ./bench_utf8 [seconds_per_case]
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct kernel
+{
+    const char *name;
+    int (*fn)(const char *data, int len);
+};
+
+static char *copy_target;
+
+static int copy(const char *data, int len)
+{
+    memcpy(copy_target, data, len);
+    return 0;
+}
+
+// 整段一次传给utf8_validate
+static int validate(const char *data, int len)
+{
+    struct ws_utf8 u = {0};
+    return utf8_validate(&u, data, len) < 0 || u.need ? -1 : 0;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 用码点生成文本，每个字符从chars中随机选
+static int fill(char *buffer, int size, const char *const *chars, int nchars)
+{
+    int length = 0;
+    while (1)
+    {
+        const char *ch = chars[rand() % nchars];
+        int n = strlen(ch);
+        if (length + n > size)
+            break;
+        memcpy(buffer + length, ch, n);
+        length += n;
+    }
+    while (length < size) // 用ASCII补齐，保证长度准确
+        buffer[length++] = 'a';
+    return length;
+}
+
+// 非法序列放在各个位置，并在所有位置把合法文本切成两段增量校验，结果都必须和标量实现一致
+static int verify(struct kernel *kernels, int nkernel)
+{
+    static const char *const bad[] = {
+        "\x80", "\xBF", "\xC0\x80", "\xC1\xBF", "\xC2", "\xC2\x41", "\xE0\x80\x80", "\xE0\x9F\xBF",
+        "\xED\xA0\x80", "\xED\xBF\xBF", "\xEF\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF",
+        "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF8\x88\x80\x80\x80", "\xFF", "\xC2\x80\x80",
+        "\xE1\x80\xC0", "\xF1\x80\x80",
+    };
+    static const char *const good[] = {
+        "a", "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+        "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF", "\xE4\xBD\xA0", "\xF0\x9F\x98\x80",
+    };
+    char text[200];
+    int i, j, k, pos;
+
+    for (i = 0; i < 200; ++i)
+    {
+        int length = fill(text, 100 + i % 64, (const char *const *)good, sizeof(good) / sizeof(good[0]));
+        for (k = 0; k < nkernel; ++k)
+            if (kernels[k].fn(text, length) != 0)
+            {
+                printf("%s: rejected valid text\n", kernels[k].name);
+                return -1;
+            }
+        for (pos = 0; pos <= length; ++pos)
+        {
+            struct ws_utf8 u = {0};
+            if (utf8_validate(&u, text, pos) < 0 || utf8_validate(&u, text + pos, length - pos) < 0 || u.need)
+            {
+                printf("utf8_validate: rejected valid text split at %d\n", pos);
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); ++i)
+        for (pos = 0; pos < 100; ++pos)
+        {
+            int n = strlen(bad[i]);
+            memset(text, 'a', sizeof(text));
+            memcpy(text + pos, bad[i], n);
+            for (k = 0; k < nkernel; ++k)
+                if (kernels[k].fn(text, 130) == 0)
+                {
+                    printf("%s: accepted invalid sequence %d at %d\n", kernels[k].name, i, pos);
+                    return -1;
+                }
+            for (j = 0; j <= 130; ++j)
+            {
+                struct ws_utf8 u = {0};
+                if (utf8_validate(&u, text, j) == 0 && utf8_validate(&u, text + j, 130 - j) == 0 && u.need == 0)
+                {
+                    printf("utf8_validate: accepted invalid sequence %d at %d split at %d\n", i, pos, j);
+                    return -1;
+                }
+            }
+        }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    static const char *const ascii[] = {"a", "b", " ", "{", "\"", "0"};
+    static const char *const latin[] = {"a", "e", " ", "\xC3\xA9", "\xC3\xBC", "\xC3\x9F"};
+    static const char *const cjk[] = {"\xE4\xBD\xA0", "\xE5\xA5\xBD", "\xE4\xB8\x96", "\xE7\x95\x8C", " "};
+    static const char *const emoji[] = {"\xF0\x9F\x98\x80", "\xF0\x9F\x91\x8D", "a", "\xE2\x9C\x93"};
+    struct
+    {
+        const char *name;
+        const char *const *chars;
+        int nchars;
+    } corpora[] = {
+        {"ascii", ascii, 6},
+        {"latin", latin, 6},
+        {"cjk", cjk, 5},
+        {"emoji", emoji, 4},
+    };
+    int sizes[] = {64, 1024, 16384, 1048576};
+    struct kernel kernels[8];
+    int nkernel = 0;
+    char *buffer;
+    int i, j, k;
+
+    kernels[nkernel++] = (struct kernel){"memcpy", copy};
+    kernels[nkernel++] = (struct kernel){"scalar", utf8_check_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        kernels[nkernel++] = (struct kernel){"ssse3", utf8_check_ssse3};
+    if (__builtin_cpu_supports("avx2"))
+        kernels[nkernel++] = (struct kernel){"avx2", utf8_check_avx2};
+#endif
+    kernels[nkernel++] = (struct kernel){"validate", validate};
+
+    if (verify(kernels + 1, nkernel - 1) < 0)
+        return 1;
+
+    buffer = malloc(sizes[3] + 1);
+    copy_target = malloc(sizes[3]);
+
+    printf("%8s %10s", "text", "size");
+    for (i = 0; i < nkernel; ++i)
+        printf("%10s", kernels[i].name);
+    printf("   (GB/s)\n");
+
+    for (k = 0; k < (int)(sizeof(corpora) / sizeof(corpora[0])); ++k)
+    {
+        for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); ++j)
+        {
+            // 从奇数地址开始，模拟帧头之后不对齐的负载
+            int length = fill(buffer + 1, sizes[j], corpora[k].chars, corpora[k].nchars);
+            printf("%8s %10d", corpora[k].name, sizes[j]);
+            for (i = 0; i < nkernel; ++i)
+            {
+                long long rounds = 0;
+                double start = now_sec(), elapsed;
+                do
+                {
+                    int n;
+                    for (n = 0; n < 64; ++n)
+                        if (kernels[i].fn(buffer + 1, length) != 0)
+                        {
+                            printf("\n%s: rejected %s text\n", kernels[i].name, corpora[k].name);
+                            return 1;
+                        }
+                    rounds += 64;
+                    elapsed = now_sec() - start;
+                } while (elapsed < seconds);
+                printf("%10.2f", (double)rounds * length / elapsed / 1e9);
+            }
+            printf("\n");
+        }
+    }
+    free(buffer);
+    free(copy_target);
+    return 0;
+}
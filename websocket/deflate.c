@@ -0,0 +1,435 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+
+#define WS_DEFLATE_POOL 8 // 每个线程每种窗口大小最多缓存的空闲流
+
+// 默认两边都不做上下文接管，压缩流只在处理一条消息时使用，用完放回线程的池里
+struct ws_deflate_config ws_deflate_config = {
+    .enabled = 1,
+    .server_no_context_takeover = 1,
+    .client_no_context_takeover = 1,
+    .server_max_window_bits = 15,
+    .client_max_window_bits = 15,
+    .level = Z_DEFAULT_COMPRESSION,
+    .mem_level = 8,
+};
+
+// 每个reactor线程一份：空闲的压缩/解压流，以及压缩和解压的输出缓冲区
+struct ws_deflate_pool
+{
+    z_stream *deflaters[16][WS_DEFLATE_POOL]; // 按窗口位数分开
+    int ndeflaters[16];
+    z_stream *inflaters[WS_DEFLATE_POOL]; // 都用15位窗口，可以解压任何窗口大小的数据
+    int ninflaters;
+
+    char *dbuffer; // 压缩输出
+    int dcapacity;
+    char *ibuffer; // 解压输出
+    int icapacity;
+};
+
+static __thread struct ws_deflate_pool pool;
+
+static const unsigned char deflate_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+static z_stream *deflater_get(int bits)
+{
+    z_stream *strm;
+    if (pool.ndeflaters[bits] > 0)
+        return pool.deflaters[bits][--pool.ndeflaters[bits]];
+
+    strm = calloc(1, sizeof(z_stream));
+    if (strm == NULL)
+        return NULL;
+    if (deflateInit2(strm, ws_deflate_config.level, Z_DEFLATED, -bits, ws_deflate_config.mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(strm);
+        return NULL;
+    }
+    return strm;
+}
+
+static void deflater_put(z_stream *strm, int bits)
+{
+    if (pool.ndeflaters[bits] < WS_DEFLATE_POOL)
+    {
+        deflateReset(strm);
+        pool.deflaters[bits][pool.ndeflaters[bits]++] = strm;
+        return;
+    }
+    deflateEnd(strm);
+    free(strm);
+}
+
+static z_stream *inflater_new(int bits)
+{
+    z_stream *strm = calloc(1, sizeof(z_stream));
+    if (strm == NULL)
+        return NULL;
+    if (inflateInit2(strm, -bits) != Z_OK)
+    {
+        free(strm);
+        return NULL;
+    }
+    return strm;
+}
+
+static z_stream *inflater_get(void)
+{
+    if (pool.ninflaters > 0)
+        return pool.inflaters[--pool.ninflaters];
+    return inflater_new(15);
+}
+
+static void inflater_put(z_stream *strm)
+{
+    if (pool.ninflaters < WS_DEFLATE_POOL)
+    {
+        inflateReset(strm);
+        pool.inflaters[pool.ninflaters++] = strm;
+        return;
+    }
+    inflateEnd(strm);
+    free(strm);
+}
+
+static int scratch_reserve(char **buffer, int *capacity, int length)
+{
+    int size;
+    char *p;
+    if (length <= *capacity)
+        return 0;
+    size = *capacity ? *capacity : BUFFER_LENGTH;
+    while (size < length)
+        size *= 2;
+    p = realloc(*buffer, size);
+    if (p == NULL)
+        return -1;
+    *buffer = p;
+    *capacity = size;
+    return 0;
+}
+
+// 解析扩展参数的值，允许带引号；不是8到15之间的整数返回-1
+static int window_bits(const char *value, int length)
+{
+    int bits = 0, i;
+    if (length >= 2 && value[0] == '"' && value[length - 1] == '"')
+    {
+        value++;
+        length -= 2;
+    }
+    if (length < 1 || length > 2)
+        return -1;
+    for (i = 0; i < length; ++i)
+    {
+        if (value[i] < '0' || value[i] > '9')
+            return -1;
+        bits = bits * 10 + value[i] - '0';
+    }
+    return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+// 检查一个permessage-deflate offer，能接受时填好d并返回0
+static int deflate_offer(struct ws_deflate *d, const char *offer, int length)
+{
+    const struct ws_deflate_config *config = &ws_deflate_config;
+    int seen = 0; // 每个参数只能出现一次
+    int client_max_window_bits = 0;
+    int pos = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->server_bits = config->server_max_window_bits;
+    d->client_bits = 15; // 客户端没有声明client_max_window_bits时只能用15
+    d->server_no_context_takeover = config->server_no_context_takeover;
+    d->client_no_context_takeover = config->client_no_context_takeover;
+
+    while (pos < length)
+    {
+        const char *param;
+        int plen, nlen, vlen = 0;
+        const char *value = NULL;
+        const char *end = memchr(offer + pos, ';', length - pos);
+        int next = end ? end - offer : length;
+
+        // 去掉空白
+        while (pos < next && (offer[pos] == ' ' || offer[pos] == '\t'))
+            pos++;
+        plen = next - pos;
+        while (plen > 0 && (offer[pos + plen - 1] == ' ' || offer[pos + plen - 1] == '\t'))
+            plen--;
+        param = offer + pos;
+        pos = next + 1;
+        if (plen <= 0) // 空参数
+            return -1;
+
+        const char *eq = memchr(param, '=', plen);
+        nlen = eq ? eq - param : plen;
+        while (nlen > 0 && param[nlen - 1] == ' ')
+            nlen--;
+        if (eq)
+        {
+            value = eq + 1;
+            vlen = param + plen - value;
+            while (vlen > 0 && *value == ' ')
+            {
+                value++;
+                vlen--;
+            }
+        }
+
+#define PARAM_IS(literal) (nlen == sizeof(literal) - 1 && strncasecmp(param, literal, nlen) == 0)
+        if (PARAM_IS("server_no_context_takeover") && !(seen & 1) && !value)
+        {
+            seen |= 1;
+            d->server_no_context_takeover = 1;
+        }
+        else if (PARAM_IS("client_no_context_takeover") && !(seen & 2) && !value)
+        {
+            seen |= 2;
+            d->client_no_context_takeover = 1;
+        }
+        else if (PARAM_IS("server_max_window_bits") && !(seen & 4) && value)
+        {
+            int bits = window_bits(value, vlen);
+            seen |= 4;
+            if (bits < 0)
+                return -1;
+            if (bits < d->server_bits)
+                d->server_bits = bits;
+        }
+        else if (PARAM_IS("client_max_window_bits") && !(seen & 8))
+        {
+            int bits = value ? window_bits(value, vlen) : 15;
+            seen |= 8;
+            if (bits < 0)
+                return -1;
+            client_max_window_bits = 1;
+            d->client_bits = bits < config->client_max_window_bits ? bits : config->client_max_window_bits;
+        }
+        else
+        {
+            return -1;
+        }
+#undef PARAM_IS
+    }
+
+    // zlib的raw deflate不支持8位窗口
+    if (d->server_bits < 9)
+        return -1;
+    if (!client_max_window_bits)
+        d->client_bits = 15;
+    if (d->client_bits < 9) // 解压时同样不能用8位窗口，9位窗口兼容8位的数据
+        d->client_bits = 9;
+    return 0;
+}
+
+// 根据Sec-WebSocket-Extensions选择第一个能接受的permessage-deflate offer
+// 协商成功时把响应头的值写入response并返回长度，否则返回0
+int ws_deflate_negotiate(struct conn *c, const char *offers, int length, char *response, int size)
+{
+    struct ws_deflate d;
+    int pos = 0;
+
+    if (!ws_deflate_config.enabled)
+        return 0;
+
+    while (pos < length)
+    {
+        const char *end = memchr(offers + pos, ',', length - pos);
+        int next = end ? end - offers : length;
+        const char *offer = offers + pos;
+        int olen = next - pos;
+        pos = next + 1;
+
+        while (olen > 0 && (*offer == ' ' || *offer == '\t'))
+        {
+            offer++;
+            olen--;
+        }
+        int nlen = 0;
+        while (nlen < olen && offer[nlen] != ';' && offer[nlen] != ' ' && offer[nlen] != '\t')
+            nlen++;
+        if (nlen != sizeof("permessage-deflate") - 1 || strncasecmp(offer, "permessage-deflate", nlen) != 0)
+            continue;
+        while (nlen < olen && offer[nlen] != ';')
+            nlen++;
+        if (nlen < olen)
+            nlen++; // 跳过';'
+
+        if (deflate_offer(&d, offer + nlen, olen - nlen) < 0)
+            continue;
+
+        c->deflate = malloc(sizeof(struct ws_deflate));
+        if (c->deflate == NULL)
+            return 0;
+        *c->deflate = d;
+
+        int n = snprintf(response, size, "permessage-deflate%s%s",
+                         d.server_no_context_takeover ? "; server_no_context_takeover" : "",
+                         d.client_no_context_takeover ? "; client_no_context_takeover" : "");
+        if (d.server_bits < 15)
+            n += snprintf(response + n, size - n, "; server_max_window_bits=%d", d.server_bits);
+        if (d.client_bits < 15)
+            n += snprintf(response + n, size - n, "; client_max_window_bits=%d", d.client_bits);
+        return n;
+    }
+    return 0;
+}
+
+// 用给定的流压缩一条消息，结果在线程的压缩缓冲区中，去掉了结尾的00 00 ff ff
+static int deflate_run(z_stream *strm, const char *data, int length, char **out)
+{
+    int bound = deflateBound(strm, length) + 16;
+    if (scratch_reserve(&pool.dbuffer, &pool.dcapacity, bound) < 0)
+        return -1;
+
+    strm->next_in = (Bytef *)data;
+    strm->avail_in = length;
+    strm->next_out = (Bytef *)pool.dbuffer;
+    strm->avail_out = pool.dcapacity;
+    while (1)
+    {
+        if (deflate(strm, Z_SYNC_FLUSH) != Z_OK)
+            return -1;
+        if (strm->avail_out > 0)
+            break;
+        // 输出缓冲区满了，扩容后继续
+        int used = pool.dcapacity;
+        if (scratch_reserve(&pool.dbuffer, &pool.dcapacity, used * 2) < 0)
+            return -1;
+        strm->next_out = (Bytef *)pool.dbuffer + used;
+        strm->avail_out = pool.dcapacity - used;
+    }
+
+    int size = pool.dcapacity - strm->avail_out;
+    if (size >= 4 && memcmp(pool.dbuffer + size - 4, deflate_tail, 4) == 0)
+        size -= 4;
+    *out = pool.dbuffer;
+    return size;
+}
+
+// 压缩一条要发给连接的消息，返回压缩后的长度，失败返回-1
+int ws_deflate_message(struct ws_deflate *d, const char *data, int length, char **out)
+{
+    int size;
+    if (d->server_no_context_takeover)
+    {
+        z_stream *strm = deflater_get(d->server_bits);
+        if (strm == NULL)
+            return -1;
+        size = deflate_run(strm, data, length, out);
+        deflater_put(strm, d->server_bits);
+        return size;
+    }
+
+    // 上下文接管：连接独占一个压缩流，滑动窗口跨消息保留
+    if (d->deflater == NULL && (d->deflater = deflater_get(d->server_bits)) == NULL)
+        return -1;
+    return deflate_run(d->deflater, data, length, out);
+}
+
+// 压缩成一个可以共享的帧，给没有上下文接管、窗口位数相同的所有订阅者使用
+struct ws_buffer *ws_deflate_frame(int bits, int opcode, const char *data, int length)
+{
+    z_stream *strm = deflater_get(bits);
+    char *out;
+    int size;
+
+    if (strm == NULL)
+        return NULL;
+    size = deflate_run(strm, data, length, &out);
+    deflater_put(strm, bits);
+    if (size < 0)
+        return NULL;
+    return ws_buffer_frame(opcode | WS_RSV1, out, size);
+}
+
+// 解压收到的消息，结果在线程的解压缓冲区中；数据损坏返回-1，超过WS_MAX_MESSAGE返回-2
+int ws_inflate_message(struct ws_deflate *d, const char *data, int length, char **out)
+{
+    z_stream *strm;
+    int size = 0, ret = 0, pass;
+
+    if (d->client_no_context_takeover)
+        strm = inflater_get();
+    else if (d->inflater == NULL)
+        strm = d->inflater = inflater_new(d->client_bits);
+    else
+        strm = d->inflater;
+    if (strm == NULL)
+        return -1;
+
+    // 先解压负载，再补上发送方去掉的00 00 ff ff
+    for (pass = 0; pass < 2 && ret == 0; ++pass)
+    {
+        strm->next_in = pass == 0 ? (Bytef *)data : (Bytef *)deflate_tail;
+        strm->avail_in = pass == 0 ? length : 4;
+        while (1)
+        {
+            if (size == pool.icapacity)
+            {
+                if (size >= WS_MAX_MESSAGE)
+                {
+                    ret = -2;
+                    break;
+                }
+                if (scratch_reserve(&pool.ibuffer, &pool.icapacity, size + 1) < 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+            strm->next_out = (Bytef *)pool.ibuffer + size;
+            strm->avail_out = pool.icapacity - size;
+            int z = inflate(strm, Z_SYNC_FLUSH);
+            size = pool.icapacity - strm->avail_out;
+            if (z != Z_OK && z != Z_BUF_ERROR)
+            {
+                ret = -1;
+                break;
+            }
+            if (strm->avail_in == 0 && strm->avail_out > 0)
+                break;
+            if (z == Z_BUF_ERROR && strm->avail_out > 0) // 没有进展
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (size > WS_MAX_MESSAGE)
+        ret = -2;
+
+    if (d->client_no_context_takeover)
+        inflater_put(strm);
+    if (ret < 0)
+        return ret;
+    *out = pool.ibuffer;
+    return size;
+}
+
+void ws_deflate_release(struct conn *c)
+{
+    struct ws_deflate *d = c->deflate;
+    if (d == NULL)
+        return;
+    if (d->deflater)
+    {
+        deflateEnd(d->deflater);
+        free(d->deflater);
+    }
+    if (d->inflater)
+    {
+        inflateEnd(d->inflater);
+        free(d->inflater);
+    }
+    free(d);
+    c->deflate = NULL;
+}
@@ -0,0 +1,222 @@
+#include "server.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// 一条路由：path以'*'结尾时按前缀匹配
+struct ws_route
+{
+    const char *method; // NULL匹配任何方法
+    const char *path;
+    int length;
+    int prefix;
+    WS_HTTP_HANDLER handler;
+};
+
+// 启动reactor之前注册，之后只读，所有reactor线程共用
+static struct ws_route routes[WS_MAX_ROUTES];
+static int nroutes = 0;
+
+// 注册一条路由，按注册顺序匹配；HEAD请求匹配GET的路由
+int ws_http_route(const char *method, const char *path, WS_HTTP_HANDLER handler)
+{
+    struct ws_route *route;
+    if (nroutes == WS_MAX_ROUTES)
+        return -1;
+    route = &routes[nroutes++];
+    route->method = method;
+    route->path = path;
+    route->length = strlen(path);
+    route->prefix = route->length > 0 && path[route->length - 1] == '*';
+    if (route->prefix)
+        route->length--;
+    route->handler = handler;
+    return 0;
+}
+
+static const char *http_reason(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+// 状态行和头部直接写进发送缓冲区
+static int http_head(struct conn *c, struct ws_http_request *req, int status, const char *type, int length)
+{
+    const char *connection = !req->keep_alive ? "Connection: close\r\n" : req->minor == 0 ? "Connection: keep-alive\r\n" : "";
+    int size = 128 + strlen(type);
+    struct ws_buffer *b = ws_reserve(c, size);
+    int n;
+    if (b == NULL)
+        return -1;
+    n = snprintf(b->data + b->length, size, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n%s\r\n",
+                 status, http_reason(status), type, length, connection);
+    ws_commit(c, b, n < size ? n : size - 1);
+    req->responded = 1;
+    return 0;
+}
+
+// 响应一个请求，body拷贝进发送缓冲区
+int ws_http_respond(struct conn *c, struct ws_http_request *req, int status, const char *type, const char *body, int length)
+{
+    struct ws_buffer *b;
+    if (http_head(c, req, status, type, length) < 0)
+        return -1;
+    if (req->head || length == 0)
+        return 0;
+    b = ws_reserve(c, length);
+    if (b == NULL)
+        return -1;
+    memcpy(b->data + b->length, body, length);
+    ws_commit(c, b, length);
+    return 0;
+}
+
+// 响应一个请求，body是ws_http_load读入的只读缓冲区，直接引用，不拷贝
+int ws_http_respond_buffer(struct conn *c, struct ws_http_request *req, int status, const char *type, struct ws_buffer *body)
+{
+    if (http_head(c, req, status, type, body->length) < 0)
+        return -1;
+    if (req->head || body->length == 0)
+        return 0;
+    return ws_queue_push(c, body);
+}
+
+// 把一个文件读成只读的共享缓冲区，可以同时放进任意多个连接的发送队列
+struct ws_buffer *ws_http_load(const char *file)
+{
+    struct ws_buffer *b = NULL;
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size < (1 << 30) && (b = ws_buffer_new(st.st_size)) != NULL)
+    {
+        while (b->length < st.st_size)
+        {
+            int count = read(fd, b->data + b->length, st.st_size - b->length);
+            if (count <= 0)
+                break;
+            b->length += count;
+        }
+        b->shared = 1;
+    }
+    close(fd);
+    return b;
+}
+
+// 出错的请求：响应之后关闭连接
+static int http_error(struct conn *c, struct ws_http_request *req, int status)
+{
+    const char *reason = http_reason(status);
+    req->keep_alive = 0;
+    ws_http_respond(c, req, status, "text/plain", reason, strlen(reason));
+    return -1;
+}
+
+// 严格的十进制Content-Length，非法返回-1
+static long long http_content_length(const char *value, int length)
+{
+    long long n = 0;
+    int i;
+    if (length == 0 || length > 18)
+        return -1;
+    for (i = 0; i < length; ++i)
+    {
+        if (value[i] < '0' || value[i] > '9')
+            return -1;
+        n = n * 10 + value[i] - '0';
+    }
+    return n;
+}
+
+// 请求头已经完整的普通HTTP请求，请求体也到齐后按路由处理；不分配内存，请求和响应都在连接自己的缓冲区中
+// 返回消耗的字节数，请求体不完整返回0，响应之后要关闭连接时返回-1
+int ws_http_serve(struct conn *c, int header_length)
+{
+    const struct ws_handshake *hs = &c->hs;
+    const char *buf = c->rbuffer;
+    struct ws_http_request req;
+    long long body = 0;
+    int i, allowed = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.minor = hs->minor;
+    req.keep_alive = hs->minor == 1 ? !ws_has_token(buf, hs->connection, "close") : ws_has_token(buf, hs->connection, "keep-alive");
+    if (hs->transfer_encoding.length > 0) // 不支持分块的请求体，无法确定请求的边界
+        return http_error(c, &req, 501);
+    if (hs->content_length.length > 0)
+    {
+        body = http_content_length(buf + hs->content_length.offset, hs->content_length.length);
+        if (body < 0)
+            return http_error(c, &req, 400);
+        if (body > WS_MAX_BODY)
+            return http_error(c, &req, 413);
+    }
+    if (c->rlength < header_length + body)
+        return 0;
+
+    req.method = buf + hs->method.offset;
+    req.method_length = hs->method.length;
+    req.path = buf + hs->path.offset;
+    req.path_length = hs->path.length;
+    req.query = memchr(req.path, '?', req.path_length);
+    if (req.query)
+    {
+        req.query_length = req.path + req.path_length - req.query - 1;
+        req.path_length = req.query - req.path;
+        req.query++;
+    }
+    req.body = buf + header_length;
+    req.body_length = body;
+    req.head = req.method_length == 4 && memcmp(req.method, "HEAD", 4) == 0;
+    c->mactive = c->reactor->now;
+
+    for (i = 0; i < nroutes; ++i)
+    {
+        const struct ws_route *route = &routes[i];
+        if (route->prefix ? req.path_length < route->length : req.path_length != route->length)
+            continue;
+        if (memcmp(req.path, route->path, route->length) != 0)
+            continue;
+        if (route->method && !(req.method_length == (int)strlen(route->method) && memcmp(req.method, route->method, req.method_length) == 0) &&
+            !(req.head && strcmp(route->method, "GET") == 0))
+        {
+            allowed = 1; // 路径匹配，方法不对
+            continue;
+        }
+        route->handler(c, &req);
+        if (!req.responded)
+            return http_error(c, &req, 500);
+        break;
+    }
+    if (i == nroutes)
+    {
+        int status = allowed ? 405 : 404;
+        const char *reason = http_reason(status);
+        ws_http_respond(c, &req, status, "text/plain", reason, strlen(reason));
+    }
+    WS_DEBUG("fd %d http %.*s %.*s", c->fd, req.method_length, req.method, hs->path.length, buf + hs->path.offset);
+    return req.keep_alive ? header_length + (int)body : -1;
+}
@@ -0,0 +1,178 @@
+#include "server.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_SLOTS 4096 // 环形缓冲区的条数，2的幂
+#define LOG_LINE 240   // 一条日志的最大长度，超过的截断
+#define LOG_BATCH 256  // 后台线程一次最多取出的条数
+#define LOG_IDLE_MS 10 // 没有日志时后台线程的休眠时间
+
+// 一个槽：seq等于写入位置时空闲，等于写入位置+1时已写好可以读取
+struct log_slot
+{
+    unsigned long long seq;
+    struct timespec time;
+    short level;
+    short thread;
+    int length;
+    char text[LOG_LINE];
+};
+
+static struct log_slot ring[LOG_SLOTS];
+static unsigned long long head = 0; // 下一个写入位置，写者之间用CAS竞争
+static unsigned long long tail = 0; // 下一个读取位置，只由持有drain_lock的线程修改
+static unsigned long long dropped = 0;
+static int ring_ready = 0;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = STDOUT_FILENO;
+
+static int thread_count = 0;
+static __thread int thread_id = 0; // 日志中的线程编号，从1开始，第一次写日志时分配
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static void ring_init(void)
+{
+    int i;
+    for (i = 0; i < LOG_SLOTS; ++i)
+        ring[i].seq = i;
+}
+
+// 格式化到环形缓冲区中就返回，不做任何I/O；缓冲区满时丢弃并计数
+void ws_log(int level, const char *fmt, ...)
+{
+    unsigned long long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    va_list ap;
+    int n;
+
+    // log_init之前（启动阶段和基准程序中）直接写stdout
+    if (!__atomic_load_n(&ring_ready, __ATOMIC_ACQUIRE))
+    {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        putchar('\n');
+        return;
+    }
+    while (1)
+    {
+        slot = &ring[pos & (LOG_SLOTS - 1)];
+        long long diff = (long long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+
+    if (thread_id == 0)
+        thread_id = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    slot->thread = thread_id;
+    va_start(ap, fmt);
+    n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->length = n < (int)sizeof(slot->text) ? n : (int)sizeof(slot->text) - 1;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int log_format(char *out, int size, const struct log_slot *slot)
+{
+    struct tm tm;
+    int n;
+
+    localtime_r(&slot->time.tv_sec, &tm);
+    n = snprintf(out, size, "%04d-%02d-%02d %02d:%02d:%02d.%03ld %-5s [%d] %.*s\n",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 slot->time.tv_nsec / 1000000, level_names[slot->level], slot->thread,
+                 slot->length, slot->text);
+    return n < size ? n : size - 1;
+}
+
+static void log_output(const char *data, int length)
+{
+    while (length > 0)
+    {
+        int n = write(log_fd, data, length);
+        if (n <= 0)
+            return;
+        data += n;
+        length -= n;
+    }
+}
+
+// 取出已写好的日志格式化后一次写出，返回取出的条数
+static int log_drain(void)
+{
+    static char out[LOG_BATCH * (LOG_LINE + 48)];
+    unsigned long long lost;
+    int length = 0, count = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost)
+        length += snprintf(out, sizeof(out), "log ring full, %llu lines dropped\n", lost);
+    while (count < LOG_BATCH)
+    {
+        struct log_slot *slot = &ring[tail & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        length += log_format(out + length, sizeof(out) - length, slot);
+        __atomic_store_n(&slot->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+        tail++;
+        count++;
+    }
+    log_output(out, length);
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+static void *log_loop(void *arg)
+{
+    struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+    (void)arg;
+    while (1)
+    {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// 写出缓冲区中剩下的日志，进程退出前调用
+void log_flush(void)
+{
+    while (log_drain() > 0)
+        ;
+}
+
+// 启动后台写日志的线程，fd是输出的文件
+int log_init(int fd)
+{
+    pthread_t tid;
+
+    log_fd = fd;
+    ring_init();
+    __atomic_store_n(&ring_ready, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&tid, NULL, log_loop, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    atexit(log_flush);
+    return 0;
+}
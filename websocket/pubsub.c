@@ -0,0 +1,396 @@
+#include "server.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WS_MAX_TOPIC 255 // 主题名的最大长度
+
+// 订阅者数组中的一项，slot是这个主题在conn->subs中的位置，用于O(1)取消订阅
+struct ws_member
+{
+    struct conn *conn;
+    int slot;
+};
+
+// 一个主题和它在本线程上的订阅者，订阅者连续存放，发布时顺序遍历
+struct ws_topic
+{
+    struct ws_topic *next; // 哈希桶链表
+    uint32_t hash;
+    struct ws_member *members;
+    int count;
+    int capacity;
+    int length;
+    char name[];
+};
+
+// 发往其他reactor线程的消息，frame是共享的已编码帧
+struct ws_publish
+{
+    struct ws_publish *next;
+    struct ws_buffer *frame;
+    int length;
+    char topic[];
+};
+
+struct reactor *reactors = NULL;
+int reactor_count = 0;
+
+// FNV-1a
+static uint32_t topic_hash(const char *name, int length)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct ws_topic *topic_find(struct ws_topics *topics, const char *name, int length, uint32_t hash)
+{
+    struct ws_topic *topic;
+    if (topics->nbuckets == 0)
+        return NULL;
+    for (topic = topics->buckets[hash & (topics->nbuckets - 1)]; topic; topic = topic->next)
+        if (topic->hash == hash && topic->length == length && memcmp(topic->name, name, length) == 0)
+            return topic;
+    return NULL;
+}
+
+// 主题数超过桶数时桶数翻倍
+static int topic_rehash(struct ws_topics *topics)
+{
+    int nbuckets = topics->nbuckets ? topics->nbuckets * 2 : 16;
+    struct ws_topic **buckets = calloc(nbuckets, sizeof(struct ws_topic *));
+    int i;
+
+    if (buckets == NULL)
+        return -1;
+    for (i = 0; i < topics->nbuckets; ++i)
+    {
+        struct ws_topic *topic = topics->buckets[i];
+        while (topic)
+        {
+            struct ws_topic *next = topic->next;
+            topic->next = buckets[topic->hash & (nbuckets - 1)];
+            buckets[topic->hash & (nbuckets - 1)] = topic;
+            topic = next;
+        }
+    }
+    free(topics->buckets);
+    topics->buckets = buckets;
+    topics->nbuckets = nbuckets;
+    return 0;
+}
+
+static struct ws_topic *topic_create(struct ws_topics *topics, const char *name, int length, uint32_t hash)
+{
+    struct ws_topic *topic;
+
+    if (topics->count >= topics->nbuckets && topic_rehash(topics) < 0)
+        return NULL;
+    topic = calloc(1, sizeof(struct ws_topic) + length);
+    if (topic == NULL)
+        return NULL;
+    topic->hash = hash;
+    topic->length = length;
+    memcpy(topic->name, name, length);
+
+    topic->next = topics->buckets[hash & (topics->nbuckets - 1)];
+    topics->buckets[hash & (topics->nbuckets - 1)] = topic;
+    topics->count++;
+    return topic;
+}
+
+static void topic_remove(struct ws_topics *topics, struct ws_topic *topic)
+{
+    struct ws_topic **p = &topics->buckets[topic->hash & (topics->nbuckets - 1)];
+    while (*p != topic)
+        p = &(*p)->next;
+    *p = topic->next;
+    topics->count--;
+    free(topic->members);
+    free(topic);
+}
+
+int pubsub_subscribe(struct conn *c, const char *name, int length)
+{
+    struct ws_topics *topics = &c->reactor->topics;
+    uint32_t hash = topic_hash(name, length);
+    struct ws_topic *topic = topic_find(topics, name, length, hash);
+    int i;
+
+    if (topic)
+    {
+        for (i = 0; i < c->nsubs; ++i)
+            if (c->subs[i].topic == topic) // 已经订阅过
+                return 0;
+    }
+    else if ((topic = topic_create(topics, name, length, hash)) == NULL)
+    {
+        return -1;
+    }
+
+    if (topic->count == topic->capacity)
+    {
+        int capacity = topic->capacity ? topic->capacity * 2 : 4;
+        struct ws_member *members = realloc(topic->members, capacity * sizeof(struct ws_member));
+        if (members == NULL)
+            goto fail;
+        topic->members = members;
+        topic->capacity = capacity;
+    }
+    if (c->nsubs == c->subs_capacity)
+    {
+        int capacity = c->subs_capacity ? c->subs_capacity * 2 : 2;
+        struct ws_subscription *subs = realloc(c->subs, capacity * sizeof(struct ws_subscription));
+        if (subs == NULL)
+            goto fail;
+        c->subs = subs;
+        c->subs_capacity = capacity;
+    }
+
+    topic->members[topic->count].conn = c;
+    topic->members[topic->count].slot = c->nsubs;
+    c->subs[c->nsubs].topic = topic;
+    c->subs[c->nsubs].index = topic->count;
+    topic->count++;
+    c->nsubs++;
+    if (c->session)
+        ws_session_topic(c, name, length, 1);
+    return 0;
+
+fail:
+    if (topic->count == 0)
+        topic_remove(topics, topic);
+    return -1;
+}
+
+// 删除c->subs[slot]，两边都用最后一项填补空位并修正对方记录的位置
+static void subscription_remove(struct conn *c, int slot)
+{
+    struct ws_topic *topic = c->subs[slot].topic;
+    int index = c->subs[slot].index;
+
+    topic->count--;
+    if (index != topic->count)
+    {
+        struct ws_member last = topic->members[topic->count];
+        topic->members[index] = last;
+        last.conn->subs[last.slot].index = index;
+    }
+
+    c->nsubs--;
+    if (slot != c->nsubs)
+    {
+        struct ws_subscription last = c->subs[c->nsubs];
+        c->subs[slot] = last;
+        last.topic->members[last.index].slot = slot;
+    }
+
+    if (topic->count == 0)
+        topic_remove(&c->reactor->topics, topic);
+}
+
+int pubsub_unsubscribe(struct conn *c, const char *name, int length)
+{
+    int i;
+    for (i = 0; i < c->nsubs; ++i)
+    {
+        struct ws_topic *topic = c->subs[i].topic;
+        if (topic->length == length && memcmp(topic->name, name, length) == 0)
+        {
+            subscription_remove(c, i);
+            if (c->session)
+                ws_session_topic(c, name, length, 0);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 连接关闭时取消所有订阅
+void pubsub_release(struct conn *c)
+{
+    while (c->nsubs > 0)
+        subscription_remove(c, c->nsubs - 1);
+    free(c->subs);
+    c->subs = NULL;
+    c->subs_capacity = 0;
+}
+
+// 把帧的引用放进本线程上每个订阅者的发送队列，返回订阅者数量
+// 协商了permessage-deflate的订阅者：没有上下文接管时，同样窗口大小的订阅者共享一个压缩帧；
+// 有上下文接管时压缩结果依赖各自的历史，只能逐个压缩
+static int deliver_local(struct reactor *r, const char *name, int length, struct ws_buffer *frame)
+{
+    struct ws_topic *topic = topic_find(&r->topics, name, length, topic_hash(name, length));
+    struct ws_buffer *compressed[16] = {0};
+    int i, count = 0, plength;
+    const char *payload = ws_frame_payload(frame, &plength);
+    int opcode = frame->data[0] & 0x0F;
+
+    if (topic == NULL)
+        return 0;
+    for (i = 0; i < topic->count; ++i)
+    {
+        struct conn *c = topic->members[i].conn;
+        struct ws_buffer *b = frame;
+        if (c->status != WS_STATUS_OPEN)
+            continue;
+        // 慢消费者：队列超过上限时按策略丢弃或断开
+        if (ws_queue_admit(c, frame->length) < 0)
+            continue;
+
+        if (c->deflate && plength >= WS_DEFLATE_MIN)
+        {
+            int bits = c->deflate->server_bits;
+            if (!c->deflate->server_no_context_takeover)
+            {
+                if (ws_encode(c, opcode, payload, plength) >= 0)
+                {
+                    count++;
+                    if (c->session)
+                        ws_session_record(c, frame);
+                }
+                ws_update_events(c);
+                continue;
+            }
+            if (compressed[bits] == NULL)
+                compressed[bits] = ws_deflate_frame(bits, opcode, payload, plength);
+            if (compressed[bits])
+                b = compressed[bits];
+        }
+        if (ws_queue_push(c, b) == 0)
+        {
+            count++;
+            WS_STAT_ADD(r, frames, 1);
+            if (c->session) // 会话保留未压缩的帧，重连后可能协商了不同的压缩参数
+                ws_session_record(c, frame);
+        }
+        ws_update_events(c);
+    }
+
+    for (i = 0; i < 16; ++i)
+        if (compressed[i])
+            ws_buffer_unref(compressed[i]);
+    return count;
+}
+
+// 发布到所有reactor：本线程直接放进订阅者队列，其他线程通过inbox和eventfd转交
+int pubsub_publish(struct reactor *r, const char *name, int length, struct ws_buffer *frame)
+{
+    int i, count = 0;
+    for (i = 0; i < reactor_count; ++i)
+    {
+        struct reactor *target = &reactors[i];
+        struct ws_publish *msg;
+        uint64_t one = 1;
+
+        if (target == r)
+        {
+            count += deliver_local(r, name, length, frame);
+            continue;
+        }
+
+        msg = malloc(sizeof(struct ws_publish) + length);
+        if (msg == NULL)
+            continue;
+        ws_buffer_ref(frame);
+        msg->frame = frame;
+        msg->length = length;
+        memcpy(msg->topic, name, length);
+
+        pthread_mutex_lock(&target->lock);
+        msg->next = target->inbox;
+        target->inbox = msg;
+        pthread_mutex_unlock(&target->lock);
+        write(target->efd, &one, sizeof(one));
+    }
+    return count;
+}
+
+// eventfd可读时调用，把其他线程发来的消息投递给本线程的订阅者
+int pubsub_deliver(struct reactor *r)
+{
+    struct ws_publish *list, *ordered = NULL;
+    uint64_t value;
+    int count = 0;
+
+    read(r->efd, &value, sizeof(value));
+
+    pthread_mutex_lock(&r->lock);
+    list = r->inbox;
+    r->inbox = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    while (list) // inbox是后进先出的，反转后按发布顺序投递
+    {
+        struct ws_publish *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered)
+    {
+        struct ws_publish *next = ordered->next;
+        count += deliver_local(r, ordered->topic, ordered->length, ordered->frame);
+        ws_buffer_unref(ordered->frame);
+        free(ordered);
+        ordered = next;
+    }
+    return count;
+}
+
+// 处理文本消息中的命令，是命令返回1，否则返回0由调用者按普通消息处理
+//   SUB <topic>              订阅
+//   UNSUB <topic>            取消订阅
+//   PUB <topic> <payload>    发布，payload编码成一个文本帧，共享给所有订阅者
+int pubsub_request(struct conn *c, const char *data, int length)
+{
+    int start, topic_length;
+    const char *topic;
+
+    if (length > 4 && memcmp(data, "SUB ", 4) == 0)
+        start = 4;
+    else if (length > 6 && memcmp(data, "UNSUB ", 6) == 0)
+        start = 6;
+    else if (length > 4 && memcmp(data, "PUB ", 4) == 0)
+        start = 4;
+    else
+        return 0;
+
+    topic = data + start;
+    topic_length = 0;
+    while (start + topic_length < length && topic[topic_length] != ' ')
+        ++topic_length;
+    if (topic_length == 0 || topic_length > WS_MAX_TOPIC)
+        return 0;
+
+    if (data[0] == 'S')
+    {
+        pubsub_subscribe(c, topic, topic_length);
+    }
+    else if (data[0] == 'U')
+    {
+        pubsub_unsubscribe(c, topic, topic_length);
+    }
+    else
+    {
+        int offset = start + topic_length + 1; // 跳过主题后的空格
+        if (offset > length)
+            offset = length;
+        struct ws_buffer *frame = ws_buffer_frame(WS_OPCODE_TEXT, data + offset, length - offset);
+        if (frame == NULL)
+            return 1;
+        pubsub_publish(c->reactor, topic, topic_length, frame);
+        ws_buffer_unref(frame);
+    }
+    return 1;
+}
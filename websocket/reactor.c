@@ -1,155 +1,637 @@
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
-#define CONNECTION_SIZE 1024
-
-int accept_cb(int fd);
-int recv_cb(int fd);
-int send_cb(int fd);
+#define EVENT_SIZE 1024
+#define IOV_SIZE 64 // 一次writev最多发送的缓冲区个数
 
-int epfd = 0;
+int accept_cb(struct conn *c);
+int recv_cb(struct conn *c);
+int send_cb(struct conn *c);
 
-struct conn conn_list[CONNECTION_SIZE] = {0};
+int set_event(struct conn *c, int event, int flag)
+{
+    struct epoll_event ev;
+    ev.events = event;
+    ev.data.ptr = c;
+    return epoll_ctl(c->reactor->epfd, flag ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-int set_event(int fd, int event, int flag)
+// 为新连接分配conn并加入reactor，失败时关闭fd
+struct conn *event_register(struct reactor *r, int fd, int event)
 {
-    if (flag)
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (c == NULL)
     {
-        struct epoll_event ev;
-        ev.events = event;
-        ev.data.fd = fd;
-        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        close(fd);
+        return NULL;
     }
-    else
+    c->fd = fd;
+    c->reactor = r;
+    c->r_action.recv_callback = recv_cb;
+    c->send_callback = send_cb;
+    c->flush_delay = ws_queue_config.flush_delay;
+
+    if (set_event(c, event, 1) < 0)
     {
-        struct epoll_event ev;
-        ev.events = event;
-        ev.data.fd = fd;
-        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        close(fd);
+        free(c);
+        return NULL;
     }
+    c->events = event;
+    WS_STAT_ADD(r, connections, 1);
+
+    // 第一次到期时检查握手有没有完成，之后由ws_timeout安排保活
+    c->created = c->active = c->mactive = r->now;
+    timer_add(&r->wheel, &c->timer, (r->now + ws_keepalive_config.handshake_timeout) / WS_TICK_MS);
+    return c;
 }
 
-int event_register(int fd, int event)
+int event_unregister(struct conn *c)
 {
-    if (fd < 0)
-        return -1;
-    conn_list[fd].fd = fd;
-    conn_list[fd].r_action.recv_callback = recv_cb;
-    conn_list[fd].send_callback = send_cb;
-
-    memset(conn_list[fd].rbuffer, 0, BUFFER_LENGTH);
-    conn_list[fd].rlength = 0;
-
-    memset(conn_list[fd].wbuffer, 0, BUFFER_LENGTH);
-    conn_list[fd].wlength = 0;
-
-    set_event(fd, event, 1);
+    epoll_ctl(c->reactor->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    timer_del(&c->timer);
+    if (c->flush_slot) // 由reactor_flush跳过
+        c->reactor->flush[c->flush_slot - 1] = NULL;
+    tls_release(c);
+    close(c->fd);
+    ws_release(c);
+    WS_STAT_ADD(c->reactor, connections, -1);
+    free(c);
+    return 0;
 }
 
-int accept_cb(int fd)
+// 监听socket是非阻塞的，一次把等待中的连接都取出来
+int accept_cb(struct conn *listener)
 {
-    struct sockaddr_in clientaddr;
-    socklen_t len = sizeof(clientaddr);
+    int count = 0;
+    while (1)
+    {
+        struct sockaddr_in clientaddr;
+        socklen_t len = sizeof(clientaddr);
 
-    int clientfd = accept(fd, (struct sockaddr *)&clientaddr, &len);
-    printf("accept finished: %d\n", clientfd);
+        int clientfd = accept4(listener->fd, (struct sockaddr *)&clientaddr, &len, SOCK_NONBLOCK);
+        if (clientfd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                WS_WARN("accept: %s", strerror(errno));
+            break;
+        }
+        WS_DEBUG("accept fd %d", clientfd);
+        // 发送队列每次都整批writev，不需要Nagle合并；TLS握手的几次小写入也不会等延迟确认
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
 
-    if (clientfd < 0)
-    {
-        printf("accept errno: %d --> %s\n", errno, strerror(errno));
-        return -1;
+        struct conn *c = event_register(listener->reactor, clientfd, EPOLLIN);
+        if (c == NULL)
+            WS_ERROR("register fd %d failed", clientfd);
+        else if (tls_enabled() && tls_accept(c) < 0) // TLS握手在第一次recv_cb中进行
+            event_unregister(c);
+        count++;
     }
-    event_register(clientfd, EPOLLIN);
-    return 0;
+    return count;
 }
 
-int recv_cb(int fd)
+// 连接被关闭释放时返回-1
+int recv_cb(struct conn *c)
 {
-    memset(conn_list[fd].rbuffer, 0, BUFFER_LENGTH);
-    int count = recv(fd, conn_list[fd].rbuffer, BUFFER_LENGTH, 0);
+    // 缓冲区满了再扩容，握手阶段最多扩到WS_MAX_HEADER，之后只会留下不完整的帧头
+    if (c->rlength == c->rcapacity)
+    {
+        int capacity = c->rcapacity ? c->rcapacity * 2 : BUFFER_LENGTH;
+        char *buffer = realloc(c->rbuffer, capacity);
+        if (buffer == NULL)
+        {
+            event_unregister(c);
+            return -1;
+        }
+        c->rbuffer = buffer;
+        c->rcapacity = capacity;
+    }
+
+    int count = c->ssl ? tls_read(c, c->rbuffer + c->rlength, c->rcapacity - c->rlength)
+                       : recv(c->fd, c->rbuffer + c->rlength, c->rcapacity - c->rlength, 0);
     if (count == 0)
     {
-        printf("client disconnect: %d\n", fd);
-        close(fd);
-        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-        return 0;
+        WS_DEBUG("fd %d disconnected", c->fd);
+        event_unregister(c);
+        return -1;
     }
     else if (count < 0)
     {
-        printf("count: %d, errno: %d, %s\n", count, errno, strerror(errno));
-        close(fd);
-        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-        return 0;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (c->tls_flags & WS_TLS_READ_WANTS_WRITE)
+                ws_update_events(c);
+            return 0;
+        }
+        WS_DEBUG("fd %d recv: %s", c->fd, strerror(errno));
+        event_unregister(c);
+        return -1;
     }
-    conn_list[fd].rlength = count;
+    c->active = c->reactor->now;
+    if (c->status == WS_STATUS_CLOSING) // 已经决定关闭，丢弃后续数据
+        return count;
+    c->rlength += count;
 
-    ws_request(&conn_list[fd]);
+    int handshake = c->status == WS_STATUS_HANDSHAKE;
+    ws_request(c);
+    if (handshake && c->status == WS_STATUS_OPEN) // 握手完成，定时器改为保活
+        timer_add(&c->reactor->wheel, &c->timer, (ws_timeout(c, c->reactor->now) + WS_TICK_MS - 1) / WS_TICK_MS);
 
-    set_event(fd, EPOLLOUT, 0);
+    // 数据都处理完了就释放读缓冲区，空闲连接不占内存
+    if (c->rlength == 0)
+    {
+        free(c->rbuffer);
+        c->rbuffer = NULL;
+        c->rcapacity = 0;
+    }
+
+    // 有数据要发送时等待可写，队列超过高水位时暂停读取
+    ws_update_events(c);
+
+    // SSL_write在等对方的数据，现在可以重试
+    if (c->tls_flags & WS_TLS_WRITE_WANTS_READ)
+        return send_cb(c);
+    // 一个TLS记录可能比读缓冲区大，剩下的明文在SSL里，socket上没有数据，epoll不会再通知
+    if (tls_pending(c) && !c->paused && c->status == WS_STATUS_OPEN)
+        return recv_cb(c);
     return count;
 }
 
-int send_cb(int fd)
+// 用writev一次发送队列中的多个缓冲区，共享的发布帧不需要先拷贝到连接自己的缓冲区
+// 由reactor_flush在本轮事件循环结束时直接调用，没有写完才等EPOLLOUT再调用；连接被关闭释放时返回-1
+int send_cb(struct conn *c)
 {
-    ws_response(&conn_list[fd]);
-
     int count = 0;
-    if (conn_list[fd].wlength != 0) {
-		count = send(fd, conn_list[fd].wbuffer, conn_list[fd].wlength, 0);
-	}
-	set_event(fd, EPOLLIN, 0);
+
+    // SSL_read在等socket可写，先重试读
+    if ((c->tls_flags & WS_TLS_READ_WANTS_WRITE) && recv_cb(c) < 0)
+        return -1;
+
+    if (c->wcount > 0)
+    {
+        struct iovec iov[IOV_SIZE];
+        int n = 0;
+        for (n = 0; n < c->wcount && n < IOV_SIZE; ++n)
+        {
+            struct ws_buffer *b = c->wqueue[(c->whead + n) & (c->wqcapacity - 1)];
+            int offset = n == 0 ? c->woffset : 0;
+            iov[n].iov_base = b->data + offset;
+            iov[n].iov_len = b->length - offset;
+        }
+
+        count = c->ssl ? tls_writev(c, iov, n) : writev(c->fd, iov, n);
+        WS_STAT_ADD(c->reactor, writes, 1);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                c->wblocked = 1;
+                ws_update_events(c);
+                return 0;
+            }
+            event_unregister(c);
+            return -1;
+        }
+        ws_queue_consume(c, count);
+        // 没写完说明socket缓冲区满了（或者超过了IOV_SIZE个缓冲区），等可写再继续
+        c->wblocked = c->wcount > 0;
+    }
+    if (c->wcount == 0 && c->status == WS_STATUS_CLOSING)
+    {
+        event_unregister(c);
+        return -1;
+    }
+    // 没有发完继续等可写，降到低水位以下恢复读取
+    ws_update_events(c);
+    // 暂停期间SSL里留下的明文不会再触发EPOLLIN
+    if (!c->paused && tls_pending(c) && c->status == WS_STATUS_OPEN)
+        return recv_cb(c);
     return count;
 }
 
+// 每个reactor线程一个监听socket，通过SO_REUSEPORT由内核分配新连接
 int init_server(unsigned short port)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 
     struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
 
     if (-1 == bind(sockfd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr)))
     {
-        printf("bind failed: %s\n", strerror(errno));
+        WS_ERROR("bind port %d: %s", port, strerror(errno));
+        close(sockfd);
+        return -1;
     }
 
-    listen(sockfd, 10);
-    printf("listen finshed: %d\n", sockfd);
+    listen(sockfd, SOMAXCONN);
+    WS_INFO("listening on port %d, fd %d", port, sockfd);
 
     return sockfd;
 }
 
-int main()
+static unsigned long long now_ms(void)
 {
-    unsigned short port = 2000;
-    epfd = epoll_create(1);
-    int sockfd = init_server(port);
-    conn_list[sockfd].fd = sockfd;
-    conn_list[sockfd].r_action.recv_callback = accept_cb;
-    set_event(sockfd, EPOLLIN, 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// 处理到期的定时器：发送ping，回收握手超时、pong超时和空闲的连接
+static void timer_cb(struct reactor *r)
+{
+    unsigned long long tick = r->now / WS_TICK_MS;
+    struct ws_timer *t;
+
+    while ((t = timer_expired(&r->wheel, tick)) != NULL)
+    {
+        struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+        long long deadline = ws_timeout(c, r->now);
+        if (deadline < 0)
+            event_unregister(c);
+        else
+            timer_add(&r->wheel, t, (deadline + WS_TICK_MS - 1) / WS_TICK_MS);
+    }
+}
+
+// 把任务交给r的线程执行，可以在任何线程调用；队列原来为空时才需要唤醒
+void reactor_post(struct reactor *r, struct ws_task *t)
+{
+    uint64_t one = 1;
+    int wake;
+
+    pthread_mutex_lock(&r->lock);
+    wake = r->tasks == NULL;
+    t->next = r->tasks;
+    r->tasks = t;
+    pthread_mutex_unlock(&r->lock);
+    if (wake)
+        write(r->efd, &one, sizeof(one));
+}
+
+// 按提交顺序执行其他线程提交的任务
+static int reactor_tasks(struct reactor *r)
+{
+    struct ws_task *list, *ordered = NULL;
+    int count = 0;
+
+    pthread_mutex_lock(&r->lock);
+    list = r->tasks;
+    r->tasks = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    while (list)
+    {
+        struct ws_task *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered)
+    {
+        struct ws_task *next = ordered->next;
+        ordered->run(ordered); // run可能释放任务
+        ordered = next;
+        count++;
+    }
+    return count;
+}
+
+// 发送本轮事件中排队的数据，写合并窗口还没到期的留到下一轮；返回最近的窗口还有多少毫秒到期
+static int reactor_flush(struct reactor *r)
+{
+    int i, kept = 0, timeout = WS_TICK_MS;
+
+    // send_cb可能处理TLS中剩下的数据，又有连接加进来，所以每次都重新比较nflush
+    for (i = 0; i < r->nflush; ++i)
+    {
+        struct conn *c = r->flush[i];
+        if (c == NULL) // 已经关闭
+            continue;
+        if (c->flush_due > r->now)
+        {
+            if ((int)(c->flush_due - r->now) < timeout)
+                timeout = c->flush_due - r->now;
+            r->flush[kept++] = c;
+            c->flush_slot = kept;
+            continue;
+        }
+        c->flush_slot = 0;
+        send_cb(c);
+    }
+    r->nflush = kept;
+    return timeout;
+}
+
+// 其他线程发布了消息或提交了任务
+int inbox_cb(struct conn *c)
+{
+    int count = pubsub_deliver(c->reactor);
+    return count + reactor_tasks(c->reactor);
+}
+
+struct reactor_args
+{
+    struct reactor *reactor;
+    unsigned short port;
+};
+
+// 一个reactor：自己的epoll和监听socket，连接从接入到关闭都在这个线程里处理
+void *reactor_loop(void *arg)
+{
+    struct reactor_args *args = arg;
+    struct reactor *r = args->reactor;
+    struct epoll_event events[EVENT_SIZE];
+    struct conn listener = {0};
+    struct conn inbox = {0};
+    int timeout = WS_TICK_MS;
+
+    r->now = now_ms();
+    timer_init(&r->wheel, r->now / WS_TICK_MS);
+
+    listener.reactor = r;
+    listener.fd = init_server(args->port);
+    if (listener.fd < 0)
+        return NULL;
+    listener.r_action.accept_callback = accept_cb;
+    set_event(&listener, EPOLLIN, 1);
+
+    inbox.reactor = r;
+    inbox.fd = r->efd;
+    inbox.r_action.recv_callback = inbox_cb;
+    set_event(&inbox, EPOLLIN, 1);
 
     while (1)
     {
-        struct epoll_event events[1024] = {0};
-        int nready = epoll_wait(epfd, events, 1024, -1);
+        // 最多等一个tick，时间轮按时推进；有写合并窗口时等到最早的窗口到期
+        int nready = epoll_wait(r->epfd, events, EVENT_SIZE, timeout);
+        r->now = now_ms();
 
         int i = 0;
         for (i = 0; i < nready; ++i)
         {
-            int connfd = events[i].data.fd;
-            if (events[i].events & EPOLLIN)
-                conn_list[connfd].r_action.recv_callback(connfd);
+            struct conn *c = events[i].data.ptr;
+            // 可读和可写可能同时发生；回调返回-1表示连接已经释放
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                if (c->r_action.recv_callback(c) < 0)
+                    continue;
+            }
             if (events[i].events & EPOLLOUT)
-                conn_list[connfd].send_callback(connfd);
+                c->send_callback(c);
+        }
+        timer_cb(r);
+        timeout = reactor_flush(r);
+    }
+    return NULL;
+}
+
+// 创建threads个reactor并在当前线程和新线程中运行，监听失败时返回-1，否则不返回
+int reactor_run(unsigned short port, long threads)
+{
+    struct rlimit rl;
+    long i;
+
+    // 每个连接一个fd，把软限制提高到硬限制
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        WS_INFO("open files limit: %llu", (unsigned long long)rl.rlim_cur);
+    }
+
+    // 直接写的连接可能已经被对方关闭，写入返回EPIPE，不要被SIGPIPE杀死
+    signal(SIGPIPE, SIG_IGN);
+
+    if (threads < 1)
+        threads = 1;
+    // 发布时要遍历所有reactor，所以先全部创建好再启动线程
+    reactors = calloc(threads, sizeof(struct reactor));
+    struct reactor_args *args = calloc(threads, sizeof(struct reactor_args));
+    for (i = 0; i < threads; ++i)
+    {
+        reactors[i].epfd = epoll_create1(0);
+        reactors[i].efd = eventfd(0, EFD_NONBLOCK);
+        pthread_mutex_init(&reactors[i].lock, NULL);
+        args[i].reactor = &reactors[i];
+        args[i].port = port;
+    }
+    reactor_count = threads;
+
+    for (i = 1; i < threads; ++i)
+    {
+        pthread_t tid;
+        pthread_create(&tid, NULL, reactor_loop, &args[i]);
+    }
+    reactor_loop(&args[0]); // 只有监听失败时才返回
+    return -1;
+}
+
+// 嵌入其他程序时定义WS_NO_MAIN，由调用者设置好配置后调用reactor_run
+#ifndef WS_NO_MAIN
+static struct ws_buffer *index_page = NULL;
+
+// 负载均衡和监控的健康检查
+static void health_handler(struct conn *c, struct ws_http_request *req)
+{
+    ws_http_respond(c, req, 200, "text/plain", "ok\n", 3);
+}
+
+// 测试页面启动时读入内存，所有请求共享同一个缓冲区
+static void index_handler(struct conn *c, struct ws_http_request *req)
+{
+    ws_http_respond_buffer(c, req, 200, "text/html; charset=utf-8", index_page);
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-Z] [-T] [-w bits] [-W bits] [-l level] [-H bytes] [-L bytes] [-M bytes] [-P policy] [-s ms] [-p ms] [-t ms] [-I ms] [-D ms] [-r frames] [-e ms] [-f file] [-C cert -K key] [-N] [-X] [-o file] [port] [threads]\n"
+           "  -Z        disable permessage-deflate\n"
+           "  -T        allow context takeover (per-connection zlib streams)\n"
+           "  -w bits   server_max_window_bits, 9-15\n"
+           "  -W bits   client_max_window_bits, 8-15\n"
+           "  -l level  zlib compression level, 0-9\n"
+           "  -H bytes  send queue high watermark, stop reading above it\n"
+           "  -L bytes  send queue low watermark, resume reading below it\n"
+           "  -M bytes  send queue limit for published frames\n"
+           "  -P policy slow consumer policy: disconnect, drop-oldest, drop-newest\n"
+           "  -s ms     handshake timeout, 0 disables\n"
+           "  -p ms     ping after this long without data, 0 disables\n"
+           "  -t ms     close when a ping gets no answer within this time\n"
+           "  -I ms     close after this long without a data message, 0 disables\n"
+           "  -D ms     coalesce frames queued within this window into one write, 0 flushes once per loop iteration\n"
+           "  -r frames keep this many recent messages per ?resume session for reconnect replay, 0 disables\n"
+           "  -e ms     keep a disconnected session this long for the client to reconnect\n"
+           "  -f file   serve this page at / over plain HTTP (default websocket.html if it exists)\n"
+           "  -C file   serve wss:// with this PEM certificate chain\n"
+           "  -K file   private key for -C\n"
+           "  -N        disable session tickets, resume from the server session cache only\n"
+           "  -X        disable kernel TLS offload\n"
+           "  -o file   append the log to this file instead of stdout\n",
+           name);
+}
+
+// ./server [options] [port] [threads]，threads默认为CPU核数
+int main(int argc, char *argv[])
+{
+    const char *logfile = NULL;
+    const char *page = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "ZTw:W:l:H:L:M:P:s:p:t:I:D:r:e:f:C:K:NXo:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'Z':
+            ws_deflate_config.enabled = 0;
+            break;
+        case 'T':
+            ws_deflate_config.server_no_context_takeover = 0;
+            ws_deflate_config.client_no_context_takeover = 0;
+            break;
+        case 'w':
+            ws_deflate_config.server_max_window_bits = atoi(optarg);
+            break;
+        case 'W':
+            ws_deflate_config.client_max_window_bits = atoi(optarg);
+            break;
+        case 'l':
+            ws_deflate_config.level = atoi(optarg);
+            break;
+        case 'H':
+            ws_queue_config.high_watermark = atoi(optarg);
+            break;
+        case 'L':
+            ws_queue_config.low_watermark = atoi(optarg);
+            break;
+        case 'M':
+            ws_queue_config.limit = atoi(optarg);
+            break;
+        case 'P':
+            if (strcmp(optarg, "disconnect") == 0)
+                ws_queue_config.policy = WS_POLICY_DISCONNECT;
+            else if (strcmp(optarg, "drop-oldest") == 0)
+                ws_queue_config.policy = WS_POLICY_DROP_OLDEST;
+            else if (strcmp(optarg, "drop-newest") == 0)
+                ws_queue_config.policy = WS_POLICY_DROP_NEWEST;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            ws_keepalive_config.handshake_timeout = atoi(optarg);
+            break;
+        case 'p':
+            ws_keepalive_config.ping_interval = atoi(optarg);
+            break;
+        case 't':
+            ws_keepalive_config.pong_timeout = atoi(optarg);
+            break;
+        case 'I':
+            ws_keepalive_config.idle_timeout = atoi(optarg);
+            break;
+        case 'D':
+            ws_queue_config.flush_delay = atoi(optarg);
+            break;
+        case 'r':
+            ws_session_config.frames = atoi(optarg);
+            break;
+        case 'e':
+            ws_session_config.ttl = atoi(optarg);
+            break;
+        case 'f':
+            page = optarg;
+            break;
+        case 'C':
+            ws_tls_config.cert = optarg;
+            break;
+        case 'K':
+            ws_tls_config.key = optarg;
+            break;
+        case 'N':
+            ws_tls_config.tickets = 0;
+            break;
+        case 'X':
+            ws_tls_config.ktls = 0;
+            break;
+        case 'o':
+            logfile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
         }
     }
+    if (ws_deflate_config.server_max_window_bits < 9 || ws_deflate_config.server_max_window_bits > 15 ||
+        ws_deflate_config.client_max_window_bits < 8 || ws_deflate_config.client_max_window_bits > 15 ||
+        ws_queue_config.low_watermark > ws_queue_config.high_watermark)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 日志由后台线程写出，reactor线程不会阻塞在终端或文件上
+    int logfd = logfile ? open(logfile, O_WRONLY | O_CREAT | O_APPEND, 0644) : STDOUT_FILENO;
+    if (logfd < 0)
+    {
+        printf("open %s: %s\n", logfile, strerror(errno));
+        return 1;
+    }
+    if (log_init(logfd) < 0)
+        return 1;
+
+    if (ws_tls_config.cert)
+    {
+        if (ws_tls_config.key == NULL)
+            ws_tls_config.key = ws_tls_config.cert;
+        if (tls_init() < 0)
+            return 1;
+    }
+
+    // 不是websocket握手的请求按路由处理
+    index_page = ws_http_load(page ? page : "websocket.html");
+    if (index_page)
+    {
+        ws_http_route("GET", "/", index_handler);
+        ws_http_route("GET", "/websocket.html", index_handler);
+    }
+    else if (page)
+    {
+        printf("open %s: %s\n", page, strerror(errno));
+        return 1;
+    }
+    ws_http_route("GET", "/healthz", health_handler);
+
+    unsigned short port = optind < argc ? atoi(argv[optind]) : 2000;
+    long threads = optind + 1 < argc ? atoi(argv[optind + 1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    return reactor_run(port, threads) < 0 ? 1 : 0;
 }
+#endif
@@ -1,19 +1,372 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 #define BUFFER_LENGTH 1024
+#define WS_MAX_HEADER 8192                // 握手请求头的最大长度，超过返回431
+#define WS_MAX_MESSAGE (16 * 1024 * 1024) // 单条消息（包括分片合并后）的最大长度
+#define WS_KEEP_BUFFER (64 * 1024)        // 超过这个大小的缓冲区用完就释放，不长期占用
+#define WS_FLUSH_BYTES (16 * 1024)        // 写合并窗口内攒够这么多数据就不再等
+
+// 日志级别，低于WS_LOG_LEVEL的日志在编译时去掉，参数也不会求值
+enum
+{
+    WS_LOG_DEBUG = 0,
+    WS_LOG_INFO,
+    WS_LOG_WARN,
+    WS_LOG_ERROR,
+};
+
+#ifndef WS_LOG_LEVEL
+#define WS_LOG_LEVEL WS_LOG_INFO // -DWS_LOG_LEVEL=0打开调试日志
+#endif
 
-typedef int (*RCALLBACK)(int fd);
+#define WS_LOG(level, ...)              \
+    do                                  \
+    {                                   \
+        if ((level) >= WS_LOG_LEVEL)    \
+            ws_log(level, __VA_ARGS__); \
+    } while (0)
+#define WS_DEBUG(...) WS_LOG(WS_LOG_DEBUG, __VA_ARGS__)
+#define WS_INFO(...) WS_LOG(WS_LOG_INFO, __VA_ARGS__)
+#define WS_WARN(...) WS_LOG(WS_LOG_WARN, __VA_ARGS__)
+#define WS_ERROR(...) WS_LOG(WS_LOG_ERROR, __VA_ARGS__)
 
+struct conn;
+typedef int (*RCALLBACK)(struct conn *c);
+
+enum
+{
+    WS_STATUS_HANDSHAKE = 0,
+    WS_STATUS_OPEN,
+    WS_STATUS_CLOSING,
+};
+
+enum
+{
+    WS_OPCODE_CONTINUATION = 0x0,
+    WS_OPCODE_TEXT = 0x1,
+    WS_OPCODE_BINARY = 0x2,
+    WS_OPCODE_CLOSE = 0x8,
+    WS_OPCODE_PING = 0x9,
+    WS_OPCODE_PONG = 0xA,
+};
+
+enum
+{
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_INVALID_DATA = 1007,
+    WS_CLOSE_TOO_BIG = 1009,
+};
+
+#define WS_RSV1 0x40     // 和opcode一起传给encode_header，表示消息经过压缩
+#define WS_DEFLATE_MIN 32 // 比这短的消息不压缩
+
+// 慢消费者的发送队列超过上限时的处理方式
+enum
+{
+    WS_POLICY_DISCONNECT = 0, // 断开连接
+    WS_POLICY_DROP_OLDEST,    // 丢弃队列中最早的发布帧
+    WS_POLICY_DROP_NEWEST,    // 丢弃新的发布帧
+};
+
+// 发送队列的背压配置，单位都是字节
+struct ws_queue_config
+{
+    int high_watermark; // 未发送的数据超过高水位时暂停读取这个连接
+    int low_watermark;  // 降到低水位以下时恢复读取
+    int limit;          // 发布的帧放不下时按policy处理
+    int policy;
+    void (*backpressure)(struct conn *c, int paused); // 暂停和恢复时通知应用，可以为NULL
+    int flush_delay; // 新连接的写合并窗口（毫秒），见conn.flush_delay
+};
+
+extern struct ws_queue_config ws_queue_config;
+
+// 一个reactor上所有连接的统计，只由reactor自己的线程修改，其他线程可以随时读取
+struct ws_stats
+{
+    long long connections;
+    long long bytes;   // 发送队列中未发送的字节数
+    long long buffers; // 发送队列中的缓冲区个数
+    long long peak;    // 单个连接发送队列的最大字节数
+    long long paused;  // 当前暂停读取的连接数
+    long long pauses;  // 累计暂停次数
+    long long dropped; // 慢消费者策略丢弃的帧数
+    long long disconnects;
+    long long pings;
+    long long pongs;    // 收到的对应ping的pong
+    long long timeouts; // 握手、pong或关闭超时被回收的连接
+    long long idle;     // 空闲超时关闭的连接
+    long long tls_handshakes;
+    long long tls_resumed; // 复用会话的TLS握手
+    long long ktls;        // 启用了kTLS发送的连接
+    long long resumed;     // 续接成功的重连
+    long long replayed;    // 重连时补发的消息数
+    long long frames;      // 放进发送队列的帧数
+    long long writes;      // 发送的系统调用次数（writev或TLS写）
+    long long epoll_mods;  // 因为发送队列变化调用epoll_ctl的次数
+};
+
+// 单写者的计数器，其他线程读取时不会看到撕裂的值
+#define WS_STAT_ADD(r, field, n) __atomic_store_n(&(r)->stats.field, (r)->stats.field + (n), __ATOMIC_RELAXED)
+#define WS_STAT_GET(r, field) __atomic_load_n(&(r)->stats.field, __ATOMIC_RELAXED)
+
+// 保活和超时配置，单位都是毫秒，0表示不启用
+struct ws_keepalive_config
+{
+    int handshake_timeout; // 连接后多久没有完成握手就关闭
+    int ping_interval;     // 多久没有收到任何数据就发送ping
+    int pong_timeout;      // ping发出后多久没有收到数据就认为连接已断开；也用于等待关闭握手
+    int idle_timeout;      // 多久没有收到数据消息就关闭
+};
+
+extern struct ws_keepalive_config ws_keepalive_config;
+
+#define WS_TICK_MS 100      // 时间轮的精度
+#define WS_WHEEL_SIZE 1024 // 时间轮的槽数，2的幂，覆盖102.4秒
+
+// 侵入式定时器，放在要定时的结构体中，不需要单独分配
+struct ws_timer
+{
+    struct ws_timer *next; // 不在时间轮中时为NULL
+    struct ws_timer *prev;
+    unsigned long long expire; // 到期的tick
+};
+
+// 单层时间轮：添加、删除O(1)，超过一圈的定时器留在槽中等下一圈
+struct ws_wheel
+{
+    unsigned long long current; // 下一个要检查的tick
+    struct ws_timer pending;    // 已到期还没有取走的定时器
+    struct ws_timer slots[WS_WHEEL_SIZE];
+};
+
+// wss配置，cert为NULL时不启用TLS
+struct ws_tls_config
+{
+    const char *cert; // PEM格式的证书链
+    const char *key;
+    int cache_size;   // 服务端会话缓存的条目数
+    int tickets;      // 会话票据，关闭后只用服务端缓存复用会话
+    int ktls;         // 内核支持时由内核加密发送
+};
+
+extern struct ws_tls_config ws_tls_config;
+
+enum
+{
+    WS_TLS_ESTABLISHED = 1 << 0,
+    WS_TLS_KTLS_SEND = 1 << 1,
+    WS_TLS_READ_WANTS_WRITE = 1 << 2, // SSL_read要等socket可写
+    WS_TLS_WRITE_WANTS_READ = 1 << 3, // SSL_write要等socket可读
+};
+
+// permessage-deflate的服务端配置
+struct ws_deflate_config
+{
+    int enabled;
+    int server_no_context_takeover; // 不跨消息保留压缩上下文，压缩流可以在连接间共用
+    int client_no_context_takeover;
+    int server_max_window_bits; // 9到15，窗口越大压缩率越高，内存越多
+    int client_max_window_bits;
+    int level;
+    int mem_level;
+};
+
+extern struct ws_deflate_config ws_deflate_config;
+
+// 断线重连的会话，客户端在握手的请求URI中带 ?resume 时启用，见ws_session_open
+struct ws_session_config
+{
+    int frames;       // 每个会话保留最近的多少条数据消息用于补发，0表示不支持续接
+    int bytes;        // 保留的消息最多占用的字节数
+    int ttl;          // 连接断开后会话保留多久（毫秒）
+    int max_sessions; // 等待重连的会话超过这个数时提前回收最早断开的
+};
+
+extern struct ws_session_config ws_session_config;
+
+struct z_stream_s;
+struct ssl_st;
+struct iovec;
+
+// 一个连接协商好的permessage-deflate参数；有上下文接管的一方独占一个常驻的zlib流
+struct ws_deflate
+{
+    int server_bits;
+    int client_bits;
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    struct z_stream_s *deflater;
+    struct z_stream_s *inflater;
+};
+
+// rbuffer中的一段数据（偏移+长度），不做拷贝
+struct ws_slice
+{
+    int offset;
+    int length;
+};
+
+// HTTP请求头的增量解析状态，跨多次recv保留；websocket握手和普通HTTP请求共用
+struct ws_handshake
+{
+    int scanned;    // 已扫描过的字节数
+    int line_start; // 当前行的起始位置
+    int length;     // 请求头完整后的总长度，之后只等请求体
+    int minor;      // HTTP/1.x的x
+
+    struct ws_slice method;
+    struct ws_slice path; // 包括查询参数
+    struct ws_slice upgrade;
+    struct ws_slice connection;
+    struct ws_slice version;
+    struct ws_slice key;
+    struct ws_slice extensions; // Sec-WebSocket-Extensions
+    struct ws_slice content_length;
+    struct ws_slice transfer_encoding;
+};
+
+#define WS_MAX_BODY (64 * 1024) // 普通HTTP请求体的最大长度，超过返回413
+#define WS_MAX_ROUTES 64
+
+// 一个普通HTTP请求，指针都指向rbuffer，只在处理函数返回之前有效
+struct ws_http_request
+{
+    const char *method;
+    int method_length;
+    const char *path; // 不含查询参数
+    int path_length;
+    const char *query; // '?'之后的部分，没有时为NULL
+    int query_length;
+    const char *body;
+    int body_length;
+    int minor;      // HTTP/1.x的x
+    int keep_alive; // 响应之后保持连接
+    int head;       // HEAD请求，响应只有头部
+    int responded;
+};
+
+// 路由的处理函数，必须在返回之前调用一次ws_http_respond，否则返回500
+typedef void (*WS_HTTP_HANDLER)(struct conn *c, struct ws_http_request *req);
+
+// 当前正在解析的帧，负载可以跨多次recv到达
+struct ws_frame
+{
+    int header; // 头部长度，0表示头部还没有解析
+    int fin;
+    int rsv;    // RSV1-3，只有协商了permessage-deflate时才允许RSV1
+    int opcode;
+    unsigned char mask[4];
+    unsigned long long length; // 负载长度
+    unsigned long long offset; // 已处理的负载字节数
+};
+
+// 文本消息的增量UTF-8校验状态，保存跨帧被截断的字符
+struct ws_utf8
+{
+    unsigned char need;  // 当前字符还缺的后续字节数
+    unsigned char lower; // 下一个后续字节的合法范围
+    unsigned char upper;
+};
+
+// 引用计数的发送缓冲区；发布的帧只编码一次，由所有订阅者的发送队列共享
+struct ws_buffer
+{
+    int refcount; // 原子操作，可能被多个reactor线程同时持有
+    int shared;   // 共享的缓冲区不能再追加数据
+    int length;
+    int capacity;
+    char data[];
+};
+
+struct ws_topic;
+struct ws_session;
+
+// 连接订阅的一个主题，index是连接在主题订阅者数组中的位置
+struct ws_subscription
+{
+    struct ws_topic *topic;
+    int index;
+};
+
+// 一个reactor线程本地的主题索引，只保存这个线程上的订阅者
+struct ws_topics
+{
+    struct ws_topic **buckets;
+    int nbuckets; // 2的幂
+    int count;
+};
+
+struct ws_publish;
+
+// 其他线程交给reactor线程执行的任务，通常嵌在调用者自己的结构体中
+struct ws_task
+{
+    struct ws_task *next;
+    void (*run)(struct ws_task *t);
+};
+
+struct reactor
+{
+    int epfd;
+    int efd; // eventfd，其他线程发布消息或提交任务后用它唤醒本线程
+
+    pthread_mutex_t lock; // 保护inbox和tasks
+    struct ws_publish *inbox;
+    struct ws_task *tasks;
+
+    struct ws_topics topics;
+    struct ws_stats stats;
+
+    struct conn **flush; // 有数据等待发送的连接，本轮事件循环结束或写合并窗口到期时发送
+    int nflush;
+    int flush_capacity;
+
+    unsigned long long now; // 本轮事件循环开始时的时间（毫秒），避免每个事件都读时钟
+    struct ws_wheel wheel;
+};
+
+// 每个连接单独分配，epoll事件里直接保存指针；缓冲区都按需分配和扩容，空闲连接只占这个结构体
 struct conn
 {
     int fd;
+    struct reactor *reactor; // 连接所属的reactor线程
+
+    struct ssl_st *ssl; // wss连接，明文连接为NULL
+    int tls_flags;
 
-    char rbuffer[BUFFER_LENGTH];
+    char *rbuffer; // 已收到还没有处理完的数据
     int rlength;
+    int rcapacity;
 
-    char wbuffer[BUFFER_LENGTH];
-    int wlength;
+    struct ws_buffer **wqueue; // 待发送的缓冲区，环形数组，容量是2的幂
+    int whead;
+    int wcount;
+    int wqcapacity;
+    int woffset;  // 队首缓冲区已发送的字节数
+    int wpinned;  // 队首这么多个缓冲区已经交给TLS加密，不能丢弃
+    int wbytes;   // 队列中未发送的字节数
+    int wpeak;    // wbytes的最大值
+    int wdropped; // 被慢消费者策略丢弃的帧数
+    int paused;   // 超过高水位，暂停读取
+    int events;   // 当前在epoll中关注的事件
+    int wblocked; // 上次没有写完，socket缓冲区满了，等EPOLLOUT再发送
+
+    // 写合并：同一轮事件循环中排队的帧一起用一次writev发送，不经过EPOLLOUT；
+    // flush_delay大于0时第一帧排队后再等这么多毫秒，把之后的帧也合并进来
+    int flush_delay;
+    int flush_slot; // 在reactor->flush中的位置加1，0表示不在其中
+    unsigned long long flush_due;
 
     RCALLBACK send_callback;
 
@@ -24,12 +377,142 @@ struct conn
     } r_action;
 
     int status;
+    struct ws_handshake hs;
+    struct ws_frame frame;
+
+    char *message; // 分片消息或超过rbuffer的消息在这里拼接
+    unsigned long long mlength;
+    unsigned long long mcapacity;
+    int mopcode;
+    int mcompressed; // 当前消息的第一帧带RSV1
+    struct ws_utf8 utf8;
+
+    struct ws_deflate *deflate; // 没有协商permessage-deflate时为NULL
+
+    struct ws_timer timer;       // 握手、保活和空闲检查共用一个定时器
+    unsigned long long created;  // 连接建立的时间（毫秒）
+    unsigned long long active;   // 最后一次收到数据的时间
+    unsigned long long mactive;  // 最后一次收到数据消息的时间
+    unsigned long long closing;  // 开始等待关闭的时间
+    unsigned long long ping;     // 还没有收到pong的ping的发送时间（微秒），也是ping的负载
+    int rtt;                     // 最近一次ping的往返时间（微秒）
+    int srtt;                    // 平滑后的往返时间
 
-    char *payload;
-	char mask[4];
+    struct ws_subscription *subs;
+    int nsubs;
+    int subs_capacity;
+
+    struct ws_session *session; // 没有启用断线重连时为NULL
+
+    void *app; // 应用挂在连接上的数据，由ws_handler.release释放
+};
+
+// 应用处理数据消息的入口，没有设置时回显
+struct ws_handler
+{
+    int (*message)(struct conn *c, int opcode, const char *data, int length); // 返回非0表示已处理
+    void (*release)(struct conn *c);                                          // 连接关闭，可以为NULL
+    int no_commands;                                                          // 非0时客户端的STATS/SUB/UNSUB/PUB命令也交给message，在启动前设置
 };
 
+extern struct ws_handler ws_handler;
+
+void sha1(const unsigned char *data, int length, unsigned char *digest);
+int base64_encode(const unsigned char *in, int in_len, char *out);
+int ws_accept_key(const char *key, int length, char *accept);
+int ws_has_token(const char *buf, struct ws_slice value, const char *token);
+int ws_parse_handshake(struct ws_handshake *hs, const char *buf, int length);
+int decode_packet(struct ws_frame *frame, const unsigned char *stream, int length);
+int encode_header(char *buffer, int fin, int opcode, unsigned long long length);
+int encode_packet(char *buffer, int opcode, const char *stream, int length);
+void demask(char *data, int len, const unsigned char *mask, unsigned long long offset);
+
+// demask的各个实现，demask在运行时选择其中CPU支持的最快的一个
+void demask_scalar(char *data, int len, const unsigned char *mask, unsigned long long offset);
+#if defined(__x86_64__) || defined(__i386__)
+void demask_sse2(char *data, int len, const unsigned char *mask, unsigned long long offset);
+void demask_avx2(char *data, int len, const unsigned char *mask, unsigned long long offset);
+#endif
+
+int utf8_validate(struct ws_utf8 *u, const char *data, int len);
+
+// utf8_validate使用的完整校验实现，按CPU选择
+int utf8_check_scalar(const char *data, int len);
+#if defined(__x86_64__) || defined(__i386__)
+int utf8_check_ssse3(const char *data, int len);
+int utf8_check_avx2(const char *data, int len);
+#endif
+
+struct ws_buffer *ws_buffer_new(int capacity);
+struct ws_buffer *ws_buffer_frame(int opcode, const char *data, int length);
+const char *ws_frame_payload(struct ws_buffer *frame, int *length);
+void ws_buffer_ref(struct ws_buffer *b);
+void ws_buffer_unref(struct ws_buffer *b);
+int ws_queue_push(struct conn *c, struct ws_buffer *b);
+void ws_queue_pop(struct conn *c);
+void ws_queue_consume(struct conn *c, int sent);
+int ws_queue_admit(struct conn *c, int length);
+void ws_update_events(struct conn *c);
+struct ws_buffer *ws_reserve(struct conn *c, int length);
+void ws_commit(struct conn *c, struct ws_buffer *b, int length);
+
+int ws_send(struct conn *c, int opcode, const char *data, int length);
+int ws_encode(struct conn *c, int opcode, const char *data, int length);
+long long ws_timeout(struct conn *c, unsigned long long now);
 int ws_request(struct conn *c);
-int ws_response(struct conn *c);
+void ws_release(struct conn *c);
+
+int ws_deflate_negotiate(struct conn *c, const char *offers, int length, char *response, int size);
+int ws_deflate_message(struct ws_deflate *d, const char *data, int length, char **out);
+int ws_inflate_message(struct ws_deflate *d, const char *data, int length, char **out);
+struct ws_buffer *ws_deflate_frame(int bits, int opcode, const char *data, int length);
+void ws_deflate_release(struct conn *c);
+
+int ws_http_route(const char *method, const char *path, WS_HTTP_HANDLER handler);
+int ws_http_serve(struct conn *c, int header_length);
+int ws_http_respond(struct conn *c, struct ws_http_request *req, int status, const char *type, const char *body, int length);
+int ws_http_respond_buffer(struct conn *c, struct ws_http_request *req, int status, const char *type, struct ws_buffer *body);
+struct ws_buffer *ws_http_load(const char *file);
+
+void ws_session_open(struct conn *c, const char *uri, int length);
+void ws_session_record(struct conn *c, struct ws_buffer *frame);
+void ws_session_desync(struct conn *c);
+void ws_session_topic(struct conn *c, const char *name, int length, int subscribed);
+void ws_session_release(struct conn *c);
+
+void timer_init(struct ws_wheel *w, unsigned long long now);
+void timer_add(struct ws_wheel *w, struct ws_timer *t, unsigned long long expire);
+void timer_del(struct ws_timer *t);
+struct ws_timer *timer_expired(struct ws_wheel *w, unsigned long long now);
+
+int tls_init(void);
+int tls_enabled(void);
+int tls_accept(struct conn *c);
+int tls_read(struct conn *c, char *buffer, int length);
+int tls_pending(struct conn *c);
+int tls_writev(struct conn *c, const struct iovec *iov, int iovcnt);
+void tls_release(struct conn *c);
+
+void ws_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_init(int fd);
+void log_flush(void);
+
+void reactor_post(struct reactor *r, struct ws_task *t);
+int reactor_run(unsigned short port, long threads);
+
+int pubsub_request(struct conn *c, const char *data, int length);
+int pubsub_subscribe(struct conn *c, const char *topic, int length);
+int pubsub_unsubscribe(struct conn *c, const char *topic, int length);
+int pubsub_publish(struct reactor *r, const char *topic, int length, struct ws_buffer *frame);
+void pubsub_release(struct conn *c);
+int pubsub_deliver(struct reactor *r);
+
+// 所有reactor，启动线程前由main创建
+extern struct reactor *reactors;
+extern int reactor_count;
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WS_TOKEN_BYTES 16
+#define WS_TOKEN_LENGTH (WS_TOKEN_BYTES * 2) // 十六进制
+
+// 断线重连的会话：记录发给客户端的最近的数据消息和订阅的主题，重连时补发客户端没有收到的部分
+// owner和以下字段由lock保护；连接可能在任意reactor上重连，所以会话是全局的
+struct ws_session
+{
+    struct ws_session *next;        // 哈希桶链表，由sessions_lock保护
+    struct ws_session *expire_prev; // 等待过期的链表，按断开的先后排列，由sessions_lock保护
+    struct ws_session *expire_next;
+    int listed;
+    int refcount; // 原子操作：哈希表和指向它的每个连接各持有一个
+    uint32_t hash;
+    char token[WS_TOKEN_LENGTH + 1];
+
+    pthread_mutex_t lock;
+    struct conn *owner;          // 当前的连接，NULL表示已断开，等待重连
+    unsigned long long detached; // 断开的时间（毫秒）
+    int desync;                  // 丢弃过已记录的消息，客户端的计数对不上了，不能再续接
+
+    unsigned long long seq; // 已发送的数据消息总数，ring中是编号seq-count+1到seq的消息
+    struct ws_buffer **ring;
+    int head;
+    int count;
+    int bytes;
+
+    char **topics; // 订阅的主题，每项是长度（1字节）加名字
+    int ntopics;
+    int topics_capacity;
+};
+
+struct ws_session_config ws_session_config = {
+    256,
+    256 * 1024,
+    60 * 1000,
+    65536,
+};
+
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ws_session **buckets;
+static int nbuckets; // 2的幂
+static int nsessions;
+static struct ws_session *expire_head, *expire_tail;
+static int nexpiring;
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a，令牌本身是随机的，只用来选桶
+static uint32_t token_hash(const char *token, int length)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)token[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void session_unref(struct ws_session *s)
+{
+    int i;
+    if (__atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    for (i = 0; i < s->count; ++i)
+        ws_buffer_unref(s->ring[(s->head + i) % ws_session_config.frames]);
+    for (i = 0; i < s->ntopics; ++i)
+        free(s->topics[i]);
+    free(s->topics);
+    free(s->ring);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+// 以下几个函数都在持有sessions_lock时调用
+static struct ws_session *session_find(const char *token, int length)
+{
+    uint32_t hash = token_hash(token, length);
+    struct ws_session *s;
+    if (length != WS_TOKEN_LENGTH || nbuckets == 0)
+        return NULL;
+    for (s = buckets[hash & (nbuckets - 1)]; s; s = s->next)
+        if (s->hash == hash && memcmp(s->token, token, length) == 0)
+            return s;
+    return NULL;
+}
+
+static int session_insert(struct ws_session *s)
+{
+    if (nsessions >= nbuckets) // 负载因子到1时扩容
+    {
+        int capacity = nbuckets ? nbuckets * 2 : 64;
+        struct ws_session **table = calloc(capacity, sizeof(struct ws_session *));
+        int i;
+        if (table == NULL)
+            return -1;
+        for (i = 0; i < nbuckets; ++i)
+        {
+            while (buckets[i])
+            {
+                struct ws_session *next = buckets[i]->next;
+                buckets[i]->next = table[buckets[i]->hash & (capacity - 1)];
+                table[buckets[i]->hash & (capacity - 1)] = buckets[i];
+                buckets[i] = next;
+            }
+        }
+        free(buckets);
+        buckets = table;
+        nbuckets = capacity;
+    }
+    s->next = buckets[s->hash & (nbuckets - 1)];
+    buckets[s->hash & (nbuckets - 1)] = s;
+    nsessions++;
+    return 0;
+}
+
+static void session_remove(struct ws_session *s)
+{
+    struct ws_session **p = &buckets[s->hash & (nbuckets - 1)];
+    while (*p != s)
+        p = &(*p)->next;
+    *p = s->next;
+    nsessions--;
+}
+
+static void expire_append(struct ws_session *s)
+{
+    s->listed = 1;
+    s->expire_prev = expire_tail;
+    s->expire_next = NULL;
+    if (expire_tail)
+        expire_tail->expire_next = s;
+    else
+        expire_head = s;
+    expire_tail = s;
+    nexpiring++;
+}
+
+static void expire_unlink(struct ws_session *s)
+{
+    if (s->expire_prev)
+        s->expire_prev->expire_next = s->expire_next;
+    else
+        expire_head = s->expire_next;
+    if (s->expire_next)
+        s->expire_next->expire_prev = s->expire_prev;
+    else
+        expire_tail = s->expire_prev;
+    s->listed = 0;
+    nexpiring--;
+}
+
+// 从过期链表头开始回收：断开超过ttl的，以及断开的会话太多时最早断开的，遇到第一个还不能回收的就停止。
+// 断开和重连之间有竞争，链表中可能有已经重连的会话，直接移出链表
+static void session_sweep(unsigned long long now)
+{
+    while (expire_head)
+    {
+        struct ws_session *s = expire_head;
+        int owned, expired;
+
+        pthread_mutex_lock(&s->lock);
+        owned = s->owner != NULL;
+        expired = s->detached + ws_session_config.ttl <= now || nexpiring > ws_session_config.max_sessions;
+        pthread_mutex_unlock(&s->lock);
+        if (!owned && !expired)
+            break;
+
+        expire_unlink(s);
+        if (!owned)
+        {
+            session_remove(s);
+            session_unref(s);
+        }
+    }
+}
+
+static struct ws_session *session_create(void)
+{
+    unsigned char random[WS_TOKEN_BYTES];
+    struct ws_session *s;
+    int i;
+
+    if (getrandom(random, sizeof(random), 0) != sizeof(random))
+        return NULL;
+    s = calloc(1, sizeof(struct ws_session));
+    if (s == NULL)
+        return NULL;
+    s->ring = malloc(ws_session_config.frames * sizeof(struct ws_buffer *));
+    if (s->ring == NULL)
+    {
+        free(s);
+        return NULL;
+    }
+    for (i = 0; i < WS_TOKEN_BYTES; ++i)
+        sprintf(s->token + i * 2, "%02x", random[i]);
+    s->hash = token_hash(s->token, WS_TOKEN_LENGTH);
+    s->refcount = 1; // 哈希表持有
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+// 在请求URI的查询参数中找name，返回值的长度，没有这个参数返回-1
+static int query_param(const char *uri, int length, const char *name, const char **value)
+{
+    const char *query = memchr(uri, '?', length);
+    const char *end = uri + length;
+    int nlen = strlen(name);
+
+    if (query == NULL)
+        return -1;
+    for (query++; query < end;)
+    {
+        const char *amp = memchr(query, '&', end - query);
+        const char *next = amp ? amp : end;
+        if (next - query >= nlen && memcmp(query, name, nlen) == 0 && (query + nlen == next || query[nlen] == '='))
+        {
+            *value = query + nlen + (query + nlen < next);
+            return next - *value;
+        }
+        query = next + 1;
+    }
+    return -1;
+}
+
+// 把一帧放进新连接的发送队列：协商了permessage-deflate时重新压缩，压缩结果依赖这个连接自己的上下文
+static void session_replay(struct conn *c, struct ws_buffer *frame)
+{
+    int length;
+    const char *payload = ws_frame_payload(frame, &length);
+    if (c->deflate && length >= WS_DEFLATE_MIN)
+        ws_encode(c, frame->data[0] & 0x0F, payload, length);
+    else if (ws_queue_push(c, frame) == 0)
+        WS_STAT_ADD(c->reactor, frames, 1);
+}
+
+// 握手成功、101响应已经放进发送队列之后调用。请求URI带 ?resume 时开始一个新会话，
+// 带 ?resume=<token>&last=<n> 时续接之前的会话，n是客户端在这个会话中已经收到的数据消息数。
+// 先发送一个不计数的文本帧
+//   SESSION <token> <n> resumed   续接成功，接着补发第n条之后的消息
+//   SESSION <token> <n> new       新会话，或者要续接的会话已经过期、补发不了，客户端需要重新同步全部状态
+// 之后客户端收到的每条数据消息计数加1，重连时带上最新的计数
+void ws_session_open(struct conn *c, const char *uri, int length)
+{
+    const char *token, *last;
+    int tlength, llength, i, resumed = 0, ntopics = 0;
+    unsigned long long n = 0, now;
+    struct ws_session *s = NULL;
+    struct ws_buffer **replay = NULL;
+    char **topics = NULL;
+    char hello[96];
+    int replayed = 0;
+
+    if (ws_session_config.frames <= 0 || (tlength = query_param(uri, length, "resume", &token)) < 0)
+        return;
+    now = now_ms();
+
+    pthread_mutex_lock(&sessions_lock);
+    session_sweep(now);
+    if (tlength > 0 && (llength = query_param(uri, length, "last", &last)) > 0 && llength < 20)
+    {
+        char digits[20];
+        memcpy(digits, last, llength);
+        digits[llength] = '\0';
+        n = strtoull(digits, NULL, 10);
+        s = session_find(token, tlength);
+    }
+    if (s)
+    {
+        pthread_mutex_lock(&s->lock);
+        if (!s->desync && n <= s->seq && n >= s->seq - s->count)
+        {
+            // 接管会话：原来的连接可能还没发现自己已经断开，它下一次发送时发现会话换了主人就关闭自己
+            replayed = s->seq - n;
+            replay = malloc((replayed + 1) * sizeof(struct ws_buffer *));
+            topics = malloc((s->ntopics + 1) * sizeof(char *));
+            if (replay && topics)
+            {
+                for (i = 0; i < replayed; ++i)
+                {
+                    replay[i] = s->ring[(s->head + s->count - replayed + i) % ws_session_config.frames];
+                    ws_buffer_ref(replay[i]);
+                }
+                for (i = 0; i < s->ntopics; ++i)
+                    if ((topics[ntopics] = malloc((unsigned char)s->topics[i][0] + 1)))
+                        memcpy(topics[ntopics++], s->topics[i], (unsigned char)s->topics[i][0] + 1);
+                s->owner = c;
+                __atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+                resumed = 1;
+                if (s->listed)
+                    expire_unlink(s);
+            }
+            else
+            {
+                replayed = 0;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!resumed)
+    {
+        s = session_create();
+        if (s && session_insert(s) < 0)
+        {
+            session_unref(s);
+            s = NULL;
+        }
+        if (s)
+        {
+            s->owner = c;
+            __atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+        }
+        n = 0;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (s == NULL)
+    {
+        free(replay);
+        free(topics);
+        WS_WARN("fd %d: cannot create a resumable session", c->fd);
+        return;
+    }
+
+    // 先恢复订阅再补发：这个reactor上的发布要等握手处理完才会投递，接管之后发布的消息不会丢，
+    // 接管前后一小段时间内的发布可能既在补发的消息中又投递一次
+    for (i = 0; i < ntopics; ++i)
+    {
+        pubsub_subscribe(c, topics[i] + 1, (unsigned char)topics[i][0]);
+        free(topics[i]);
+    }
+    free(topics);
+    c->session = s;
+
+    length = snprintf(hello, sizeof(hello), "SESSION %s %llu %s", s->token, n, resumed ? "resumed" : "new");
+    ws_encode(c, WS_OPCODE_TEXT, hello, length);
+    for (i = 0; i < replayed; ++i)
+    {
+        session_replay(c, replay[i]);
+        ws_buffer_unref(replay[i]);
+    }
+    free(replay);
+    if (resumed)
+    {
+        WS_STAT_ADD(c->reactor, resumed, 1);
+        WS_STAT_ADD(c->reactor, replayed, replayed);
+    }
+    WS_DEBUG("fd %d session %s %s at %llu, replayed %d", c->fd, s->token, resumed ? "resumed" : "new", n, replayed);
+}
+
+// 会话已经被重连的新连接接管：放开会话，关闭这个旧连接，和ws_queue_admit一样由epoll报告EPOLLHUP后回收
+static void session_lost(struct conn *c)
+{
+    session_unref(c->session);
+    c->session = NULL;
+    if (c->status == WS_STATUS_OPEN)
+    {
+        c->status = WS_STATUS_CLOSING;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+// 发给客户端的一条数据消息，frame是未压缩的完整帧，会话持有它的一个引用
+void ws_session_record(struct conn *c, struct ws_buffer *frame)
+{
+    struct ws_session *s = c->session;
+    const struct ws_session_config *config = &ws_session_config;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->owner != c)
+    {
+        pthread_mutex_unlock(&s->lock);
+        session_lost(c);
+        return;
+    }
+    s->seq++;
+    while (s->count > 0 && (s->count == config->frames || s->bytes + frame->length > config->bytes))
+    {
+        struct ws_buffer *oldest = s->ring[s->head];
+        s->bytes -= oldest->length;
+        ws_buffer_unref(oldest);
+        s->head = (s->head + 1) % config->frames;
+        s->count--;
+    }
+    if (frame->length <= config->bytes) // 放不下的大消息不保留，重连时从它之后开始才能续接
+    {
+        ws_buffer_ref(frame);
+        s->ring[(s->head + s->count) % config->frames] = frame;
+        s->count++;
+        s->bytes += frame->length;
+    }
+    else
+    {
+        s->head = (s->head + s->count) % config->frames;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 已经记录的消息被慢消费者策略丢弃，客户端的计数和会话对不上了，之后的重连只能重新开始
+void ws_session_desync(struct conn *c)
+{
+    struct ws_session *s = c->session;
+    pthread_mutex_lock(&s->lock);
+    if (s->owner == c)
+        s->desync = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 连接订阅或取消订阅了一个主题；连接关闭时由pubsub_release取消的订阅仍然保留，重连时恢复
+void ws_session_topic(struct conn *c, const char *name, int length, int subscribed)
+{
+    struct ws_session *s = c->session;
+    int i;
+
+    if (length > 255) // 长度只占1字节，pubsub命令的主题本来就不超过255
+        return;
+    pthread_mutex_lock(&s->lock);
+    if (s->owner != c)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    for (i = 0; i < s->ntopics; ++i)
+        if ((unsigned char)s->topics[i][0] == length && memcmp(s->topics[i] + 1, name, length) == 0)
+            break;
+    if (subscribed && i == s->ntopics)
+    {
+        char *topic = NULL;
+        if (s->ntopics == s->topics_capacity)
+        {
+            int capacity = s->topics_capacity ? s->topics_capacity * 2 : 4;
+            char **array = realloc(s->topics, capacity * sizeof(char *));
+            if (array)
+            {
+                s->topics = array;
+                s->topics_capacity = capacity;
+            }
+        }
+        if (s->ntopics < s->topics_capacity && (topic = malloc(length + 1)))
+        {
+            topic[0] = length;
+            memcpy(topic + 1, name, length);
+            s->topics[s->ntopics++] = topic;
+        }
+    }
+    else if (!subscribed && i < s->ntopics)
+    {
+        free(s->topics[i]);
+        s->topics[i] = s->topics[--s->ntopics];
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 连接关闭：会话保留ttl毫秒等待重连
+void ws_session_release(struct conn *c)
+{
+    struct ws_session *s = c->session;
+    unsigned long long now = now_ms();
+    int owned;
+
+    if (s == NULL)
+        return;
+    c->session = NULL;
+    pthread_mutex_lock(&s->lock);
+    owned = s->owner == c;
+    if (owned)
+    {
+        s->owner = NULL;
+        s->detached = now;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&sessions_lock);
+    if (owned && !s->listed)
+        expire_append(s);
+    session_sweep(now);
+    pthread_mutex_unlock(&sessions_lock);
+    session_unref(s);
+}
@@ -0,0 +1,71 @@
+#include "server.h"
+
+#include <stddef.h>
+
+static void timer_link(struct ws_timer *head, struct ws_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void timer_unlink(struct ws_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timer_init(struct ws_wheel *w, unsigned long long now)
+{
+    int i;
+    w->current = now;
+    w->pending.next = w->pending.prev = &w->pending;
+    for (i = 0; i < WS_WHEEL_SIZE; ++i)
+        w->slots[i].next = w->slots[i].prev = &w->slots[i];
+}
+
+// 添加或重新设置定时器，expire是到期的tick，已经过去的时间在下一个tick到期
+void timer_add(struct ws_wheel *w, struct ws_timer *t, unsigned long long expire)
+{
+    if (t->next)
+        timer_unlink(t);
+    if (expire < w->current)
+        expire = w->current;
+    t->expire = expire;
+    timer_link(&w->slots[expire & (WS_WHEEL_SIZE - 1)], t);
+}
+
+void timer_del(struct ws_timer *t)
+{
+    if (t->next)
+        timer_unlink(t);
+}
+
+// 取出一个到now为止已经到期的定时器，没有就返回NULL
+// 每个槽只检查一次，把到期的定时器移到pending中再逐个返回，调用者处理时可以添加或删除任何定时器
+struct ws_timer *timer_expired(struct ws_wheel *w, unsigned long long now)
+{
+    while (w->pending.next == &w->pending)
+    {
+        struct ws_timer *head, *t, *next;
+        if (w->current > now)
+            return NULL;
+        head = &w->slots[w->current & (WS_WHEEL_SIZE - 1)];
+        for (t = head->next; t != head; t = next)
+        {
+            next = t->next;
+            if (t->expire <= now) // 没到期的是下一圈的
+            {
+                timer_unlink(t);
+                timer_link(&w->pending, t);
+            }
+        }
+        w->current++;
+    }
+
+    struct ws_timer *t = w->pending.next;
+    timer_unlink(t);
+    return t;
+}
@@ -0,0 +1,241 @@
+#include "server.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_RECORD 16384 // 一个TLS记录的最大明文长度
+
+struct ws_tls_config ws_tls_config = {
+    NULL,
+    NULL,
+    20480,
+    1,
+    1,
+};
+
+static SSL_CTX *tls_ctx = NULL;
+
+// 没有kTLS时把发送队列中的小缓冲区拼成一个记录再加密，避免每帧一个记录和一次系统调用
+static __thread char tls_scratch[TLS_RECORD];
+
+static void tls_print_errors(const char *what)
+{
+    unsigned long e;
+    char message[256];
+    while ((e = ERR_get_error()) != 0)
+    {
+        ERR_error_string_n(e, message, sizeof(message));
+        WS_ERROR("%s: %s", what, message);
+    }
+}
+
+// 所有reactor共用一个SSL_CTX，会话缓存和票据密钥因此在线程间共享
+int tls_init(void)
+{
+    const struct ws_tls_config *config = &ws_tls_config;
+    static const unsigned char sid_ctx[] = "websocket";
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL)
+    {
+        tls_print_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, config->cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, config->key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1)
+    {
+        tls_print_errors(config->cert);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+
+    // 发送队列里的缓冲区在重试之间可能换地址，部分写入按已发送的字节从队列中弹出
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // 服务端会话缓存：TLS 1.2的会话ID复用，以及关闭票据时TLS 1.3的有状态票据
+    SSL_CTX_set_session_id_context(tls_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, config->cache_size);
+    // 无状态票据不需要查共享缓存，多个reactor之间没有锁竞争；票据密钥由OpenSSL随机生成
+    if (!config->tickets)
+        SSL_CTX_set_options(tls_ctx, SSL_OP_NO_TICKET);
+    if (config->ktls)
+        SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    return 0;
+}
+
+int tls_enabled(void)
+{
+    return tls_ctx != NULL;
+}
+
+int tls_accept(struct conn *c)
+{
+    SSL *ssl = SSL_new(tls_ctx);
+    if (ssl == NULL)
+        return -1;
+    if (SSL_set_fd(ssl, c->fd) != 1)
+    {
+        SSL_free(ssl);
+        return -1;
+    }
+    SSL_set_accept_state(ssl);
+    c->ssl = ssl;
+    return 0;
+}
+
+// 握手完成后记录会话复用和kTLS；握手由SSL_read在第一次读时完成，不需要单独的状态
+static void tls_established(struct conn *c)
+{
+    SSL *ssl = c->ssl;
+    c->tls_flags |= WS_TLS_ESTABLISHED;
+    WS_STAT_ADD(c->reactor, tls_handshakes, 1);
+    if (SSL_session_reused(ssl))
+        WS_STAT_ADD(c->reactor, tls_resumed, 1);
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        c->tls_flags |= WS_TLS_KTLS_SEND;
+        WS_STAT_ADD(c->reactor, ktls, 1);
+    }
+}
+
+// 和recv一样：返回读到的字节数，0表示对方关闭，-1并设置errno表示出错，EAGAIN表示要等事件
+int tls_read(struct conn *c, char *buffer, int length)
+{
+    SSL *ssl = c->ssl;
+    int n = SSL_read(ssl, buffer, length);
+
+    c->tls_flags &= ~WS_TLS_READ_WANTS_WRITE;
+    if (!(c->tls_flags & WS_TLS_ESTABLISHED) && SSL_is_init_finished(ssl))
+        tls_established(c);
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(ssl, n))
+    {
+    case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE: // 握手或密钥更新要先发送数据，可写时再读
+        c->tls_flags |= WS_TLS_READ_WANTS_WRITE;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        errno = ECONNRESET;
+        return -1;
+    }
+}
+
+// SSL中还有已经解密但没有读出的数据，epoll不会再通知
+int tls_pending(struct conn *c)
+{
+    return c->ssl && SSL_pending(c->ssl) > 0;
+}
+
+// 和writev一样：返回发送的字节数，-1并设置errno表示出错
+int tls_writev(struct conn *c, const struct iovec *iov, int iovcnt)
+{
+    SSL *ssl = c->ssl;
+    int total = 0, i = 0, offset = 0;
+
+    // kTLS由内核加密，直接writev，队列中的共享帧也不用拷贝
+    if (c->tls_flags & WS_TLS_KTLS_SEND)
+        return writev(c->fd, iov, iovcnt);
+
+    c->tls_flags &= ~WS_TLS_WRITE_WANTS_READ;
+    while (i < iovcnt)
+    {
+        const char *data;
+        int length, n, end;
+
+        if (iov[i].iov_len - offset >= TLS_RECORD / 2)
+        {
+            // 大缓冲区直接加密，不经过拼接
+            data = (const char *)iov[i].iov_base + offset;
+            length = iov[i].iov_len - offset;
+            if (length > TLS_RECORD)
+                length = TLS_RECORD;
+            end = i + 1;
+        }
+        else
+        {
+            int j = i, joffset = offset;
+            length = 0;
+            while (j < iovcnt && length < TLS_RECORD)
+            {
+                int size = iov[j].iov_len - joffset;
+                if (size > TLS_RECORD - length)
+                    size = TLS_RECORD - length;
+                memcpy(tls_scratch + length, (const char *)iov[j].iov_base + joffset, size);
+                length += size;
+                joffset += size;
+                if (joffset == (int)iov[j].iov_len)
+                {
+                    ++j;
+                    joffset = 0;
+                }
+            }
+            data = tls_scratch;
+            end = joffset ? j + 1 : j;
+        }
+
+        n = SSL_write(ssl, data, length);
+        if (n <= 0)
+        {
+            int error = SSL_get_error(ssl, n);
+            if (error == SSL_ERROR_WANT_READ)
+                c->tls_flags |= WS_TLS_WRITE_WANTS_READ;
+            if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+            {
+                ERR_clear_error();
+                errno = EPIPE;
+                return -1;
+            }
+            // 这个记录已经加密，重试时OpenSSL发送的是它保存的密文，其中的帧不能再被慢消费者策略丢弃
+            c->wpinned = end;
+            if (total > 0)
+                return total;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        c->wpinned = 0;
+        total += n;
+        // 按实际写入的字节数前进
+        while (n > 0)
+        {
+            int size = iov[i].iov_len - offset;
+            if (n < size)
+            {
+                offset += n;
+                break;
+            }
+            n -= size;
+            ++i;
+            offset = 0;
+        }
+    }
+    return total;
+}
+
+// 尽量发送close_notify，不等待对方回应
+void tls_release(struct conn *c)
+{
+    if (c->ssl == NULL)
+        return;
+    if (c->tls_flags & WS_TLS_ESTABLISHED)
+        SSL_shutdown(c->ssl);
+    ERR_clear_error();
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+    c->tls_flags = 0;
+}
@@ -0,0 +1,370 @@
+#include "server.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// 逐字节校验一个字节，need是当前字符还缺的后续字节数，[lower, upper]是下一个后续字节的合法范围
+// 范围按RFC 3629第4节收窄，排除过长编码、代理项和超过U+10FFFF的码点
+static inline int utf8_step(struct ws_utf8 *u, unsigned char ch)
+{
+    if (u->need)
+    {
+        if (ch < u->lower || ch > u->upper)
+            return -1;
+        u->need--;
+        u->lower = 0x80;
+        u->upper = 0xBF;
+        return 0;
+    }
+    if (ch < 0x80)
+        return 0;
+
+    u->lower = 0x80;
+    u->upper = 0xBF;
+    if (ch >= 0xC2 && ch <= 0xDF)
+    {
+        u->need = 1;
+    }
+    else if (ch >= 0xE0 && ch <= 0xEF)
+    {
+        u->need = 2;
+        if (ch == 0xE0)
+            u->lower = 0xA0; // 过长编码
+        else if (ch == 0xED)
+            u->upper = 0x9F; // 代理项U+D800-U+DFFF
+    }
+    else if (ch >= 0xF0 && ch <= 0xF4)
+    {
+        u->need = 3;
+        if (ch == 0xF0)
+            u->lower = 0x90;
+        else if (ch == 0xF4)
+            u->upper = 0x8F; // 超过U+10FFFF
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// 标量版本，任何平台都可用；ASCII部分一次检查8字节
+int utf8_check_scalar(const char *data, int len)
+{
+    struct ws_utf8 u = {0};
+    int i = 0;
+
+    while (i < len)
+    {
+        if (u.need == 0)
+        {
+            for (; i + 8 <= len; i += 8)
+            {
+                uint64_t v;
+                memcpy(&v, data + i, 8);
+                if (v & 0x8080808080808080ULL)
+                    break;
+            }
+            if (i == len)
+                break;
+        }
+        if (utf8_step(&u, data[i++]) < 0)
+            return -1;
+    }
+    return u.need ? -1 : 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 向量版本用Keiser和Lemire的查表算法：每个字节和它前一个字节的高低半字节各查一张16项的表，
+// 三个结果按位与之后非零就是错误；再单独检查第3、4字节位置上必须出现的后续字节
+#define TOO_SHORT (1 << 0)      // 首字节后面不是后续字节
+#define TOO_LONG (1 << 1)       // ASCII后面是后续字节
+#define OVERLONG_3 (1 << 2)     // E0 80..9F
+#define TOO_LARGE (1 << 3)      // F4 90..BF
+#define SURROGATE (1 << 4)      // ED A0..BF
+#define OVERLONG_2 (1 << 5)     // C0..C1
+#define TOO_LARGE_1000 (1 << 6) // F5..FF
+#define OVERLONG_4 (1 << 6)     // F0 80..8F
+#define TWO_CONTS (1 << 7)      // 两个连续的后续字节
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// 前一个字节的高半字节
+static const unsigned char byte1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+// 前一个字节的低半字节
+static const unsigned char byte1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+// 当前字节的高半字节
+static const unsigned char byte2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// 块末尾的字节大于这些值说明有字符没有结束，下一个块必须以后续字节开头
+static const unsigned char incomplete_max[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+struct utf8_sse
+{
+    __m128i error;
+    __m128i prev;       // 上一个块
+    __m128i incomplete; // 上一个块末尾有没有结束的字符
+};
+
+__attribute__((target("ssse3")))
+static inline void utf8_block_ssse3(struct utf8_sse *s, __m128i input)
+{
+    const __m128i low = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, s->prev, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, s->prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, s->prev, 13);
+
+    __m128i b1h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), low));
+    __m128i b1l = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte1_low), _mm_and_si128(prev1, low));
+    __m128i b2h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte2_high), _mm_and_si128(_mm_srli_epi16(input, 4), low));
+    __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+    // 前两个字节是三字节或四字节字符的首字节时，这里必须是后续字节（special中的TWO_CONTS位）
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+    s->error = _mm_or_si128(s->error, _mm_xor_si128(must23, special));
+    s->incomplete = _mm_subs_epu8(input, _mm_loadu_si128((const __m128i *)(incomplete_max + 16)));
+    s->prev = input;
+}
+
+// 全是ASCII的块只需要确认上一个块没有留下未结束的字符
+__attribute__((target("ssse3")))
+static inline void utf8_ascii_ssse3(struct utf8_sse *s, __m128i input)
+{
+    s->error = _mm_or_si128(s->error, s->incomplete);
+    s->incomplete = _mm_setzero_si128();
+    s->prev = input;
+}
+
+__attribute__((target("ssse3")))
+int utf8_check_ssse3(const char *data, int len)
+{
+    struct utf8_sse s = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i in0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i in1 = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i in2 = _mm_loadu_si128((const __m128i *)(data + i + 32));
+        __m128i in3 = _mm_loadu_si128((const __m128i *)(data + i + 48));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(in0, in1), _mm_or_si128(in2, in3))) == 0)
+        {
+            utf8_ascii_ssse3(&s, in3);
+            continue;
+        }
+        utf8_block_ssse3(&s, in0);
+        utf8_block_ssse3(&s, in1);
+        utf8_block_ssse3(&s, in2);
+        utf8_block_ssse3(&s, in3);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i input = _mm_loadu_si128((const __m128i *)(data + i));
+        if (_mm_movemask_epi8(input) == 0)
+            utf8_ascii_ssse3(&s, input);
+        else
+            utf8_block_ssse3(&s, input);
+    }
+    if (i < len)
+    {
+        // 不足一个块的尾部补0，0是ASCII，截断的字符会被当作TOO_SHORT
+        char tail[16] = {0};
+        memcpy(tail, data + i, len - i);
+        utf8_block_ssse3(&s, _mm_loadu_si128((const __m128i *)tail));
+    }
+    s.error = _mm_or_si128(s.error, s.incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(s.error, _mm_setzero_si128())) == 0xFFFF ? 0 : -1;
+}
+
+struct utf8_avx
+{
+    __m256i error;
+    __m256i prev;
+    __m256i incomplete;
+};
+
+__attribute__((target("avx2")))
+static inline void utf8_block_avx2(struct utf8_avx *s, __m256i input)
+{
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    // alignr按128位分别移位，先拼出[上一块的高半部分, 本块的低半部分]
+    __m256i shifted = _mm256_permute2x128_si256(s->prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+    __m256i t1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte1_high));
+    __m256i t1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte1_low));
+    __m256i t2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte2_high));
+    __m256i b1h = _mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low));
+    __m256i b1l = _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, low));
+    __m256i b2h = _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(input, 4), low));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+    s->error = _mm256_or_si256(s->error, _mm256_xor_si256(must23, special));
+    s->incomplete = _mm256_subs_epu8(input, _mm256_loadu_si256((const __m256i *)incomplete_max));
+    s->prev = input;
+}
+
+__attribute__((target("avx2")))
+static inline void utf8_ascii_avx2(struct utf8_avx *s, __m256i input)
+{
+    s->error = _mm256_or_si256(s->error, s->incomplete);
+    s->incomplete = _mm256_setzero_si256();
+    s->prev = input;
+}
+
+__attribute__((target("avx2")))
+int utf8_check_avx2(const char *data, int len)
+{
+    struct utf8_avx s = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i in0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i in1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0)
+        {
+            utf8_ascii_avx2(&s, in1);
+            continue;
+        }
+        utf8_block_avx2(&s, in0);
+        utf8_block_avx2(&s, in1);
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i input = _mm256_loadu_si256((const __m256i *)(data + i));
+        if (_mm256_movemask_epi8(input) == 0)
+            utf8_ascii_avx2(&s, input);
+        else
+            utf8_block_avx2(&s, input);
+    }
+    if (i < len)
+    {
+        char tail[32] = {0};
+        memcpy(tail, data + i, len - i);
+        utf8_block_avx2(&s, _mm256_loadu_si256((const __m256i *)tail));
+    }
+    s.error = _mm256_or_si256(s.error, s.incomplete);
+    return _mm256_testz_si256(s.error, s.error) ? 0 : -1;
+}
+#endif
+
+typedef int (*UTF8_CHECK)(const char *data, int len);
+
+// 第一次调用时根据CPU支持的指令集选择实现
+static UTF8_CHECK utf8_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return utf8_check_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return utf8_check_ssse3;
+#endif
+    return utf8_check_scalar;
+}
+
+static UTF8_CHECK utf8_impl = NULL;
+static pthread_once_t utf8_once = PTHREAD_ONCE_INIT;
+
+static void utf8_init(void)
+{
+    utf8_impl = utf8_select();
+}
+
+// data末尾最多3个字节可能是被截断的字符，返回最后一个完整字符的结束位置
+static int utf8_boundary(const unsigned char *data, int len)
+{
+    int i = len - 1;
+    int need;
+
+    while (i > 0 && len - i < 4 && (data[i] & 0xC0) == 0x80)
+        --i;
+    if (data[i] >= 0xF0)
+        need = 4;
+    else if (data[i] >= 0xE0)
+        need = 3;
+    else if (data[i] >= 0xC0)
+        need = 2;
+    else
+        return len;
+    return need > len - i ? i : len;
+}
+
+// 增量校验一段文本，data可以在字符中间开始或结束，没有结束的字符保存在u中
+// 整条消息都传入之后u->need为0才是合法的UTF-8；出错返回-1
+int utf8_validate(struct ws_utf8 *u, const char *data, int len)
+{
+    int i = 0, end;
+
+    // 先补完上一段末尾的字符
+    while (u->need && i < len)
+        if (utf8_step(u, data[i++]) < 0)
+            return -1;
+
+    if (len - i < 16) // 短数据直接逐字节处理
+    {
+        for (; i < len; ++i)
+            if (utf8_step(u, data[i]) < 0)
+                return -1;
+        return 0;
+    }
+
+    // 向量实现只处理完整的字符，末尾被截断的字符逐字节处理并保存状态
+    end = i + utf8_boundary((const unsigned char *)data + i, len - i);
+    pthread_once(&utf8_once, utf8_init); // 多个reactor线程同时进入时只选择一次
+    if (utf8_impl(data + i, end - i) < 0)
+        return -1;
+    for (i = end; i < len; ++i)
+        if (utf8_step(u, data[i]) < 0)
+            return -1;
+    return 0;
+}
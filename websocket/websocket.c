@@ -1,236 +1,1349 @@
 #include "server.h"
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
-#include <openssl/sha.h>
-#include <openssl/pem.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // GUID是特定值，与客户端的Sec-WebSocket-Key一起，通过SHA-1算法生成一个新值发送回客户端，完成握手，确保连接的安全
 #define GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
-// 标准WebSocket头部，适用于长度小于126字节的数据
-struct _nty_ophdr
+#define SHA1_DIGEST_LENGTH 20
+#define WS_ACCEPT_LENGTH 29 // 20字节摘要的Base64编码，加上结尾的'\0'
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// SHA-1的一个64字节分组，消息扩展只保留最近16个字，边算边生成
+static void sha1_block(uint32_t h[5], const unsigned char *block)
 {
-    unsigned char opcode : 4,         // 操作码，表示帧的类型
-        rsv3 : 1, rsv2 : 1, rsv1 : 1, // 保留位，通常设置为0
-        fin : 1;                      // 表示是否为消息的最后一帧
-    unsigned char payload_length : 7, // 有效载荷的长度
-        mask : 1;                     // 表示是否对有效载荷进行掩码
-} __attribute__((packed));            // 确保编译器不会对其进行填充，确保结构体的内存布局与协议中的字节布局完全一致
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        w[i] = ((uint32_t)block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+
+#define SHA1_W(i) (i < 16 ? w[i] : (w[i & 15] = ROL32(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1)))
+#define SHA1_ROUND(f, k)                                         \
+    {                                                            \
+        uint32_t t = ROL32(a, 5) + (f) + e + (k) + SHA1_W(i);    \
+        e = d;                                                   \
+        d = c;                                                   \
+        c = ROL32(b, 30);                                        \
+        b = a;                                                   \
+        a = t;                                                   \
+    }
+#pragma GCC unroll 20
+    for (i = 0; i < 20; ++i)
+        SHA1_ROUND(d ^ (b & (c ^ d)), 0x5A827999)
+#pragma GCC unroll 20
+    for (i = 20; i < 40; ++i)
+        SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1)
+#pragma GCC unroll 20
+    for (i = 40; i < 60; ++i)
+        SHA1_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC)
+#pragma GCC unroll 20
+    for (i = 60; i < 80; ++i)
+        SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6)
+#undef SHA1_ROUND
+#undef SHA1_W
 
-// 扩展头部，适用于长度在126到65535字节之间的数据
-struct _nty_websocket_head_126
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+// 计算SHA-1摘要，全部在栈上完成，不申请内存
+void sha1(const unsigned char *data, int length, unsigned char *digest)
 {
-    unsigned short payload_length; // 有效载荷的长度
-    char mask_key[4]; // 掩码密钥，用于解码有效载荷
-    unsigned char data[8]; // 有效载荷的前8个字节
-} __attribute__((packed));
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char tail[128] = {0};
+    unsigned long long bits = (unsigned long long)length * 8;
+    int blocks = length / 64;
+    int rest = length % 64;
+    int size = rest < 56 ? 64 : 128; // 剩余数据加上0x80和8字节长度需要的空间
+    int i;
+
+    for (i = 0; i < blocks; ++i)
+        sha1_block(h, data + i * 64);
+
+    memcpy(tail, data + blocks * 64, rest);
+    tail[rest] = 0x80;
+    for (i = 0; i < 8; ++i)
+        tail[size - 1 - i] = (bits >> (i * 8)) & 0xFF;
+    sha1_block(h, tail);
+    if (size == 128)
+        sha1_block(h, tail + 64);
 
-// 另一种扩展头部，适用于长度超过65535字节的数据
-struct _nty_websocket_head_127
+    for (i = 0; i < 5; ++i)
+    {
+        digest[i * 4] = h[i] >> 24;
+        digest[i * 4 + 1] = (h[i] >> 16) & 0xFF;
+        digest[i * 4 + 2] = (h[i] >> 8) & 0xFF;
+        digest[i * 4 + 3] = h[i] & 0xFF;
+    }
+}
+
+// 将输入进行Base64编码，out至少需要(in_len+2)/3*4+1个字节，返回编码后的长度
+int base64_encode(const unsigned char *in, int in_len, char *out)
 {
-    unsigned long long payload_length; 
-    char mask_key[4];
-    unsigned char data[8];
-} __attribute__((packed));
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, size = 0;
 
-typedef struct _nty_websocket_head_127 nty_websocket_head_127;
-typedef struct _nty_websocket_head_126 nty_websocket_head_126;
-typedef struct _nty_ophdr nty_ophdr;
+    for (i = 0; i + 3 <= in_len; i += 3)
+    {
+        uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out[size++] = table[v >> 18];
+        out[size++] = table[(v >> 12) & 0x3F];
+        out[size++] = table[(v >> 6) & 0x3F];
+        out[size++] = table[v & 0x3F];
+    }
+    if (i < in_len) // 剩下1或2个字节，用'='补齐
+    {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < in_len)
+            v |= in[i + 1] << 8;
+        out[size++] = table[v >> 18];
+        out[size++] = table[(v >> 12) & 0x3F];
+        out[size++] = i + 1 < in_len ? table[(v >> 6) & 0x3F] : '=';
+        out[size++] = '=';
+    }
+    out[size] = '\0';
+    return size;
+}
 
-// 将输入字符串进行Base64编码
-int base64_encode(char *in_str, int in_len, char *out_str)
+// 由Sec-WebSocket-Key计算Sec-WebSocket-Accept，accept至少29个字节，返回其长度
+int ws_accept_key(const char *key, int length, char *accept)
 {
-    BIO *b64, *bio;
-    BUF_MEM *bptr = NULL;
-    size_t size = 0;
+    unsigned char key_guid[128];                    // Sec-WebSocket-Key + GUID
+    unsigned char sec_data[SHA1_DIGEST_LENGTH];     // SHA1摘要，二进制数据，不能当作字符串处理
 
-    if (in_str == NULL || out_str == NULL)
+    if (length + sizeof(GUID) - 1 > sizeof(key_guid))
         return -1;
+    memcpy(key_guid, key, length);
+    memcpy(key_guid + length, GUID, sizeof(GUID) - 1);
+    sha1(key_guid, length + sizeof(GUID) - 1, sec_data);
+    return base64_encode(sec_data, SHA1_DIGEST_LENGTH, accept);
+}
 
-    b64 = BIO_new(BIO_f_base64()); // 创建Base64过滤BIO对象
-    bio = BIO_new(BIO_s_mem()); // 创建内存对象，存储中间结果
-    bio = BIO_push(b64, bio); // 形成BIO链
+#define WS_HEADER_IS(name, len, literal) ((len) == sizeof(literal) - 1 && strncasecmp((name), (literal), (len)) == 0)
 
-    BIO_write(bio, in_str, in_len); // 将输入字符写入BIO链
-    BIO_flush(bio); // 刷新BIO链
+// 去掉首尾的空格和制表符
+static struct ws_slice ws_trim(const char *buf, int offset, int length)
+{
+    struct ws_slice slice;
+    while (length > 0 && (buf[offset] == ' ' || buf[offset] == '\t'))
+    {
+        ++offset;
+        --length;
+    }
+    while (length > 0 && (buf[offset + length - 1] == ' ' || buf[offset + length - 1] == '\t'))
+        --length;
+    slice.offset = offset;
+    slice.length = length;
+    return slice;
+}
 
-    BIO_get_mem_ptr(bio, &bptr); // 获取内存BIO的指针bptr，指向编码后的数据
-    memcpy(out_str, bptr->data, bptr->length); // 将编码后的数据从内存BIO复制到输出字符串out_str
-    out_str[bptr->length - 1] = '\0';
-    size = bptr->length;
+// 判断逗号分隔的头部值中是否包含token（忽略大小写），例如 "keep-alive, Upgrade"
+int ws_has_token(const char *buf, struct ws_slice value, const char *token)
+{
+    int tlen = strlen(token);
+    int pos = value.offset;
+    int end = value.offset + value.length;
 
-    BIO_free_all(bio); // 释放所有的BIO对象，防止内存泄漏
-    return size;
+    while (pos < end)
+    {
+        const char *comma = memchr(buf + pos, ',', end - pos);
+        int next = comma ? comma - buf : end;
+        struct ws_slice item = ws_trim(buf, pos, next - pos);
+        if (item.length == tlen && strncasecmp(buf + item.offset, token, tlen) == 0)
+            return 1;
+        pos = next + 1;
+    }
+    return 0;
+}
+
+// 解析请求行 "GET /path HTTP/1.1"，方法不限，版本只接受HTTP/1.0和HTTP/1.1
+static int ws_parse_request_line(struct ws_handshake *hs, const char *buf, int start, int length)
+{
+    const char *line = buf + start;
+    const char *sp1 = memchr(line, ' ', length);
+    if (sp1 == NULL || sp1 == line)
+        return -1;
+    const char *sp2 = memchr(sp1 + 1, ' ', length - (sp1 + 1 - line));
+    if (sp2 == NULL || sp2 == sp1 + 1)
+        return -1;
+
+    hs->method.offset = start;
+    hs->method.length = sp1 - line;
+    hs->path.offset = sp1 + 1 - buf;
+    hs->path.length = sp2 - sp1 - 1;
+
+    if (length - (sp2 + 1 - line) != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0 || (sp2[8] != '0' && sp2[8] != '1'))
+        return -1;
+    hs->minor = sp2[8] - '0';
+    return 0;
 }
 
-// 从allbuf中读取一行文本并存储到linebuf
-int readline(char *allbuf, int level, char *linebuf)
+// 解析一个请求头 "Name: value"，只记录握手和路由需要的字段
+static int ws_parse_header_line(struct ws_handshake *hs, const char *buf, int start, int length)
 {
-    int len = strlen(allbuf);
+    const char *line = buf + start;
+    const char *colon = memchr(line, ':', length);
+    if (colon == NULL || colon == line)
+        return -1;
+
+    int nlen = colon - line;
+    int voffset = colon + 1 - buf;
+    struct ws_slice value = ws_trim(buf, voffset, start + length - voffset);
 
-    for (; level < len; ++level)
+    if (WS_HEADER_IS(line, nlen, "Sec-WebSocket-Key"))
+        hs->key = value;
+    else if (WS_HEADER_IS(line, nlen, "Upgrade"))
+        hs->upgrade = value;
+    else if (WS_HEADER_IS(line, nlen, "Connection"))
+        hs->connection = value;
+    else if (WS_HEADER_IS(line, nlen, "Sec-WebSocket-Version"))
+        hs->version = value;
+    else if (WS_HEADER_IS(line, nlen, "Sec-WebSocket-Extensions"))
+        hs->extensions = value;
+    else if (WS_HEADER_IS(line, nlen, "Content-Length"))
+        hs->content_length = value;
+    else if (WS_HEADER_IS(line, nlen, "Transfer-Encoding"))
+        hs->transfer_encoding = value;
+    return 0;
+}
+
+// 增量解析HTTP请求头：每次recv之后用完整的rbuffer调用，已扫描过的部分不会重复扫描
+// 返回请求头总长度（含结尾空行）；数据不完整返回0；请求不合法返回-1
+// 解析结果以偏移+长度的形式指向buf，不做拷贝；是不是合法的websocket握手由调用者检查
+int ws_parse_handshake(struct ws_handshake *hs, const char *buf, int length)
+{
+    if (hs->length > 0) // 请求头已经完整，在等请求体
+        return hs->length;
+    while (hs->scanned < length)
     {
-        if (allbuf[level] == '\r' && allbuf[level + 1] == '\n')
-            return level + 2;
-        else
-            *(linebuf++) = allbuf[level];
+        const char *lf = memchr(buf + hs->scanned, '\n', length - hs->scanned);
+        if (lf == NULL)
+        {
+            hs->scanned = length;
+            return 0;
+        }
+
+        int end = lf - buf;
+        if (end == hs->line_start || buf[end - 1] != '\r')
+            return -1;
+
+        int start = hs->line_start;
+        int line_len = end - 1 - start;
+        hs->scanned = end + 1;
+        hs->line_start = end + 1;
+
+        if (line_len == 0) // 空行，请求头结束
+        {
+            if (hs->method.length == 0)
+                return -1;
+            hs->length = hs->line_start;
+            return hs->length;
+        }
+
+        int ret = (hs->method.length == 0) ? ws_parse_request_line(hs, buf, start, line_len)
+                                           : ws_parse_header_line(hs, buf, start, line_len);
+        if (ret < 0)
+            return -1;
     }
+    return 0;
+}
 
-    return -1;
+// 检查一个请求Upgrade: websocket的请求是不是合法的握手
+static int ws_valid_upgrade(const struct ws_handshake *hs, const char *buf)
+{
+    if (!WS_HEADER_IS(buf + hs->method.offset, hs->method.length, "GET") || hs->minor != 1 || hs->key.length != 24)
+        return 0;
+    if (!ws_has_token(buf, hs->connection, "upgrade"))
+        return 0;
+    if (hs->version.length != 0 && !WS_HEADER_IS(buf + hs->version.offset, hs->version.length, "13"))
+        return 0;
+    return 1;
 }
 
-// 解码操作
-void demask(char *data, int len, char *mask)
+
+// 从负载的offset处开始的4字节掩码，按内存顺序拼成32位整数，宽掩码由它重复得到
+static uint32_t mask_word(const unsigned char *mask, unsigned long long offset)
 {
+    unsigned char word[4];
+    uint32_t m;
     int i;
-    for (i = 0; i < len; ++i)
-        *(data + i) ^= *(mask + (i % 4));
+    for (i = 0; i < 4; ++i)
+        word[i] = mask[(offset + i) & 3];
+    memcpy(&m, word, 4);
+    return m;
 }
 
-// 解析数据包
-char *decode_packet(unsigned char *stream, char *mask, int length, int *ret)
+// 较长的负载先逐字节处理到align字节对齐，避免向量读写跨缓存行；返回处理的字节数
+static int demask_head(char *data, int len, const unsigned char *mask, unsigned long long offset, int align)
 {
-    nty_ophdr *hdr = (nty_ophdr *)stream; // 将输入流的前sizeof(nty_ophdr)字节解释为nty_ophdr类型的头部
-    unsigned char *data = stream + sizeof(nty_ophdr); // 将data指针移动到头部之后的位置
-    int size = 0;
-    int start = 0;
     int i = 0;
+    if (len < 256)
+        return 0;
+    for (; (uintptr_t)(data + i) & (align - 1); ++i)
+        data[i] ^= mask[(offset + i) & 3];
+    return i;
+}
 
-    /* 根据头部信息中的掩码位来判断数据包的格式*/
-    if ((hdr->mask & 0x7F) == 126)
+// 逐字节处理不足一个字的尾部
+static void demask_tail(char *data, int i, int len, const unsigned char *mask, unsigned long long offset)
+{
+    for (; i < len; ++i)
+        data[i] ^= mask[(offset + i) & 3];
+}
+
+// 64位标量版本，任何平台都可用
+void demask_scalar(char *data, int len, const unsigned char *mask, unsigned long long offset)
+{
+    uint64_t m = mask_word(mask, offset);
+    int i = 0;
+
+    m |= m << 32;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, data + i, 8); // 负载通常不对齐，memcpy编译为一次非对齐读写
+        v ^= m;
+        memcpy(data + i, &v, 8);
+    }
+    demask_tail(data, i, len, mask, offset);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void demask_sse2(char *data, int len, const unsigned char *mask, unsigned long long offset)
+{
+    int i = demask_head(data, len, mask, offset, 16);
+    __m128i m = _mm_set1_epi32(mask_word(mask, offset + i));
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), m));
+        _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), m));
+        _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), m));
+        _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), m));
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), m));
+    }
+    if (i + 8 <= len)
+    {
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storel_epi64(p, _mm_xor_si128(_mm_loadl_epi64(p), m));
+        i += 8;
+    }
+    demask_tail(data, i, len, mask, offset);
+}
+
+__attribute__((target("avx2")))
+void demask_avx2(char *data, int len, const unsigned char *mask, unsigned long long offset)
+{
+    int i = demask_head(data, len, mask, offset, 32);
+    __m256i m = _mm256_set1_epi32(mask_word(mask, offset + i));
+
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i *p = (__m256i *)(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), m));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), m));
+        _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), m));
+        _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), m));
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i *p = (__m256i *)(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), m));
+    }
+    if (i + 16 <= len)
     {
-        nty_websocket_head_126 *hdr126 = (nty_websocket_head_126 *)data;
-        size = hdr126->payload_length;
-        for (i = 0; i < 4; ++i)
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm256_castsi256_si128(m)));
+        i += 16;
+    }
+    if (i + 8 <= len)
+    {
+        __m128i *p = (__m128i *)(data + i);
+        _mm_storel_epi64(p, _mm_xor_si128(_mm_loadl_epi64(p), _mm256_castsi256_si128(m)));
+        i += 8;
+    }
+    demask_tail(data, i, len, mask, offset);
+}
+#endif
+
+typedef void (*DEMASK)(char *data, int len, const unsigned char *mask, unsigned long long offset);
+
+// 第一次调用时根据CPU支持的指令集选择实现
+static DEMASK demask_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return demask_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return demask_sse2;
+#endif
+    return demask_scalar;
+}
+
+static DEMASK demask_impl = NULL;
+static pthread_once_t demask_once = PTHREAD_ONCE_INIT;
+
+static void demask_init(void)
+{
+    demask_impl = demask_select();
+}
+
+// 解码操作，offset为data在整个负载中的位置，用于分多次解码同一帧
+void demask(char *data, int len, const unsigned char *mask, unsigned long long offset)
+{
+    if (len < 16) // 短负载直接逐字节处理
+    {
+        int i;
+        for (i = 0; i < len; ++i)
+            data[i] ^= mask[(offset + i) & 3];
+        return;
+    }
+    pthread_once(&demask_once, demask_init); // 多个reactor线程同时进入时只选择一次
+    demask_impl(data, len, mask, offset);
+}
+
+// 解析帧头部，成功返回头部长度，数据不完整返回0，协议错误返回-1
+int decode_packet(struct ws_frame *frame, const unsigned char *stream, int length)
+{
+    unsigned long long size;
+    int header = 2;
+    int opcode;
+    int i;
+
+    if (length < 2)
+        return 0;
+
+    opcode = stream[0] & 0x0F;
+    if (stream[0] & 0x30) // RSV2、RSV3没有扩展使用，必须为0；RSV1由调用者根据协商结果检查
+        return -1;
+    if (!(stream[1] & 0x80)) // 客户端发来的帧必须带掩码
+        return -1;
+    if ((opcode > WS_OPCODE_BINARY && opcode < WS_OPCODE_CLOSE) || opcode > WS_OPCODE_PONG)
+        return -1;
+
+    size = stream[1] & 0x7F;
+    if (size == 126) // 16位扩展长度，网络字节序
+    {
+        if (length < 4)
+            return 0;
+        size = (stream[2] << 8) | stream[3];
+        header = 4;
+    }
+    else if (size == 127) // 64位扩展长度，最高位必须为0
+    {
+        if (length < 10)
+            return 0;
+        size = 0;
+        for (i = 0; i < 8; ++i)
+            size = (size << 8) | stream[2 + i];
+        if (size >> 63)
+            return -1;
+        header = 10;
+    }
+
+    // 控制帧不能分片，负载不超过125字节
+    if (opcode >= WS_OPCODE_CLOSE && (!(stream[0] & 0x80) || (stream[0] & WS_RSV1) || size > 125))
+        return -1;
+
+    if (length < header + 4)
+        return 0;
+    memcpy(frame->mask, stream + header, 4);
+    header += 4;
+
+    frame->header = header;
+    frame->fin = (stream[0] & 0x80) != 0;
+    frame->rsv = stream[0] & 0x70;
+    frame->opcode = opcode;
+    frame->length = size;
+    frame->offset = 0;
+    return header;
+}
+
+// 生成服务端帧头部（不带掩码），opcode可以带上WS_RSV1，返回头部长度
+int encode_header(char *buffer, int fin, int opcode, unsigned long long length)
+{
+    unsigned char *head = (unsigned char *)buffer;
+    int i;
+
+    head[0] = (fin ? 0x80 : 0) | (opcode & (WS_RSV1 | 0x0F));
+    if (length < 126)
+    {
+        head[1] = length;
+        return 2;
+    }
+    if (length <= 0xFFFF)
+    {
+        head[1] = 126;
+        head[2] = length >> 8;
+        head[3] = length & 0xFF;
+        return 4;
+    }
+    head[1] = 127;
+    for (i = 0; i < 8; ++i)
+        head[2 + i] = (length >> (56 - 8 * i)) & 0xFF;
+    return 10;
+}
+
+// 将原始数据编码成一个完整的数据帧，buffer至少需要length+10个字节
+int encode_packet(char *buffer, int opcode, const char *stream, int length)
+{
+    int size = encode_header(buffer, 1, opcode, length);
+    memcpy(buffer + size, stream, length);
+    return length + size;
+}
+
+// 申请一个引用计数为1的发送缓冲区
+struct ws_buffer *ws_buffer_new(int capacity)
+{
+    struct ws_buffer *b = malloc(sizeof(struct ws_buffer) + capacity);
+    if (b == NULL)
+        return NULL;
+    b->refcount = 1;
+    b->shared = 0;
+    b->length = 0;
+    b->capacity = capacity;
+    return b;
+}
+
+// 把一条消息编码成一个只读的共享帧，之后可以放进任意多个连接的发送队列
+struct ws_buffer *ws_buffer_frame(int opcode, const char *data, int length)
+{
+    struct ws_buffer *b = ws_buffer_new(length + 10);
+    if (b == NULL)
+        return NULL;
+    b->length = encode_packet(b->data, opcode, data, length);
+    b->shared = 1;
+    return b;
+}
+
+// 取出未压缩的帧中的负载
+const char *ws_frame_payload(struct ws_buffer *frame, int *length)
+{
+    int size = frame->data[1] & 0x7F;
+    int header = size == 126 ? 4 : size == 127 ? 10 : 2;
+    *length = frame->length - header;
+    return frame->data + header;
+}
+
+void ws_buffer_ref(struct ws_buffer *b)
+{
+    __atomic_add_fetch(&b->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void ws_buffer_unref(struct ws_buffer *b)
+{
+    if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        free(b);
+}
+
+struct ws_queue_config ws_queue_config = {
+    256 * 1024,
+    64 * 1024,
+    4 * 1024 * 1024,
+    WS_POLICY_DISCONNECT,
+    NULL,
+    0,
+};
+
+// 发送队列的字节数和缓冲区个数变化，同时更新连接和reactor的统计
+static void ws_queue_account(struct conn *c, int bytes, int buffers)
+{
+    struct reactor *r = c->reactor;
+    c->wbytes += bytes;
+    if (c->wbytes > c->wpeak)
+        c->wpeak = c->wbytes;
+    WS_STAT_ADD(r, bytes, bytes);
+    WS_STAT_ADD(r, buffers, buffers);
+    if (c->wbytes > r->stats.peak)
+        __atomic_store_n(&r->stats.peak, c->wbytes, __ATOMIC_RELAXED);
+}
+
+// 把缓冲区放到发送队列末尾，队列持有一个引用
+int ws_queue_push(struct conn *c, struct ws_buffer *b)
+{
+    if (c->wcount == c->wqcapacity)
+    {
+        int capacity = c->wqcapacity ? c->wqcapacity * 2 : 4;
+        struct ws_buffer **queue = malloc(capacity * sizeof(struct ws_buffer *));
+        int i;
+        if (queue == NULL)
+            return -1;
+        for (i = 0; i < c->wcount; ++i) // 按顺序搬到新数组的开头
+            queue[i] = c->wqueue[(c->whead + i) & (c->wqcapacity - 1)];
+        free(c->wqueue);
+        c->wqueue = queue;
+        c->wqcapacity = capacity;
+        c->whead = 0;
+    }
+    ws_buffer_ref(b);
+    c->wqueue[(c->whead + c->wcount) & (c->wqcapacity - 1)] = b;
+    c->wcount++;
+    ws_queue_account(c, b->length, 1);
+    return 0;
+}
+
+// 队首的缓冲区发送完了
+void ws_queue_pop(struct conn *c)
+{
+    struct ws_buffer *b = c->wqueue[c->whead];
+    ws_queue_account(c, -(b->length - c->woffset), -1);
+    ws_buffer_unref(b);
+    c->whead = (c->whead + 1) & (c->wqcapacity - 1);
+    c->wcount--;
+    c->woffset = 0;
+    if (c->wpinned > 0)
+        c->wpinned--;
+}
+
+// 已经发送了sent个字节，弹出发送完的缓冲区
+void ws_queue_consume(struct conn *c, int sent)
+{
+    while (sent > 0)
+    {
+        int remain = c->wqueue[c->whead]->length - c->woffset;
+        if (sent < remain)
         {
-            mask[i] = hdr126->mask_key[i];
+            c->woffset += sent;
+            ws_queue_account(c, -sent, 0);
+            break;
         }
-        start = 8;
+        sent -= remain;
+        ws_queue_pop(c);
     }
-    else if ((hdr->mask & 0x7F) == 127)
+}
+
+// 从队首开始丢弃发布的共享帧，直到再放入length个字节不超过上限；正在发送的帧和连接自己的数据不能丢
+static int ws_queue_drop(struct conn *c, int length)
+{
+    int limit = ws_queue_config.limit;
+    int mask = c->wqcapacity - 1;
+    int i, n = c->wcount, kept = 0;
+
+    for (i = 0; i < n; ++i)
     {
-        nty_websocket_head_127 *hdr127 = (nty_websocket_head_127 *)data;
-        size = hdr127->payload_length;
-        for (i = 0; i < 4; ++i)
+        struct ws_buffer *b = c->wqueue[(c->whead + i) & mask];
+        if (c->wbytes + length > limit && b->shared && i >= c->wpinned && !(i == 0 && c->woffset > 0))
         {
-            mask[i] = hdr127->mask_key[i];
+            ws_queue_account(c, -b->length, -1);
+            ws_buffer_unref(b);
+            c->wdropped++;
+            WS_STAT_ADD(c->reactor, dropped, 1);
+            if (c->session)
+                ws_session_desync(c);
+            continue;
         }
-        start = 14;
+        c->wqueue[(c->whead + kept) & mask] = b;
+        kept++;
+    }
+    c->wcount = kept;
+    return c->wbytes + length > limit ? -1 : 0;
+}
+
+// 发布的帧放入慢消费者的队列之前调用：超过上限时按配置的策略处理，返回-1表示不要放入这一帧
+int ws_queue_admit(struct conn *c, int length)
+{
+    const struct ws_queue_config *config = &ws_queue_config;
+
+    if (c->wbytes + length <= config->limit)
+        return 0;
+    if (config->policy == WS_POLICY_DISCONNECT)
+    {
+        // 正在遍历订阅者，不能在这里释放连接；shutdown之后epoll报告EPOLLHUP，由recv_cb关闭
+        c->status = WS_STATUS_CLOSING;
+        shutdown(c->fd, SHUT_RDWR);
+        WS_STAT_ADD(c->reactor, disconnects, 1);
+        return -1;
     }
-    else // 使用标准头部结构
+    if (config->policy == WS_POLICY_DROP_OLDEST && ws_queue_drop(c, length) == 0)
+        return 0;
+    c->wdropped++;
+    WS_STAT_ADD(c->reactor, dropped, 1);
+    return -1;
+}
+
+// 把连接放进reactor的待发送列表，由reactor_loop在本轮事件结束后或窗口到期时发送；
+// 握手和关闭阶段的数据不等窗口
+static void ws_flush_later(struct conn *c)
+{
+    struct reactor *r = c->reactor;
+    if (c->flush_slot == 0)
     {
-        size = hdr->payload_length;
-        memcpy(mask, data, 4);
-        start = 6;
+        if (r->nflush == r->flush_capacity)
+        {
+            int capacity = r->flush_capacity ? r->flush_capacity * 2 : 64;
+            struct conn **flush = realloc(r->flush, capacity * sizeof(struct conn *));
+            if (flush == NULL)
+            {
+                c->wblocked = 1; // 退回到等EPOLLOUT
+                return;
+            }
+            r->flush = flush;
+            r->flush_capacity = capacity;
+        }
+        r->flush[r->nflush++] = c;
+        c->flush_slot = r->nflush;
+        c->flush_due = r->now + (c->status == WS_STATUS_OPEN ? c->flush_delay : 0);
     }
-    *ret = size;
-    demask(stream + start, size, mask); // 解码
-    return stream + start;
+    if (c->wbytes >= WS_FLUSH_BYTES)
+        c->flush_due = r->now;
 }
 
-// 将原始数据编码成数据包
-int encode_packet(char *buffer, char *mask, char *stream, int length)
+// 根据发送队列更新连接关注的事件：新数据先放进reactor的待发送列表，直接写，socket写满了才等可写；
+// 超过高水位暂停读取，降到低水位恢复。事件没有变化时不调用epoll_ctl
+void ws_update_events(struct conn *c)
 {
-    /* 初始化头部 */
-    nty_ophdr head = {0};
-    head.fin = 1;
-    head.opcode = 1;
-    int size = 0;
+    const struct ws_queue_config *config = &ws_queue_config;
+    struct reactor *r = c->reactor;
+    int events = 0;
 
-    if (length < 126) // <126 使用基本头部
+    if (c->wcount > 0)
+    {
+        if (!c->wblocked)
+            ws_flush_later(c);
+        if (c->wblocked)
+            events |= EPOLLOUT;
+    }
+    if (!c->paused && c->wbytes >= config->high_watermark)
     {
-        head.payload_length = length;
-        memcpy(buffer, &head, sizeof(nty_ophdr));
-        size = 2;
+        c->paused = 1;
+        WS_STAT_ADD(r, paused, 1);
+        WS_STAT_ADD(r, pauses, 1);
+        if (config->backpressure)
+            config->backpressure(c, 1);
     }
-    else if (length < 0xffff) // 使用nty_websocket_head_126扩展头部
+    else if (c->paused && c->wbytes <= config->low_watermark)
     {
-        nty_websocket_head_126 hdr = {0};
-        hdr.payload_length = length;
-        memcpy(hdr.mask_key, mask, 4);
+        c->paused = 0;
+        WS_STAT_ADD(r, paused, -1);
+        if (config->backpressure)
+            config->backpressure(c, 0);
+    }
+    if (!c->paused)
+        events |= EPOLLIN;
+    // TLS的读写可能要等相反方向的事件
+    if (c->tls_flags & WS_TLS_READ_WANTS_WRITE)
+        events |= EPOLLOUT;
+    if (c->tls_flags & WS_TLS_WRITE_WANTS_READ)
+        events |= EPOLLIN;
 
-        memcpy(buffer, &head, sizeof(nty_ophdr));
-        memcpy(buffer + sizeof(nty_ophdr), &hdr, sizeof(nty_websocket_head_126));
-        size = sizeof(nty_websocket_head_126);
+    if (events != c->events)
+    {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+        WS_STAT_ADD(r, epoll_mods, 1);
     }
-    else // 使用nty_websocket_head_127扩展头部
+}
+
+// 返回队尾还能再写入length个字节的私有缓冲区，没有就新建一个
+struct ws_buffer *ws_reserve(struct conn *c, int length)
+{
+    struct ws_buffer *b;
+    if (c->wcount > 0)
     {
-        nty_websocket_head_127 hdr = {0};
-        hdr.payload_length = length;
-        memcpy(hdr.mask_key, mask, 4);
-        memcpy(buffer, &head, sizeof(nty_ophdr));
-        memcpy(buffer + sizeof(nty_ophdr), &hdr, sizeof(nty_websocket_head_127));
-        size = sizeof(nty_websocket_head_127);
+        b = c->wqueue[(c->whead + c->wcount - 1) & (c->wqcapacity - 1)];
+        if (!b->shared && b->capacity - b->length >= length)
+            return b;
     }
-    memcpy(buffer + size, stream, length);
-    return length + size;
+
+    b = ws_buffer_new(length > BUFFER_LENGTH ? length : BUFFER_LENGTH);
+    if (b == NULL)
+        return NULL;
+    if (ws_queue_push(c, b) < 0)
+    {
+        free(b);
+        return NULL;
+    }
+    ws_buffer_unref(b); // 只由队列持有
+    return b;
+}
+
+// 在ws_reserve返回的缓冲区末尾写入了length个字节
+void ws_commit(struct conn *c, struct ws_buffer *b, int length)
+{
+    b->length += length;
+    ws_queue_account(c, length, 0);
 }
 
-#define WEBSOCK_KEY_LENGTH 19
+static int ws_append(struct conn *c, const char *data, int length)
+{
+    struct ws_buffer *b = ws_reserve(c, length);
+    if (b == NULL)
+        return -1;
+    memcpy(b->data + b->length, data, length);
+    ws_commit(c, b, length);
+    return length;
+}
+
+// 将一个完整的帧追加到发送队列；协商了permessage-deflate时数据帧先压缩。不记入断线重连的会话
+int ws_encode(struct conn *c, int opcode, const char *data, int length)
+{
+    if (c->deflate && opcode < WS_OPCODE_CLOSE && length >= WS_DEFLATE_MIN)
+    {
+        char *out;
+        int size = ws_deflate_message(c->deflate, data, length, &out);
+        if (size >= 0)
+        {
+            data = out;
+            length = size;
+            opcode |= WS_RSV1;
+        }
+    }
+
+    struct ws_buffer *b = ws_reserve(c, length + 10);
+    if (b == NULL)
+        return -1;
+    length = encode_packet(b->data + b->length, opcode, data, length);
+    ws_commit(c, b, length);
+    WS_STAT_ADD(c->reactor, frames, 1);
+    return length;
+}
 
-// 握手
+// 发送一条消息；启用了断线重连时数据消息另外编码一份未压缩的帧留给会话补发
+int ws_send(struct conn *c, int opcode, const char *data, int length)
+{
+    int ret = ws_encode(c, opcode, data, length);
+    if (ret >= 0 && c->session && opcode < WS_OPCODE_CLOSE)
+    {
+        struct ws_buffer *frame = ws_buffer_frame(opcode, data, length);
+        if (frame)
+        {
+            ws_session_record(c, frame);
+            ws_buffer_unref(frame);
+        }
+        else
+        {
+            ws_session_desync(c);
+        }
+    }
+    return ret;
+}
+
+// 发送关闭帧，发送完后关闭连接
+static void ws_close(struct conn *c, int code)
+{
+    char payload[2];
+    payload[0] = (code >> 8) & 0xFF;
+    payload[1] = code & 0xFF;
+    ws_send(c, WS_OPCODE_CLOSE, payload, 2);
+    c->status = WS_STATUS_CLOSING;
+}
+
+// 处理连接上的一个HTTP请求：Upgrade: websocket的请求完成握手，生成101响应；其他请求交给ws_http_serve路由
+// 返回消耗的字节数，数据不完整返回0，需要在发送完响应后关闭连接时返回-1
 int handshark(struct conn *c)
 {
-    char linebuf[1024] = {0};
-    int idx = 0;
-    char sec_data[128] = {0}; // 存储SHA1加密后的数据
-    char sec_accept[32] = {0}; // 存储Base64编码后的数据
-    do
-    {
-        memset(linebuf, 0, 1024);
-        idx = readline(c->rbuffer, idx, linebuf);
-        if (strstr(linebuf, "Sec-WebSocket-Key")) // 如果当前行包含"Sec-WebSocket-Key"
-        {
-            strcat(linebuf, GUID); // 将GUID附加到Sec-WebSocket-Key中
-            SHA1(linebuf + WEBSOCK_KEY_LENGTH, strlen(linebuf + WEBSOCK_KEY_LENGTH), sec_data); // 进行SHA1
-            base64_encode(sec_data, strlen(sec_data), sec_accept); // 进行Base64编码
-            memset(c->wbuffer, 0, BUFFER_LENGTH);
-            // 构建响应报文
-            c->wlength = sprintf(c->wbuffer, "HTTP/1.1 101 Switching Protocols\r\n"
-                                             "Upgrade: websocket\r\n"
-                                             "Connection: Upgrade\r\n"
-                                             "Sec-WebSocket-Accept: %s\r\n\r\n",
-                                 sec_accept);
-            printf("ws response : %s\n", c->wbuffer);
-            break;
+    int used = ws_parse_handshake(&c->hs, c->rbuffer, c->rlength);
+    if (used > 0 && !ws_has_token(c->rbuffer, c->hs.upgrade, "websocket"))
+        return ws_http_serve(c, used);
+    if (used < 0 || (used > 0 && !ws_valid_upgrade(&c->hs, c->rbuffer)))
+    {
+        static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\n"
+                                          "Connection: close\r\n"
+                                          "Content-Length: 0\r\n\r\n";
+        ws_append(c, bad_request, sizeof(bad_request) - 1);
+        return -1;
+    }
+    if (used == 0)
+    {
+        if (c->rlength >= WS_MAX_HEADER) // 请求头太大
+        {
+            static const char too_large[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                                            "Connection: close\r\n"
+                                            "Content-Length: 0\r\n\r\n";
+            ws_append(c, too_large, sizeof(too_large) - 1);
+            return -1;
         }
-    } while ((c->rbuffer[idx] != '\r' || c->rbuffer[idx + 1] != '\n') && idx != -1);
+        return 0;
+    }
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Upgrade: websocket\r\n"
+                                    "Connection: Upgrade\r\n"
+                                    "Sec-WebSocket-Accept: ";
+    static const char extensions[] = "\r\nSec-WebSocket-Extensions: ";
+    char deflate[160];
+    int dlength = 0;
+    if (c->hs.extensions.length > 0)
+        dlength = ws_deflate_negotiate(c, c->rbuffer + c->hs.extensions.offset, c->hs.extensions.length, deflate, sizeof(deflate));
+
+    struct ws_buffer *b = ws_reserve(c, sizeof(switching) - 1 + WS_ACCEPT_LENGTH + sizeof(extensions) + dlength + 4);
+    if (b == NULL)
+        return -1;
+
+    // 构建响应报文，直接写入发送缓冲区
+    char *response = b->data + b->length;
+    int length = sizeof(switching) - 1;
+    memcpy(response, switching, length);
+    length += ws_accept_key(c->rbuffer + c->hs.key.offset, c->hs.key.length, response + length);
+    if (dlength > 0)
+    {
+        memcpy(response + length, extensions, sizeof(extensions) - 1);
+        length += sizeof(extensions) - 1;
+        memcpy(response + length, deflate, dlength);
+        length += dlength;
+    }
+    memcpy(response + length, "\r\n\r\n", 4);
+    length += 4;
+    ws_commit(c, b, length);
+    WS_DEBUG("fd %d response: %.*s", c->fd, length, response);
+    c->status = WS_STATUS_OPEN;
+    ws_session_open(c, c->rbuffer + c->hs.path.offset, c->hs.path.length);
+    return used;
+}
+
+// 丢弃rbuffer中已处理的length个字节
+static void ws_consume(struct conn *c, int length)
+{
+    memmove(c->rbuffer, c->rbuffer + length, c->rlength - length);
+    c->rlength -= length;
+}
+
+// 把一段数据帧负载追加到分片消息缓冲区
+static int ws_message_append(struct conn *c, const char *data, int length)
+{
+    if (c->mlength + length > c->mcapacity)
+    {
+        unsigned long long capacity = c->mcapacity ? c->mcapacity : BUFFER_LENGTH;
+        char *buffer;
+        while (capacity < c->mlength + length)
+            capacity *= 2;
+        buffer = realloc(c->message, capacity);
+        if (buffer == NULL)
+            return -1;
+        c->message = buffer;
+        c->mcapacity = capacity;
+    }
+    memcpy(c->message + c->mlength, data, length);
+    c->mlength += length;
     return 0;
 }
 
-// 处理接收到的请求，根据连接状态进行握手和数据解码
-int ws_request(struct conn *c)
+// STATS命令：返回这个连接和所有reactor的发送队列统计，JSON格式
+static int ws_stats_request(struct conn *c, const char *data, int length)
 {
-    printf("request: %s\n", c->rbuffer);
+    struct ws_stats total = {0};
+    char response[1024];
+    int i, n;
 
-    if (c->status == 0)
+    if (length != 5 || memcmp(data, "STATS", 5) != 0)
+        return 0;
+    for (i = 0; i < reactor_count; ++i)
     {
-        handshark(c);
-        c->status = 1;
+        struct reactor *r = &reactors[i];
+        long long peak = WS_STAT_GET(r, peak);
+        total.connections += WS_STAT_GET(r, connections);
+        total.bytes += WS_STAT_GET(r, bytes);
+        total.buffers += WS_STAT_GET(r, buffers);
+        total.paused += WS_STAT_GET(r, paused);
+        total.pauses += WS_STAT_GET(r, pauses);
+        total.dropped += WS_STAT_GET(r, dropped);
+        total.disconnects += WS_STAT_GET(r, disconnects);
+        total.pings += WS_STAT_GET(r, pings);
+        total.pongs += WS_STAT_GET(r, pongs);
+        total.timeouts += WS_STAT_GET(r, timeouts);
+        total.idle += WS_STAT_GET(r, idle);
+        total.tls_handshakes += WS_STAT_GET(r, tls_handshakes);
+        total.tls_resumed += WS_STAT_GET(r, tls_resumed);
+        total.ktls += WS_STAT_GET(r, ktls);
+        total.resumed += WS_STAT_GET(r, resumed);
+        total.replayed += WS_STAT_GET(r, replayed);
+        total.frames += WS_STAT_GET(r, frames);
+        total.writes += WS_STAT_GET(r, writes);
+        total.epoll_mods += WS_STAT_GET(r, epoll_mods);
+        if (peak > total.peak)
+            total.peak = peak;
     }
-    else if (c->status == 1)
+    n = snprintf(response, sizeof(response),
+                 "{\"conn\":{\"queued_bytes\":%d,\"queued_buffers\":%d,\"peak_bytes\":%d,\"dropped\":%d,\"paused\":%d,"
+                 "\"rtt_us\":%d,\"srtt_us\":%d,\"flush_delay_ms\":%d},"
+                 "\"server\":{\"connections\":%lld,\"queued_bytes\":%lld,\"queued_buffers\":%lld,\"peak_bytes\":%lld,"
+                 "\"paused\":%lld,\"pauses\":%lld,\"dropped\":%lld,\"disconnects\":%lld,"
+                 "\"pings\":%lld,\"pongs\":%lld,\"timeouts\":%lld,\"idle\":%lld,"
+                 "\"tls_handshakes\":%lld,\"tls_resumed\":%lld,\"ktls\":%lld,\"resumed\":%lld,\"replayed\":%lld,"
+                 "\"frames\":%lld,\"writes\":%lld,\"epoll_mods\":%lld}}",
+                 c->wbytes, c->wcount, c->wpeak, c->wdropped, c->paused, c->rtt, c->srtt, c->flush_delay,
+                 total.connections, total.bytes, total.buffers, total.peak,
+                 total.paused, total.pauses, total.dropped, total.disconnects,
+                 total.pings, total.pongs, total.timeouts, total.idle,
+                 total.tls_handshakes, total.tls_resumed, total.ktls, total.resumed, total.replayed,
+                 total.frames, total.writes, total.epoll_mods);
+    ws_send(c, WS_OPCODE_TEXT, response, n);
+    return 1;
+}
+
+struct ws_handler ws_handler = {
+    NULL,
+    NULL,
+    0,
+};
+
+// 收到一条完整的消息，订阅/发布命令交给pubsub处理（应用可以用no_commands关掉），其他消息交给应用，没有应用处理时回显给客户端
+static void ws_message(struct conn *c, int opcode, const char *data, int length)
+{
+    c->mactive = c->reactor->now;
+    if (c->mcompressed)
     {
-        char mask[4] = {0};
-        int ret = 0;
-        c->payload = decode_packet(c->rbuffer, c->mask, c->rlength, &ret);
-        printf("data : %s , length : %d\n", c->payload, ret);
-        c->wlength = ret;
-        c->status = 2;
+        char *out;
+        c->mcompressed = 0;
+        length = ws_inflate_message(c->deflate, data, length, &out);
+        if (length < 0)
+        {
+            ws_close(c, length == -2 ? WS_CLOSE_TOO_BIG : WS_CLOSE_INVALID_DATA);
+            return;
+        }
+        data = out;
+
+        // 压缩的文本消息解压后整体校验
+        struct ws_utf8 utf8 = {0};
+        if (opcode == WS_OPCODE_TEXT && (utf8_validate(&utf8, data, length) < 0 || utf8.need))
+        {
+            ws_close(c, WS_CLOSE_INVALID_DATA);
+            return;
+        }
     }
-    return 0;
+
+    WS_DEBUG("fd %d message: %.*s, length: %d", c->fd, length, data, length);
+    if (opcode == WS_OPCODE_TEXT && !ws_handler.no_commands &&
+        (ws_stats_request(c, data, length) || pubsub_request(c, data, length)))
+        return;
+    if (ws_handler.message && ws_handler.message(c, opcode, data, length))
+        return;
+    ws_send(c, opcode, data, length);
 }
 
-// 处理要发送的响应，根据连接状态进行数据编码
-int ws_response(struct conn *c)
+struct ws_keepalive_config ws_keepalive_config = {
+    10 * 1000,
+    30 * 1000,
+    10 * 1000,
+    0,
+};
+
+static unsigned long long now_us(void)
 {
-    if (c->status == 2)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// 发送ping，负载是发送时间，用于在pong中计算往返时间
+static void ws_ping(struct conn *c)
+{
+    c->ping = now_us();
+    ws_send(c, WS_OPCODE_PING, (const char *)&c->ping, sizeof(c->ping));
+    ws_update_events(c);
+    WS_STAT_ADD(c->reactor, pings, 1);
+}
+
+// 只统计对应最近一次ping的pong，客户端主动发送的pong是单向心跳，忽略
+static void ws_pong(struct conn *c, const char *data, int length)
+{
+    int rtt;
+    if (c->ping == 0 || length != sizeof(c->ping) || memcmp(data, &c->ping, length) != 0)
+        return;
+    rtt = now_us() - c->ping;
+    c->rtt = rtt;
+    c->srtt = c->srtt ? (c->srtt * 7 + rtt) / 8 : rtt; // 和TCP一样的平滑系数
+    c->ping = 0;
+    WS_STAT_ADD(c->reactor, pongs, 1);
+}
+
+// 连接的定时器到期：返回下一次到期的时间（毫秒），返回-1表示应该关闭连接
+// 收到数据时只更新active，不移动定时器，到期时再根据active计算真正的期限
+long long ws_timeout(struct conn *c, unsigned long long now)
+{
+    const struct ws_keepalive_config *config = &ws_keepalive_config;
+    unsigned long long deadline;
+
+    if (c->status == WS_STATUS_HANDSHAKE)
+    {
+        // 保持连接的HTTP请求每处理一个重新计时
+        deadline = c->mactive + config->handshake_timeout;
+        if (config->handshake_timeout == 0)
+            return now + WS_WHEEL_SIZE * WS_TICK_MS;
+        if (now < deadline)
+            return deadline;
+        WS_STAT_ADD(c->reactor, timeouts, 1);
+        return -1;
+    }
+
+    // 对方不读数据时发送队列永远发不完，等待关闭也要有期限
+    if (c->status == WS_STATUS_CLOSING)
     {
-        c->wlength = encode_packet(c->wbuffer, c->mask, c->payload, c->wlength);
-        c->status = 1;
+        if (c->closing == 0)
+            c->closing = now;
+        deadline = c->closing + (config->pong_timeout ? config->pong_timeout : 1000);
+        if (now < deadline)
+            return deadline;
+        WS_STAT_ADD(c->reactor, timeouts, 1);
+        return -1;
     }
-    return 0;
+
+    if (config->idle_timeout && now >= c->mactive + config->idle_timeout)
+    {
+        ws_close(c, WS_CLOSE_GOING_AWAY);
+        ws_update_events(c);
+        WS_STAT_ADD(c->reactor, idle, 1);
+        c->closing = now;
+        return now + (config->pong_timeout ? config->pong_timeout : 1000);
+    }
+
+    deadline = now + WS_WHEEL_SIZE * WS_TICK_MS;
+    if (c->ping)
+    {
+        // ping之后收到过任何数据都说明连接还活着
+        unsigned long long sent = c->ping / 1000;
+        if (c->active >= sent)
+            c->ping = 0;
+        else if (now >= sent + config->pong_timeout)
+        {
+            WS_STAT_ADD(c->reactor, timeouts, 1);
+            return -1;
+        }
+        else
+            deadline = sent + config->pong_timeout;
+    }
+    if (c->ping == 0 && config->ping_interval)
+    {
+        if (now >= c->active + config->ping_interval)
+        {
+            ws_ping(c);
+            deadline = now + config->pong_timeout;
+        }
+        else
+            deadline = c->active + config->ping_interval;
+    }
+    if (config->idle_timeout && c->mactive + config->idle_timeout < deadline)
+        deadline = c->mactive + config->idle_timeout;
+    return deadline;
+}
+
+// 关闭帧里的状态码是否允许出现（RFC 6455 7.4），1004/1005/1006/1015只能在本地使用
+static int ws_close_code_valid(int code)
+{
+    if (code >= 1000 && code <= 1003)
+        return 1;
+    if (code >= 1007 && code <= 1014)
+        return 1;
+    return code >= 3000 && code <= 4999;
+}
+
+// 处理一个完整的控制帧
+static void ws_control(struct conn *c, int opcode, const char *data, int length)
+{
+    if (opcode == WS_OPCODE_PING)
+    {
+        ws_send(c, WS_OPCODE_PONG, data, length);
+    }
+    else if (opcode == WS_OPCODE_PONG)
+    {
+        ws_pong(c, data, length);
+    }
+    else if (opcode == WS_OPCODE_CLOSE)
+    {
+        struct ws_utf8 utf8 = {0};
+        if (length == 1 || (length >= 2 && !ws_close_code_valid(((unsigned char)data[0] << 8) | (unsigned char)data[1])))
+        {
+            ws_close(c, WS_CLOSE_PROTOCOL_ERROR);
+            return;
+        }
+        // 状态码后面的原因必须是UTF-8
+        if (length > 2 && (utf8_validate(&utf8, data + 2, length - 2) < 0 || utf8.need))
+        {
+            ws_close(c, WS_CLOSE_INVALID_DATA);
+            return;
+        }
+        // 回复关闭帧，带上对方的状态码
+        ws_send(c, WS_OPCODE_CLOSE, data, length < 2 ? 0 : 2);
+        c->status = WS_STATUS_CLOSING;
+    }
+}
+
+// 处理rbuffer中的帧，负载可以分多次到达；返回已处理的字节数
+static int ws_frames(struct conn *c)
+{
+    struct ws_frame *frame = &c->frame;
+    int pos = 0;
+
+    while (c->status == WS_STATUS_OPEN)
+    {
+        if (frame->header == 0)
+        {
+            int used = decode_packet(frame, (const unsigned char *)c->rbuffer + pos, c->rlength - pos);
+            if (used < 0)
+            {
+                ws_close(c, WS_CLOSE_PROTOCOL_ERROR);
+                break;
+            }
+            if (used == 0)
+                break;
+            pos += used;
+
+            if (frame->opcode < WS_OPCODE_CLOSE)
+            {
+                // 续帧必须跟在未结束的消息后面，新消息不能插在分片中间
+                if ((frame->opcode == WS_OPCODE_CONTINUATION) != (c->mopcode != 0))
+                {
+                    ws_close(c, WS_CLOSE_PROTOCOL_ERROR);
+                    break;
+                }
+                if (c->mlength + frame->length > WS_MAX_MESSAGE)
+                {
+                    ws_close(c, WS_CLOSE_TOO_BIG);
+                    break;
+                }
+                // RSV1只能出现在压缩消息的第一帧上
+                if (frame->rsv && (c->deflate == NULL || frame->opcode == WS_OPCODE_CONTINUATION))
+                {
+                    ws_close(c, WS_CLOSE_PROTOCOL_ERROR);
+                    break;
+                }
+                if (frame->opcode != WS_OPCODE_CONTINUATION)
+                {
+                    c->mopcode = frame->opcode;
+                    c->mcompressed = frame->rsv != 0;
+                }
+            }
+        }
+
+        unsigned long long avail = c->rlength - pos;
+        unsigned long long remain = frame->length - frame->offset;
+        char *data = c->rbuffer + pos;
+
+        if (frame->opcode >= WS_OPCODE_CLOSE)
+        {
+            // 控制帧不超过125字节，等负载全部到达再处理
+            if (avail < remain)
+                break;
+            demask(data, remain, frame->mask, 0);
+            pos += remain;
+            frame->header = 0;
+            ws_control(c, frame->opcode, data, remain);
+            continue;
+        }
+
+        int length = (int)(avail < remain ? avail : remain);
+        int last = (unsigned long long)length == remain; // 本段是否到达帧尾
+        if (length == 0 && remain != 0)
+            break;
+        demask(data, length, frame->mask, frame->offset);
+
+        // 未压缩的文本消息每收到一段就校验，截断的字符留到下一段，不必等整条消息
+        if (c->mopcode == WS_OPCODE_TEXT && !c->mcompressed &&
+            (utf8_validate(&c->utf8, data, length) < 0 || (frame->fin && last && c->utf8.need)))
+        {
+            ws_close(c, WS_CLOSE_INVALID_DATA);
+            break;
+        }
+
+        if (frame->fin && frame->offset == 0 && last && c->mlength == 0)
+        {
+            // 整条消息都在rbuffer中，直接使用，不拷贝
+            ws_message(c, c->mopcode, data, length);
+            c->mopcode = 0;
+        }
+        else
+        {
+            if (ws_message_append(c, data, length) < 0)
+            {
+                ws_close(c, WS_CLOSE_TOO_BIG);
+                break;
+            }
+            if (frame->fin && last)
+            {
+                ws_message(c, c->mopcode, c->message, c->mlength);
+                c->mlength = 0;
+                c->mopcode = 0;
+                if (c->mcapacity > WS_KEEP_BUFFER)
+                {
+                    free(c->message);
+                    c->message = NULL;
+                    c->mcapacity = 0;
+                }
+            }
+        }
+
+        pos += length;
+        frame->offset += length;
+        if (frame->offset == frame->length)
+            frame->header = 0;
+    }
+    return pos;
+}
+
+// 处理接收到的请求，根据连接状态进行握手和数据解码
+// 返回-1表示需要在发送完队列中的数据后关闭连接
+int ws_request(struct conn *c)
+{
+    WS_DEBUG("fd %d request: %.*s", c->fd, c->rlength, c->rbuffer);
+
+    // 保持连接的HTTP请求可以连续到达（pipelining），按顺序处理，直到升级为websocket或数据不完整
+    while (c->status == WS_STATUS_HANDSHAKE)
+    {
+        int used = handshark(c);
+        if (used < 0)
+        {
+            c->status = WS_STATUS_CLOSING;
+            return -1;
+        }
+        if (used == 0)
+            return 0;
+        ws_consume(c, used);
+        if (c->status == WS_STATUS_HANDSHAKE)
+            memset(&c->hs, 0, sizeof(c->hs));
+    }
+    if (c->status == WS_STATUS_OPEN)
+        ws_consume(c, ws_frames(c));
+
+    return c->status == WS_STATUS_CLOSING ? -1 : 0;
+}
+
+// 释放连接上的缓冲区
+void ws_release(struct conn *c)
+{
+    if (ws_handler.release)
+        ws_handler.release(c);
+    pubsub_release(c);
+    ws_session_release(c);
+    ws_deflate_release(c);
+    while (c->wcount > 0)
+        ws_queue_pop(c);
+    if (c->paused)
+        WS_STAT_ADD(c->reactor, paused, -1);
+    c->paused = 0;
+    free(c->wqueue);
+    free(c->rbuffer);
+    free(c->message);
+    c->wqueue = NULL;
+    c->rbuffer = NULL;
+    c->message = NULL;
+    c->whead = c->wqcapacity = 0;
+    c->rlength = c->rcapacity = 0;
+    c->mlength = c->mcapacity = 0;
 }